@@ -0,0 +1,469 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "buffer_cache.h"
+
+/*
+ * Sweeps record size, producer count, buffer size and count and codec,
+ * writing total_mb per combination, and prints a line of CSV (or JSON with
+ * -j) for each: throughput, compression ratio, the latency of
+ * buffer_cache_write() and the time producers spent waiting for empty
+ * buffers. Codec "write" is the baseline: a write(2) per record.
+ */
+
+#define MAX_LIST	16
+#define PATTERN_SZ	(4 * 1024 * 1024)
+
+/*
+ * Latency histogram: exact below 16ns, then 16 buckets per power of two,
+ * for an error of at most 1/16.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(64 << HIST_SUB_BITS)
+
+#define CODEC_WRITE	-1
+
+struct codec {
+	const char	*name;
+	int		compress;
+};
+
+static const struct codec codecs[] = {
+	{ "write",	CODEC_WRITE },
+	{ "none",	BC_COMP_NONE },
+#ifndef _WITHOUT_LZ4
+	{ "lz4",	BC_COMP_LZ4 },
+#endif
+#ifdef _WITH_ZLIB
+	{ "zlib",	BC_COMP_ZLIB },
+#endif
+#ifdef _WITH_ZSTD
+	{ "zstd",	BC_COMP_ZSTD },
+#endif
+};
+
+struct run {
+	const char	*file;
+	int		compress;
+	size_t		rec_size;
+	size_t		producers;
+	size_t		buffer_mb;
+	size_t		buffer_cnt;
+	size_t		workers;
+	uint64_t	total;
+	struct buffer_cache_ctx *bc;
+	int		fd;
+	pthread_barrier_t barrier;
+};
+
+struct producer {
+	struct run	*run;
+	pthread_t	thr;
+	uint64_t	hist[HIST_BUCKETS];
+	uint64_t	max_ns;
+};
+
+static unsigned char *pattern;
+
+static
+uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static
+size_t
+hist_idx(uint64_t v)
+{
+	int msb;
+
+	if (v < HIST_SUB)
+		return (size_t)v;
+
+	msb = 63 - __builtin_clzll(v);
+	return ((size_t)(msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+	    ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static
+uint64_t
+hist_val(size_t idx)
+{
+	int msb;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	msb = (int)(idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB | (idx & (HIST_SUB - 1))) <<
+	    (msb - HIST_SUB_BITS);
+}
+
+static
+uint64_t
+hist_pct(const uint64_t *hist, uint64_t n, double q)
+{
+	uint64_t want, seen = 0;
+	size_t i;
+
+	want = (uint64_t)(q * (double)n + 0.999999);
+	if (want == 0)
+		want = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= want)
+			return hist_val(i);
+	}
+
+	return 0;
+}
+
+/*
+ * Something that compresses about as well as log lines: words from a
+ * small vocabulary, with numbers in between.
+ */
+static
+void
+make_pattern(void)
+{
+	static const char *words[] = {
+		"GET ", "POST ", "/index.html ", "/api/v1/items ", "200 ",
+		"404 ", "user=", "session=", "took ", "ms ", "ok ", "error ",
+		"retry ", "cache ", "miss ", "hit ", "\n",
+	};
+	size_t i = 0, len;
+	unsigned int x = 12345;
+
+	pattern = malloc(PATTERN_SZ);
+	assert (pattern != NULL);
+
+	while (i < PATTERN_SZ) {
+		x = x * 1103515245 + 12345;
+		if ((x >> 16) % 4 == 0) {
+			len = (size_t)snprintf((char *)pattern + i,
+			    PATTERN_SZ - i, "%u ", x % 100000);
+		} else {
+			const char *w = words[(x >> 16) % (sizeof(words) / sizeof(words[0]))];
+
+			len = strlen(w);
+			if (len > PATTERN_SZ - i)
+				len = PATTERN_SZ - i;
+			memcpy(pattern + i, w, len);
+		}
+		i += len;
+	}
+}
+
+static
+void *
+producer_thr(void *arg)
+{
+	struct producer *p = arg;
+	struct run *run = p->run;
+	uint64_t n, i, t0, t1, off = 0;
+	ssize_t ssz;
+	int r;
+
+	n = run->total / run->rec_size / run->producers;
+
+	pthread_barrier_wait(&run->barrier);
+
+	for (i = 0; i < n; i++) {
+		off += 4099;
+		if (off > PATTERN_SZ - run->rec_size)
+			off %= PATTERN_SZ - run->rec_size;
+
+		t0 = now_ns();
+		if (run->compress == CODEC_WRITE) {
+			ssz = write(run->fd, pattern + off, run->rec_size);
+			assert (ssz == (ssize_t)run->rec_size);
+		} else {
+			r = buffer_cache_write(run->bc, pattern + off,
+			    run->rec_size);
+			assert (r == 0);
+		}
+		t1 = now_ns();
+
+		++p->hist[hist_idx(t1 - t0)];
+		if (t1 - t0 > p->max_ns)
+			p->max_ns = t1 - t0;
+	}
+
+	return NULL;
+}
+
+static
+int
+do_run(struct run *run, const char *codec, int json)
+{
+	static int header;
+	struct buffer_cache_opts opts;
+	struct producer *prods;
+	uint64_t hist[HIST_BUCKETS], recs, bytes, max_ns = 0;
+	uint64_t waits = 0, wait_ns = 0, t0, t1;
+	struct stat st;
+	double secs;
+	size_t i, j;
+	int r = 0;
+
+	run->bc = NULL;
+	run->fd = -1;
+
+	if (run->compress == CODEC_WRITE) {
+		run->fd = open(run->file, O_WRONLY | O_CREAT | O_TRUNC, 00666);
+		if (run->fd < 0) {
+			perror(run->file);
+			return 1;
+		}
+	} else {
+		buffer_cache_opts_init(&opts);
+		opts.compress = run->compress;
+		opts.buffer_size_mb = run->buffer_mb;
+		opts.buffer_cnt = run->buffer_cnt;
+		opts.comp_workers = run->workers;
+		if (run->producers > 1)
+			opts.flags |= BC_OPT_MULTI_PRODUCER;
+
+		run->bc = buffer_cache_init_opts(run->file, &opts);
+		if (run->bc == NULL)
+			return 1;
+	}
+
+	prods = calloc(run->producers, sizeof(*prods));
+	assert (prods != NULL);
+
+	pthread_barrier_init(&run->barrier, NULL, (unsigned)run->producers + 1);
+	for (i = 0; i < run->producers; i++) {
+		prods[i].run = run;
+		pthread_create(&prods[i].thr, NULL, producer_thr, &prods[i]);
+	}
+
+	pthread_barrier_wait(&run->barrier);
+	t0 = now_ns();
+
+	for (i = 0; i < run->producers; i++)
+		pthread_join(prods[i].thr, NULL);
+
+	if (run->bc != NULL) {
+		buffer_cache_waits(run->bc, &waits, &wait_ns);
+		r = buffer_cache_destroy(run->bc);
+	} else {
+		r = close(run->fd);
+	}
+	t1 = now_ns();
+	pthread_barrier_destroy(&run->barrier);
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < run->producers; i++) {
+		for (j = 0; j < HIST_BUCKETS; j++)
+			hist[j] += prods[i].hist[j];
+		if (prods[i].max_ns > max_ns)
+			max_ns = prods[i].max_ns;
+	}
+	free(prods);
+
+	/* Not a result if the output didn't make it out */
+	if (r != 0) {
+		perror(run->file);
+		return 1;
+	}
+
+	recs = run->total / run->rec_size / run->producers * run->producers;
+	bytes = recs * run->rec_size;
+	secs = (double)(t1 - t0) / 1e9;
+	if (stat(run->file, &st) != 0 || st.st_size == 0)
+		st.st_size = 1;
+
+	if (json) {
+		printf("{\"codec\":\"%s\",\"record_size\":%zu,\"producers\":%zu,"
+		    "\"buffer_mb\":%zu,\"buffer_cnt\":%zu,\"workers\":%zu,"
+		    "\"bytes\":%ju,\"records\":%ju,\"secs\":%.6f,"
+		    "\"mb_s\":%.2f,\"rec_s\":%.0f,\"ratio\":%.3f,"
+		    "\"p50_ns\":%ju,\"p99_ns\":%ju,\"p999_ns\":%ju,"
+		    "\"max_ns\":%ju,\"waits\":%ju,\"wait_ms\":%.3f}\n",
+		    codec, run->rec_size, run->producers, run->buffer_mb,
+		    run->buffer_cnt, run->workers, (uintmax_t)bytes,
+		    (uintmax_t)recs, secs, (double)bytes / secs / 1e6,
+		    (double)recs / secs, (double)bytes / (double)st.st_size,
+		    (uintmax_t)hist_pct(hist, recs, 0.5),
+		    (uintmax_t)hist_pct(hist, recs, 0.99),
+		    (uintmax_t)hist_pct(hist, recs, 0.999), (uintmax_t)max_ns,
+		    (uintmax_t)waits, (double)wait_ns / 1e6);
+	} else {
+		if (!header) {
+			printf("codec,record_size,producers,buffer_mb,buffer_cnt,"
+			    "workers,bytes,records,secs,mb_s,rec_s,ratio,p50_ns,"
+			    "p99_ns,p999_ns,max_ns,waits,wait_ms\n");
+			header = 1;
+		}
+		printf("%s,%zu,%zu,%zu,%zu,%zu,%ju,%ju,%.6f,%.2f,%.0f,%.3f,"
+		    "%ju,%ju,%ju,%ju,%ju,%.3f\n",
+		    codec, run->rec_size, run->producers, run->buffer_mb,
+		    run->buffer_cnt, run->workers, (uintmax_t)bytes,
+		    (uintmax_t)recs, secs, (double)bytes / secs / 1e6,
+		    (double)recs / secs, (double)bytes / (double)st.st_size,
+		    (uintmax_t)hist_pct(hist, recs, 0.5),
+		    (uintmax_t)hist_pct(hist, recs, 0.99),
+		    (uintmax_t)hist_pct(hist, recs, 0.999), (uintmax_t)max_ns,
+		    (uintmax_t)waits, (double)wait_ns / 1e6);
+	}
+	fflush(stdout);
+
+	return 0;
+}
+
+static
+size_t
+parse_list(const char *arg, size_t *list)
+{
+	char *end;
+	size_t n = 0;
+
+	while (*arg != '\0' && n < MAX_LIST) {
+		list[n] = (size_t)strtoul(arg, &end, 10);
+		if (end == arg || list[n] == 0) {
+			fprintf(stderr, "Bad list: %s\n", arg);
+			exit(1);
+		}
+		++n;
+		arg = (*end == ',') ? end + 1 : end;
+	}
+
+	return n;
+}
+
+static
+void
+usage(void)
+{
+	size_t i;
+
+	fprintf(stderr, "usage: bench_bc [-j] [-k] [-f file] [-m total_mb] "
+	    "[-r rec_sizes] [-p producers]\n"
+	    "                [-b buffer_mbs] [-n buffer_cnts] "
+	    "[-w workers] [-c codecs]\n"
+	    "Lists are comma separated. Codecs:");
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		fprintf(stderr, " %s", codecs[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[]) {
+	size_t rec_sizes[MAX_LIST] = { 16, 128, 1024 }, nrec_sizes = 3;
+	size_t producers[MAX_LIST] = { 1, 4 }, nproducers = 2;
+	size_t buffer_mbs[MAX_LIST] = { 64 }, nbuffer_mbs = 1;
+	size_t buffer_cnts[MAX_LIST] = { 4 }, nbuffer_cnts = 1;
+	const char *codec_list = "none,lz4";
+	const struct codec *sel[MAX_LIST];
+	struct run run;
+	size_t nsel = 0, i, c, r, p, b, n;
+	char *list, *tok, *save;
+	int ch, json = 0, keep = 0, fails = 0;
+
+	memset(&run, 0, sizeof(run));
+	run.file = "bench_bc.trace";
+	run.total = 256ULL * 1024 * 1024;
+
+	while ((ch = getopt(argc, argv, "jkf:m:r:p:b:n:w:c:")) != -1) {
+		switch (ch) {
+		case 'j':
+			json = 1;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'f':
+			run.file = optarg;
+			break;
+		case 'm':
+			run.total = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'r':
+			nrec_sizes = parse_list(optarg, rec_sizes);
+			break;
+		case 'p':
+			nproducers = parse_list(optarg, producers);
+			break;
+		case 'b':
+			nbuffer_mbs = parse_list(optarg, buffer_mbs);
+			break;
+		case 'n':
+			nbuffer_cnts = parse_list(optarg, buffer_cnts);
+			break;
+		case 'w':
+			run.workers = (size_t)atoi(optarg);
+			break;
+		case 'c':
+			codec_list = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	list = strdup(codec_list);
+	assert (list != NULL);
+	for (tok = strtok_r(list, ",", &save); tok != NULL && nsel < MAX_LIST;
+	    tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+			if (strcmp(tok, codecs[i].name) == 0)
+				break;
+		}
+		if (i == sizeof(codecs) / sizeof(codecs[0])) {
+			fprintf(stderr, "Unknown codec: %s\n", tok);
+			usage();
+		}
+		sel[nsel++] = &codecs[i];
+	}
+	free(list);
+
+	make_pattern();
+
+	for (c = 0; c < nsel; c++)
+	for (r = 0; r < nrec_sizes; r++)
+	for (p = 0; p < nproducers; p++)
+	for (b = 0; b < nbuffer_mbs; b++)
+	for (n = 0; n < nbuffer_cnts; n++) {
+		/* Buffers don't matter to the baseline */
+		if (sel[c]->compress == CODEC_WRITE && (b > 0 || n > 0))
+			continue;
+		if (rec_sizes[r] > PATTERN_SZ / 2) {
+			fprintf(stderr, "Records larger than %d bytes aren't "
+			    "supported\n", PATTERN_SZ / 2);
+			return 1;
+		}
+
+		run.compress = sel[c]->compress;
+		run.rec_size = rec_sizes[r];
+		run.producers = producers[p];
+		run.buffer_mb = buffer_mbs[b];
+		run.buffer_cnt = buffer_cnts[n];
+
+		if (do_run(&run, sel[c]->name, json) != 0) {
+			fprintf(stderr, "%s failed\n", sel[c]->name);
+			++fails;
+		}
+	}
+
+	if (!keep)
+		unlink(run.file);
+	free(pattern);
+
+	return fails ? 1 : 0;
+}
@@ -27,16 +27,29 @@
  * SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#ifdef _WITH_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
+#include <errno.h>
 
 #ifndef _WITHOUT_LZ4
 #include "lz4/lz4.h"
@@ -46,11 +59,70 @@
 #ifdef _WITH_ZLIB
 #include "zlib.h"
 #endif
+
+#ifdef _WITH_ZSTD
+#include "zstd.h"
+#endif
+#include "crc32c.h"
 #include "buffer_cache.h"
 
-#define LZ4_EXTRA_SZ	64*1024
-#define LZ4_BLOCK_SZ	4*1024*1024
+#define LZ4_EXTRA_SZ	(64*1024)
+#define LZ4_BLOCK_SZ	(4*1024*1024)
 #define ZLIB_BLOCK_SZ	LZ4_BLOCK_SZ
+#define ZLIB_LEVEL	1
+#define ZSTD_OBUF_SZ	ZLIB_BLOCK_SZ
+
+/* Compressor output scratch space, enough for any codec's block */
+#ifndef _WITHOUT_LZ4
+#define COMP_OBUF_SZ	(LZ4_COMPRESSBOUND(LZ4_BLOCK_SZ)+4)
+#else
+#define COMP_OBUF_SZ	ZLIB_BLOCK_SZ
+#endif
+#define DIO_ALIGN	4096
+#define DIO_STAGE_SZ	(1024*1024)
+#define HUGE_PAGE_SZ	(2*1024*1024)
+#define NUMA_NODES	1024	/* at most, for mbind() */
+
+/* Framed records (BC_OPT_FRAMED): a varint of at most 5 bytes, and a CRC */
+#define FRAME_MAX	0xFFFFFFFFULL
+#define FRAME_CRC_SZ	4
+
+/* Compressibility check, see _bc_compressible() */
+#define SAMPLE_SZ	(16*1024)
+#define SAMPLE_CNT	4
+#define SAMPLE_SCRATCH	(2*SAMPLE_CNT*SAMPLE_SZ)
+
+/* Default spin_us, and spin-wait hint, see _bc_wait() */
+#define SPIN_US		50
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()	__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX()	__asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX()	do { } while (0)
+#endif
+
+/*
+ * The index is a run of struct bc_index_ent followed by a footer: offset
+ * of the index in the file (u64), entry count (u64), flags (u32), magic.
+ * The footer always ends BC_INDEX_GZ_TAIL bytes before the end of a gzip
+ * file and right at the end of an LZ4 file.
+ */
+#define BC_INDEX_MAGIC		0x58494342	/* "BCIX" */
+#define BC_INDEX_KEYS		0x1
+#define BC_INDEX_FTR_SZ		24
+#define BC_INDEX_LZ4_MAGIC	0x184D2A5B	/* skippable frame */
+#define BC_INDEX_GZ_CHUNK	(65535 - 4)
+#define BC_INDEX_GZ_TAIL	10
+
+/*
+ * The manifest of striped output: magic, stripe count (u32) and entry
+ * count (u64), followed by the paths of the stripes (u32 length and the
+ * bytes) and the entries (struct bc_stripe_ent), each saying where the
+ * next len bytes of the stream are.
+ */
+#define BC_STRIPE_MAGIC		0x4D534342	/* "BCSM" */
 
 struct bc_buffer {
 	struct bc_buffer *next;
@@ -60,19 +132,187 @@ struct bc_buffer {
 	size_t	bytes_left;
 
 	unsigned char *bufp;
+	unsigned char *buf;
+	size_t	buf_len;	/* of the mapping */
+
+	/* Bytes of stream history in front of the payload (linked LZ4) */
+	size_t	link_len;
+
+	/* Index key in effect at the start of the buffer */
+	uint64_t	key;
+	int		key_set;
+
+	/* When it was last put on the empty list (CLOCK_MONOTONIC, ns) */
+	uint64_t	idle_since;
+
+	/* Records written into it, for counting drops */
+	size_t		rec_cnt;
+
+	/*
+	 * With max_age_ms, the I/O thread writes out what's in a producer's
+	 * current buffer once it gets too old (see _bc_age_flush()). The
+	 * first flushed bytes of the payload are then already out, and the
+	 * rest has been there since dirty_at at most. While the bytes from
+	 * age_off on are being written out, age_flushing is set (under the
+	 * drain mutex) and the buffer is on the I/O thread's age_next list.
+	 */
+	size_t		flushed;
+	uint64_t	dirty_at;
+	int		age_flushing;
+	size_t		age_off;
+	struct bc_buffer *age_next;
+
+	/*
+	 * The producer's sequence number at the start of the buffer, and
+	 * the buffer's place in the order of the drain list.
+	 */
+	uint64_t	prod_seq;
+	uint64_t	ticket;
+
+	/* Only used with compression workers or io_uring */
+	uint64_t	seq;
+	unsigned int	crc32;
+	size_t		obuf_used;
+	unsigned char	*obuf;
+	unsigned char	*obuf_mem;
+	size_t		obuf_len;
+
+#ifdef _WITH_IO_URING
+	/* Remainder of the write in flight for this buffer */
+	struct iovec	io_iov;
+	off_t		io_off;
+#endif
+};
+
+struct bc_producer {
+	struct buffer_cache_ctx *ctx;
+	struct bc_producer *next;
+	struct bc_producer *prev;
+
+	struct bc_buffer *current_wr;
+
+	/* Space handed out by buffer_cache_reserve(), not yet committed */
+	size_t		reserved;
+
+	/* Last key set with buffer_cache_set_key() */
+	uint64_t	key;
+	int		key_set;
+
+	/* Sequence number at the end and ticket of the last buffer drained */
+	uint64_t	seq;
+	uint64_t	ticket;
 
-	unsigned char buf[0];
+	/*
+	 * Engine ctxs: busy is set while the producer is in a call that
+	 * uses its current buffer (or holds a reservation in it), and
+	 * stealing while _engine_steal() is about to take the buffer away.
+	 * Each sets its own flag and then looks at the other's, so they
+	 * never both go ahead, see _prod_pin(). held_since is when the
+	 * buffer became current.
+	 */
+	int		busy;		/* atomic */
+	int		stealing;	/* atomic */
+	uint64_t	held_since;	/* atomic */
+};
+
+/*
+ * On-disk index entry (BC_OPT_INDEX), little endian like everything else.
+ */
+struct bc_index_ent {
+	uint64_t	uoff;
+	uint64_t	coff;
+	uint64_t	key;
+};
+
+struct bc_stripe_ent {
+	uint64_t	len;
+	uint64_t	stripe;
+};
+
+#ifdef _WITH_IO_URING
+struct bc_uring {
+	int		fd;
+	unsigned int	entries;
+	unsigned int	inflight;
+	int		error;		/* errno of the last failed write */
+
+	void		*sq_ring;
+	size_t		sq_ring_sz;
+	unsigned int	*sq_head;
+	unsigned int	*sq_tail;
+	unsigned int	*sq_mask;
+	unsigned int	*sq_array;
+	struct io_uring_sqe *sqes;
+	size_t		sqes_sz;
+
+	void		*cq_ring;
+	size_t		cq_ring_sz;
+	unsigned int	*cq_head;
+	unsigned int	*cq_tail;
+	unsigned int	*cq_mask;
+	struct io_uring_cqe *cqes;
+};
+#endif
+
+struct bc_worker {
+	struct buffer_cache_ctx *ctx;
+	int		thr_created;
+	pthread_t	thread;
+#ifndef _WITHOUT_LZ4
+	void		*lz4_strm;
+#endif
+#ifdef _WITH_ZLIB
+	int		zlib_init;
+	z_stream	zlib_strm;
+#endif
+};
+
+/*
+ * Threads and a pool of buffers shared by the ctxs attached to it, see
+ * buffer_cache_engine_init(). ctxs with buffers drained wait their turn
+ * on the ready queue; those that found the pool used up are on the
+ * starved list, to be woken when a buffer comes back. held counts the
+ * buffers that are some producer's current one (or about to be), which
+ * don't come back unless taken, see _engine_steal().
+ */
+struct bc_engine_thr {
+	struct buffer_cache_engine *eng;
+	pthread_t	thread;
+	unsigned char	*comp_obuf;
+};
+
+struct buffer_cache_engine {
+	size_t		buffer_size_mb;
+	size_t		buf_cnt;
+	size_t		buf_max;
+	size_t		held;
+	size_t		ctx_cnt;
+	struct buffer_cache_ctx *ctxs;
+	struct bc_buffer *free;
+	struct buffer_cache_ctx *ready;	/* stored atomically */
+	struct buffer_cache_ctx *ready_tail;
+	struct buffer_cache_ctx *starved;
+	size_t		thread_cnt;
+	struct bc_engine_thr *threads;
+	int		exit;
+	uint64_t	spin_ns;
+	unsigned int	parked;		/* threads asleep on cv */
+	pthread_cond_t	cv;
+	pthread_mutex_t	mtx;
 };
 
 #ifndef _WITHOUT_LZ4
 struct lz4_state {
 	int		hdr_written;
-	int		first;
+	int		linked;
+	int		link_bufs;
+	int		block_checksum;
 	int		stream_checksum;
+	int		new_file;	/* next buffer written starts a file */
 	void		*lz4_state;
 	void		*xxh32_state;
+	size_t		link_len;
 	unsigned char	lz4_link_buf[LZ4_EXTRA_SZ];
-	unsigned char   lz4_obuf[LZ4_COMPRESSBOUND(LZ4_BLOCK_SZ)+4];
 };
 #endif
 
@@ -82,7 +322,13 @@ struct zlib_state {
 	unsigned int	isize;
 	unsigned int	zlib_crc32;
 	z_stream	zlib_strm;
-	unsigned char   zlib_obuf[ZLIB_BLOCK_SZ];
+};
+#endif
+
+#ifdef _WITH_ZSTD
+struct zstd_state {
+	int		ended;		/* output ends with a complete frame */
+	ZSTD_CCtx	*cctx;
 };
 #endif
 
@@ -91,12 +337,108 @@ struct buffer_cache_ctx {
 	size_t	buffer_size;
 	size_t	buffer_cnt;
 	int	fd;
+	off_t	out_off;
+
+	/*
+	 * Rotation (rotate_mb, rotate_sec): file_pattern is what the names
+	 * are made from and file_idx the number of the current file. The
+	 * I/O thread moves on to the next file once out_off reaches
+	 * rotate_limit, or at rotate_at (rotate_rt in wall clock time, ns).
+	 */
+	char	*file_pattern;
+	char	*file_stem;	/* what it last expanded to */
+	unsigned int file_idx;
+	uint64_t rotate_bytes;
+	uint64_t rotate_limit;
+	uint64_t rotate_ns;
+	uint64_t rotate_at;
+	uint64_t rotate_rt;
+
+	/*
+	 * With O_DIRECT, everything is written in multiples of dio_align
+	 * and out_off stays aligned. The trailing partial block of the
+	 * stream is held back in dio_buf (dio_len bytes) until more data
+	 * follows or the file is finished.
+	 */
+	size_t	buf_align;
+	size_t	dio_align;
+	unsigned int numa_node;
+	size_t	dio_len;
+	unsigned char *dio_buf;
 	size_t	empty_cnt;
-	size_t	drain_cnt;
+	size_t	drain_cnt;	/* stored atomically, see _bc_wait() */
+
+	/*
+	 * Buffers are allocated as producers need them, up to buf_max
+	 * (buffer_cnt or less, see buffer_cache_init_opts()). Those left
+	 * on the empty list for idle_ns are freed again by the I/O thread,
+	 * down to buf_min.
+	 */
+	size_t	buf_alloc_cnt;
+	size_t	buf_min;
+	size_t	buf_max;
+	uint64_t idle_ns;
+
+	/* Partially filled buffers are flushed once max_age_ns old */
+	uint64_t max_age_ns;
+
+	/* Next time the I/O thread looks at both, every tick_ns */
+	uint64_t tick_ns;
+	uint64_t tick_at;
+
+	/* How long the I/O thread polls for buffers before sleeping */
+	uint64_t spin_ns;
+
+	/* What to do when the pool is used up, see buffer_cache.h */
+	int	backpressure;
+	uint64_t bp_timeout_ns;
+	uint64_t drop_bytes;	/* atomic */
+	uint64_t drop_recs;	/* atomic */
+
+	/* Writes that found no empty buffer, and how long they waited */
+	uint64_t wait_cnt;	/* atomic */
+	uint64_t wait_ns;	/* atomic */
+
+	/*
+	 * Statistics, see buffer_cache_stats(). st_io_ns is the time the
+	 * I/O thread spent writing since it took on its current buffer.
+	 */
+	uint64_t st_bytes_in;	/* atomic */
+	uint64_t st_bytes_out;	/* atomic */
+	uint64_t st_drained;	/* under the drain mutex */
+	uint64_t st_io_ns;
+	uint64_t st_comp_hist[BC_STATS_HIST];	/* atomic */
+	uint64_t st_write_hist[BC_STATS_HIST];	/* atomic */
+
+	/*
+	 * Durability, see buffer_cache_wait_durable(). Buffers are given
+	 * tickets in the order they are drained (under the drain mutex);
+	 * written_ticket is the last one written out by the I/O thread and
+	 * synced_ticket the last one synced. sync_req is the highest ticket
+	 * a producer is waiting on.
+	 */
+	int	durability;
+	uint64_t sync_ns;
+	uint64_t sync_at;
+	uint64_t drain_ticket;
+	uint64_t written_ticket;
+	int	sync_dirty;	/* written out since the last sync */
+	int	comp_pending;	/* output held back by the compressor */
+	uint64_t sync_req;	/* atomic */
+	uint64_t synced_ticket;
+	int	sync_failed;
+	pthread_cond_t	durable_cv;
+	pthread_mutex_t	sync_mtx;
 	struct bc_buffer *empty;
 	struct bc_buffer *drain;
 	struct bc_buffer *drain_tail;
-	struct bc_buffer *current_wr;
+
+	int		flags;
+	struct bc_producer sp;	/* single producer mode */
+	int		prod_key_created;
+	pthread_key_t	prod_key;
+	pthread_mutex_t	prod_mtx;
+	struct bc_producer *producers;
 
 	int		compress;
 	union {
@@ -106,12 +448,90 @@ struct buffer_cache_ctx {
 #endif
 #ifdef _WITH_ZLIB
 		struct zlib_state	zlib_state;
+#endif
+#ifdef _WITH_ZSTD
+		struct zstd_state	zstd_state;
 #endif
 	};
 
+	/*
+	 * Where the thread doing the writes has the compressor put its
+	 * output before writing it out (COMP_OBUF_SZ). An engine's threads
+	 * each have their own, which the ctx borrows for its turn.
+	 */
+	unsigned char	*comp_obuf;
+
+	/*
+	 * With compression workers, buffers are tagged with a sequence
+	 * number when they are taken off the drain list. The workers
+	 * place them in seq_ring once compressed, and the I/O thread
+	 * writes them out strictly in sequence order.
+	 */
+	size_t		comp_workers;
+	size_t		obuf_size;
+	struct bc_worker *workers;
+	uint64_t	pop_seq;
+	uint64_t	write_seq;
+	struct bc_buffer **seq_ring;	/* slots stored atomically */
+	int		exit_seq;
+	unsigned int	seq_parked;
+	pthread_cond_t	seq_cv;
+	pthread_mutex_t	seq_mtx;
+
+#ifdef _WITH_IO_URING
+	/* Only ever used by the thread doing the writes */
+	struct bc_uring	*uring;
+#endif
+
+	/*
+	 * Block index, built by the thread doing the writes: one entry per
+	 * buffer, giving the uncompressed and the compressed offset of its
+	 * start and the key in effect there.
+	 */
+	struct bc_index_ent *index;
+	size_t		index_cnt;
+	size_t		index_size;
+	int		index_failed;
+	int		index_keys;
+	uint64_t	index_uoff;
+	uint64_t	index_key;
+
+	/*
+	 * Striping (stripe_cnt): drained buffers are handed on to the
+	 * stripes, ctxs of their own that write one file each and return
+	 * the buffers to their pool (this ctx) once written out. The order
+	 * they went in goes into the manifest, see _stripe_buf().
+	 */
+	struct buffer_cache_ctx *pool;
+	struct buffer_cache_ctx **stripes;
+	size_t		stripe_cnt;
+	size_t		stripe_next;
+	struct bc_stripe_ent *stripe_ents;
+	size_t		stripe_ent_cnt;
+	size_t		stripe_ent_size;
+	int		stripe_failed;
+
+	/*
+	 * Attached to an engine, which does the I/O instead of io_thread.
+	 * eng_sched is set (under the drain mutex) while the ctx is on
+	 * the ready queue or one of the engine threads is working on it,
+	 * eng_starved (under the engine mutex) while it is on the starved
+	 * list. eng_wake (under the empty mutex) is bumped whenever a
+	 * buffer goes back to the pool that it might now get. All of the
+	 * engine's ctxs are on its ctxs list, through eng_ctx_next.
+	 */
+	struct buffer_cache_engine *engine;
+	struct buffer_cache_ctx *eng_ctx_next;
+	struct buffer_cache_ctx *eng_next;
+	struct buffer_cache_ctx *eng_starved_next;
+	int		eng_sched;
+	int		eng_starved;
+	unsigned int	eng_wake;
+
 	int		thr_created;
 	int		exit_drain;
 	pthread_t	io_thread;
+	unsigned int	drain_parked;	/* threads asleep on drain_cv */
 	pthread_cond_t	drain_cv;
 	pthread_cond_t	empty_cv;
 	pthread_mutex_t	drain_mtx;
@@ -119,614 +539,4778 @@ struct buffer_cache_ctx {
 };
 
 
-#ifndef _WITHOUT_LZ4
-static
-int
-lz4_write_hdr(struct buffer_cache_ctx *ctx)
+static void _recycle_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf);
+static void _engine_put_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf);
+static void _bc_drop(struct buffer_cache_ctx *ctx, size_t bytes, size_t recs);
+static uint64_t _drain_push(struct buffer_cache_ctx *ctx,
+    struct bc_buffer *buf);
+
+/*
+ * The part of a buffer's payload still to be written out, which is all of
+ * it unless some was flushed early.
+ */
+static inline
+unsigned char *
+_buf_data(struct bc_buffer *buf)
 {
-	struct lz4_state *lz4_ctx = &ctx->lz4_state;
-	ssize_t ssz_written;
-	unsigned char buf[19];
-	unsigned int magic = 0x184D2204;
-	int hdr_sz = 0;
+	return buf->buf + LZ4_EXTRA_SZ + buf->flushed;
+}
 
-	memset(buf, 0, sizeof(buf));
-	memcpy(&buf[0], &magic, sizeof(magic));
-	hdr_sz += sizeof(magic);
-	buf[hdr_sz++] = (0x1 << 6) | (lz4_ctx->stream_checksum << 2); // FLG:{VER, stream checksum}
-	buf[hdr_sz++] = (0x7 << 4); // BD:{4MB blocks}
-	buf[hdr_sz++] = (XXH32(&buf[4], 2, 0) >> 8) & 0xFF; // HC
+static inline
+size_t
+_buf_len(struct bc_buffer *buf)
+{
+	return buf->bytes_used - buf->flushed;
+}
+
+static
+uint64_t
+_bc_now(void)
+{
+	struct timespec ts;
 
-	assert (hdr_sz <= sizeof(buf));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	ssz_written = write(ctx->fd, buf, (size_t)hdr_sz);
-	if (ssz_written == (ssize_t)hdr_sz) {
-		lz4_ctx->hdr_written = 1;
-		return 0;
-	} else {
-		return 1;
-	}
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
+/*
+ * Add a time to a histogram of buffer_cache_stats(): bucket 0 is for less
+ * than a microsecond, bucket i for up to 2^i.
+ */
 static
-int
-lz4_write_tail(struct buffer_cache_ctx *ctx)
+void
+_bc_hist_add(uint64_t *hist, uint64_t ns)
 {
-	struct lz4_state *lz4_ctx = &ctx->lz4_state;
-	unsigned int eos = 0;
-	unsigned int cksum;
-	ssize_t ssz_written;
+	uint64_t us = ns / 1000;
+	size_t i = (us == 0) ? 0 : (size_t)(64 - __builtin_clzll(us));
 
-	/* Write End-of-Stream marker */
-	ssz_written = write(ctx->fd, &eos, 4);
-	if (ssz_written != 4)
-		return 1;
+	if (i >= BC_STATS_HIST)
+		i = BC_STATS_HIST - 1;
 
-	/* Write stream checksum, if enabled */
-	if (lz4_ctx->stream_checksum) {
-		cksum = XXH32_digest(lz4_ctx->xxh32_state);
-		ssz_written = write(ctx->fd, &cksum, 4);
-		if (ssz_written != 4)
-			return 1;
-	}
+	__atomic_fetch_add(&hist[i], 1, __ATOMIC_RELAXED);
+}
 
-	return 0;
+/*
+ * Account for the I/O thread being done with a buffer it took on at
+ * start: its time spent writing, and with compressed set, the rest as
+ * compressing.
+ */
+static
+void
+_bc_stat_buf(struct buffer_cache_ctx *ctx, uint64_t start, int compressed)
+{
+	uint64_t total = _bc_now() - start, io = ctx->st_io_ns;
+
+	if (io > total)
+		io = total;
+
+	_bc_hist_add(ctx->st_write_hist, io);
+	if (compressed)
+		_bc_hist_add(ctx->st_comp_hist, total - io);
 }
 
 static
 int
-lz4_write_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+_bc_pwrite(struct buffer_cache_ctx *ctx, const void *data, size_t count)
 {
-	struct lz4_state *lz4_ctx = &ctx->lz4_state;
+	const unsigned char *bufp = data;
 	ssize_t ssz_written;
-	size_t sz_left;
-	unsigned int in_sz, out_sz;
-	unsigned char *bufp;
-	unsigned int sz_val;
+	uint64_t start = _bc_now();
+	int r = 0;
 
-	if (!lz4_ctx->first) {
-		/*
-		 * XXX: revisit whenever the LZ4 streaming API understands separate
-		 * input blocks...
-		 */
-	} else {
-		lz4_ctx->first = 0;
+	__atomic_fetch_add(&ctx->st_bytes_out, count, __ATOMIC_RELAXED);
+
+	while (count > 0) {
+		ssz_written = pwrite(ctx->fd, bufp, count, ctx->out_off);
+		if (ssz_written < 0) {
+			if (errno == EINTR)
+				continue;
+			r = 1;
+			break;
+		}
+
+		bufp += ssz_written;
+		count -= (size_t)ssz_written;
+		ctx->out_off += ssz_written;
 	}
 
-	sz_left = buf->bytes_used;
-	buf->bufp = buf->buf + LZ4_EXTRA_SZ;
-	while (sz_left > 0) {
-		in_sz = (sz_left < LZ4_BLOCK_SZ) ? (int)sz_left : LZ4_BLOCK_SZ;
+	ctx->st_io_ns += _bc_now() - start;
 
-		if (lz4_ctx->stream_checksum)
-			XXH32_update(lz4_ctx->xxh32_state, buf->bufp, in_sz);
+	return r;
+}
 
-		/*
-		 * (Try to) compress into obuf+4, keeping the first 4 bytes for
-		 * size information.
-		 */
-		out_sz = LZ4_compress_limitedOutput((char *)buf->bufp,
-		    (char *)lz4_ctx->lz4_obuf+4, in_sz, in_sz-1);
+/*
+ * O_DIRECT variant of _bc_write(): data is staged in dio_buf and written
+ * out in aligned chunks. Aligned data is written directly if nothing is
+ * held back from before.
+ */
+static
+int
+_bc_dio_write(struct buffer_cache_ctx *ctx, const void *data, size_t count)
+{
+	const unsigned char *bufp = data;
+	size_t n, full;
 
-		/* XXX: all things lz4 assume little endian */
-		if (out_sz > 0) {
-			/* Block compressed fine */
+	if (ctx->dio_len == 0 && ((uintptr_t)bufp & (ctx->dio_align - 1)) == 0) {
+		full = count & ~(ctx->dio_align - 1);
+		if (_bc_pwrite(ctx, bufp, full) != 0)
+			return 1;
 
-			/* Copy the compressed block size into the output buffer */
-			memcpy(lz4_ctx->lz4_obuf, &out_sz, 4);
-			out_sz += 4;
+		bufp += full;
+		count -= full;
+	}
 
-			/* Write the compressed block, prefixed with the block size */
-			bufp = lz4_ctx->lz4_obuf;
-			while (out_sz > 0) {
-				ssz_written = write(ctx->fd, bufp, (size_t)out_sz);
-				assert (ssz_written >= 0);
-				bufp += ssz_written;
-				out_sz -= (int)ssz_written;
-			}
-		} else {
-			/* Couldn't compress */
+	while (count > 0) {
+		n = DIO_STAGE_SZ - ctx->dio_len;
+		if (n > count)
+			n = count;
 
-			/* First, write the size, with the "uncompressed" flag */
-			sz_val = in_sz | 0x80000000;
-			ssz_written = write(ctx->fd, &sz_val, 4);
-			assert (ssz_written == 4);
+		memcpy(ctx->dio_buf + ctx->dio_len, bufp, n);
+		ctx->dio_len += n;
+		bufp += n;
+		count -= n;
 
-			/* Now, write the uncompressed input block */
-			bufp = buf->bufp;
-			while (in_sz > 0) {
-				ssz_written = write(ctx->fd, bufp, (size_t)in_sz);
-				assert (ssz_written >= 0);
-				bufp += ssz_written;
-				in_sz -= (int)ssz_written;
-			}
+		full = ctx->dio_len & ~(ctx->dio_align - 1);
+		if (full == 0)
+			continue;
 
-			/* Restore in_sz */
-			in_sz = (sz_left < LZ4_BLOCK_SZ) ? (int)sz_left : LZ4_BLOCK_SZ;
-		}
+		if (_bc_pwrite(ctx, ctx->dio_buf, full) != 0)
+			return 1;
 
-		buf->bufp += in_sz;
-		sz_left -= (size_t)in_sz;
+		ctx->dio_len -= full;
+		memmove(ctx->dio_buf, ctx->dio_buf + full, ctx->dio_len);
 	}
 
 	return 0;
 }
-#endif
 
-
-#ifdef _WITH_ZLIB
+/*
+ * O_DIRECT preparation of a buffer's output for _bc_output(). data must
+ * be aligned and have at least dio_align bytes of scratch space in front
+ * of it. Whatever was held back from before is prepended to data (which
+ * is moved if necessary) and the new partial trailing block is held back
+ * in turn. Returns the start of the aligned run to write and updates
+ * *countp to its length, which may be 0.
+ */
 static
-int
-zlib_write_hdr(struct buffer_cache_ctx *ctx)
+unsigned char *
+_bc_dio_prepare(struct buffer_cache_ctx *ctx, unsigned char *data,
+    size_t *countp)
 {
-	struct zlib_state *zlib_ctx = &ctx->zlib_state;
-	ssize_t ssz_written;
-	unsigned char buf[10];
-	int hdr_sz = 0;
-	unsigned int mtime = 0;
-
-	buf[hdr_sz++] = 0x1f; // ID1
-	buf[hdr_sz++] = 0x8b; // ID2
-	buf[hdr_sz++] = 0x08; // CM:{deflate}
-	buf[hdr_sz++] = 0x00; // FLG
-	memcpy(&buf[4], &mtime, 4);
-	hdr_sz += 4;
-	buf[hdr_sz++] = 0x00; // XFL:{used fastest algorithm}
-	buf[hdr_sz++] = 0xff; // OS:{unknown}
+	size_t count = *countp;
+	size_t full;
 
-	assert (hdr_sz <= sizeof(buf));
+	assert (((uintptr_t)data & (ctx->dio_align - 1)) == 0);
 
-	ssz_written = write(ctx->fd, buf, (size_t)hdr_sz);
-	if (ssz_written == (ssize_t)hdr_sz) {
-		zlib_ctx->hdr_written = 1;
-		return 0;
-	} else {
-		return 1;
+	if (ctx->dio_len > 0) {
+		memmove(data - ctx->dio_align + ctx->dio_len, data, count);
+		data -= ctx->dio_align;
+		memcpy(data, ctx->dio_buf, ctx->dio_len);
+		count += ctx->dio_len;
 	}
+
+	full = count & ~(ctx->dio_align - 1);
+	ctx->dio_len = count - full;
+	memcpy(ctx->dio_buf, data + full, ctx->dio_len);
+
+	*countp = full;
+	return data;
 }
 
+/*
+ * Write out the partial block held back at the end of an O_DIRECT file,
+ * padded to a full block, and cut the file back to its real size.
+ */
 static
 int
-zlib_write_tail(struct buffer_cache_ctx *ctx)
+_bc_dio_finish(struct buffer_cache_ctx *ctx)
 {
-	struct zlib_state *zlib_ctx = &ctx->zlib_state;
-	ssize_t ssz_written;
-	size_t out_sz;
-	unsigned char *bufp;
-	int r;
-
-	/* Finish stream */
-	do {
-		zlib_ctx->zlib_strm.next_out = zlib_ctx->zlib_obuf;
-		zlib_ctx->zlib_strm.avail_out = ZLIB_BLOCK_SZ;
-
-		r = deflate(&zlib_ctx->zlib_strm, Z_FINISH);
-		assert (r != Z_STREAM_ERROR);
-		assert (r != Z_BUF_ERROR);
-
-		out_sz = ZLIB_BLOCK_SZ - zlib_ctx->zlib_strm.avail_out;
-
-		/* Write the compressed output zlib has provided so far */
-		bufp = zlib_ctx->zlib_obuf;
-		while (out_sz > 0) {
-			ssz_written = write(ctx->fd, bufp, out_sz);
-			assert (ssz_written >= 0);
-			bufp += ssz_written;
-			out_sz -= (size_t)ssz_written;
-		}
+	off_t size = ctx->out_off + (off_t)ctx->dio_len;
 
-	} while (r != Z_STREAM_END);
+	if (ctx->dio_len == 0)
+		return 0;
 
-	/* Write checksum */
-	ssz_written = write(ctx->fd, &zlib_ctx->zlib_crc32, 4);
-	if (ssz_written != 4)
+	memset(ctx->dio_buf + ctx->dio_len, 0, ctx->dio_align - ctx->dio_len);
+	if (_bc_pwrite(ctx, ctx->dio_buf, ctx->dio_align) != 0)
 		return 1;
 
-	/* Write isize (length % 2^32) */
-	ssz_written = write(ctx->fd, &zlib_ctx->isize, 4);
-	if (ssz_written != 4)
-		return 1;
+	ctx->dio_len = 0;
+	ctx->out_off = size;
 
-	return 0;
+	return (ftruncate(ctx->fd, size) == 0) ? 0 : 1;
 }
 
+/*
+ * Synchronously write data at the current output offset.
+ */
 static
 int
-zlib_write_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+_bc_write(struct buffer_cache_ctx *ctx, const void *data, size_t count)
 {
-	struct zlib_state *zlib_ctx = &ctx->zlib_state;
-	ssize_t ssz_written;
-	size_t sz_left;
-	size_t out_sz;
-	unsigned char *bufp;
-	unsigned int sz_val;
-	int r;
-
-	sz_left = buf->bytes_used;
-	buf->bufp = buf->buf + LZ4_EXTRA_SZ;
+	if (ctx->flags & BC_OPT_DIRECT_IO)
+		return _bc_dio_write(ctx, data, count);
 
-	zlib_ctx->zlib_strm.next_in = buf->bufp;
-	zlib_ctx->zlib_strm.avail_in = sz_left;
+	return _bc_pwrite(ctx, data, count);
+}
 
-	zlib_ctx->isize += (unsigned int)sz_left;
-	zlib_ctx->zlib_crc32 = crc32(zlib_ctx->zlib_crc32, buf->bufp, sz_left);
 
-	do {
-		zlib_ctx->zlib_strm.next_out = zlib_ctx->zlib_obuf;
-		zlib_ctx->zlib_strm.avail_out = ZLIB_BLOCK_SZ;
+#ifdef _WITH_IO_URING
+static
+int
+bc_uring_enter(struct bc_uring *ring, unsigned int to_submit,
+    unsigned int min_complete)
+{
+	unsigned int flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+	long r;
 
-		r = deflate(&zlib_ctx->zlib_strm, Z_NO_FLUSH);
-		assert (r != Z_STREAM_ERROR);
-		assert (r != Z_BUF_ERROR);
+	do {
+		r = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+		    min_complete, flags, NULL, 0);
+	} while (r < 0 && errno == EINTR);
 
-		out_sz = ZLIB_BLOCK_SZ - zlib_ctx->zlib_strm.avail_out;
+	return (r < 0) ? 1 : 0;
+}
 
-		/* Write the compressed output zlib has provided so far */
-		bufp = zlib_ctx->zlib_obuf;
-		while (out_sz > 0) {
-			ssz_written = write(ctx->fd, bufp, out_sz);
-			assert (ssz_written >= 0);
-			bufp += ssz_written;
-			out_sz -= (size_t)ssz_written;
-		}
-	} while (zlib_ctx->zlib_strm.avail_in);
+static
+void
+bc_uring_free(struct bc_uring *ring)
+{
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring != NULL)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring != NULL)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	free(ring);
+}
 
-	return 0;
+/*
+ * Set up an io_uring with the given number of entries. Returns NULL if
+ * io_uring isn't available, in which case the caller falls back to
+ * plain write(2).
+ */
+static
+struct bc_uring *
+bc_uring_init(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct bc_uring *ring;
+	void *ptr;
+
+	if ((ring = malloc(sizeof(*ring))) == NULL)
+		return NULL;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		goto fail;
+
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ptr = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+
+	ring->sq_ring = ptr;
+	ring->sq_head = (unsigned int *)((char *)ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ptr + p.sq_off.array);
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+
+	ring->sqes = ptr;
+
+	ring->cq_ring_sz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	ptr = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+
+	ring->cq_ring = ptr;
+	ring->cq_head = (unsigned int *)((char *)ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ptr + p.cq_off.cqes);
+
+	return ring;
+
+fail:
+	bc_uring_free(ring);
+	return NULL;
 }
-#endif
 
+/*
+ * Queue a write of whatever remains of buf's io_iov at io_off.
+ */
+static
+void
+bc_uring_queue(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	struct bc_uring *ring = ctx->uring;
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = ctx->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&buf->io_iov;
+	sqe->len = 1;
+	sqe->off = (uint64_t)buf->io_off;
+	sqe->user_data = (uint64_t)(uintptr_t)buf;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
 
+/*
+ * Reap completions, waiting for at least min_complete of them. Buffers
+ * whose writes are complete go back on the empty list, short writes are
+ * resubmitted for the remainder. A failed write (or one that wrote
+ * nothing) is recorded in ring->error and its buffer recycled all the
+ * same; the other completions are still reaped before returning 1.
+ */
 static
-void *
-_drain_thr(void *priv)
+int
+bc_uring_reap(struct buffer_cache_ctx *ctx, unsigned int min_complete)
 {
-	struct buffer_cache_ctx *ctx = (struct buffer_cache_ctx *)priv;
+	struct bc_uring *ring = ctx->uring;
+	struct io_uring_cqe *cqe;
 	struct bc_buffer *buf;
-	ssize_t ssz_written, sz_left;
+	unsigned int head, resubmit, pending;
+	int failed = 0;
+
+	/* Submit anything a failed bc_uring_enter() left behind as well */
+	pending = *ring->sq_tail - __atomic_load_n(ring->sq_head,
+	    __ATOMIC_ACQUIRE);
+	if (min_complete > 0 &&
+	    bc_uring_enter(ring, pending, min_complete) != 0) {
+		ring->error = errno;
+		return 1;
+	}
 
-	for (;;) {
-		/*
-		 * Lock the drain mutex and check if there is anything to
-		 * drain.
-		 * If there isn't, then wait on the drain cv until the
-		 * write signals us to say that there now is some data
-		 * on the drain list.
-		 */
-		pthread_mutex_lock(&ctx->drain_mtx);
+	resubmit = 0;
+	head = *ring->cq_head;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		buf = (struct bc_buffer *)(uintptr_t)cqe->user_data;
+
+		if (cqe->res <= 0) {
+			ring->error = (cqe->res < 0) ? -cqe->res : EIO;
+			failed = 1;
+			--ring->inflight;
+			_recycle_buf(ctx, buf);
+		} else if ((size_t)cqe->res < buf->io_iov.iov_len) {
+			buf->io_iov.iov_base = (char *)buf->io_iov.iov_base + cqe->res;
+			buf->io_iov.iov_len -= (size_t)cqe->res;
+			buf->io_off += cqe->res;
+			bc_uring_queue(ctx, buf);
+			++resubmit;
+		} else {
+			--ring->inflight;
+			_recycle_buf(ctx, buf);
+		}
 
-		if (ctx->drain_cnt == 0) {
-			if (ctx->exit_drain) {
-				pthread_mutex_unlock(&ctx->drain_mtx);
-				return NULL;
-			}
+		++head;
+	}
 
-			pthread_cond_wait(&ctx->drain_cv, &ctx->drain_mtx);
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
 
-			if (ctx->exit_drain) {
-				pthread_mutex_unlock(&ctx->drain_mtx);
-				return NULL;
+	if (resubmit > 0 && bc_uring_enter(ring, resubmit, 0) != 0) {
+		ring->error = errno;
+		failed = 1;
+	}
+
+	if (failed)
+		errno = ring->error;
+
+	return failed;
+}
+
+static
+int
+bc_uring_write(struct buffer_cache_ctx *ctx, struct bc_buffer *buf,
+    const void *data, size_t count)
+{
+	struct bc_uring *ring = ctx->uring;
+	uint64_t start = _bc_now();
+	unsigned int n;
+	int r, failed = 0;
+
+	__atomic_fetch_add(&ctx->st_bytes_out, count, __ATOMIC_RELAXED);
+
+	/*
+	 * Keep no more writes in flight than there are ring entries. A
+	 * failed write still frees its entry; only give up when waiting
+	 * itself fails.
+	 */
+	while (ring->inflight >= ring->entries) {
+		n = ring->inflight;
+		if (bc_uring_reap(ctx, 1) != 0) {
+			failed = 1;
+			if (ring->inflight == n) {
+				_recycle_buf(ctx, buf);
+				return 1;
 			}
 		}
+	}
 
-		/*
-		 * Grab a buffer from the head of the drain list.
-		 */
-		assert (ctx->drain_cnt > 0);
+	buf->io_iov.iov_base = (void *)data;
+	buf->io_iov.iov_len = count;
+	buf->io_off = ctx->out_off;
+	ctx->out_off += (off_t)count;
+
+	bc_uring_queue(ctx, buf);
+	++ring->inflight;
 
-		--ctx->drain_cnt;
+	/* buf belongs to the ring now; bc_uring_reap() submits it if need be */
+	if (bc_uring_enter(ring, 1, 0) != 0)
+		return 1;
 
-		buf = ctx->drain;
-		ctx->drain = buf->next;
+	/* Recycle whatever has completed in the meantime */
+	r = bc_uring_reap(ctx, 0);
+	ctx->st_io_ns += _bc_now() - start;
 
-		if (ctx->drain_tail == buf) {
-			ctx->drain_tail = NULL;
-		} else {
-			ctx->drain->prev = NULL;
-			if (ctx->drain->next != NULL)
-				ctx->drain->next->prev = ctx->drain;
+	if (failed && r == 0) {
+		errno = ring->error;
+		r = 1;
+	}
+
+	return r;
+}
+#endif
+
+/*
+ * Whether writes are done asynchronously.
+ */
+static
+int
+_bc_async_io(struct buffer_cache_ctx *ctx)
+{
+#ifdef _WITH_IO_URING
+	if (ctx->uring != NULL)
+		return 1;
+#else
+	(void)ctx;
+#endif
+	return 0;
+}
+
+/*
+ * Whether the calling I/O thread still has writes in flight.
+ */
+static
+int
+_bc_io_pending(struct buffer_cache_ctx *ctx)
+{
+#ifdef _WITH_IO_URING
+	if (ctx->uring != NULL)
+		return (ctx->uring->inflight > 0);
+#else
+	(void)ctx;
+#endif
+	return 0;
+}
+
+/*
+ * Wait for all writes in flight to complete. Returns 1 if any of them
+ * failed, or if it can't wait for them.
+ */
+static
+int
+_bc_io_wait(struct buffer_cache_ctx *ctx)
+{
+	int r = 0;
+#ifdef _WITH_IO_URING
+	unsigned int n;
+
+	while (ctx->uring != NULL && ctx->uring->inflight > 0) {
+		n = ctx->uring->inflight;
+		if (bc_uring_reap(ctx, 1) != 0) {
+			r = 1;
+			if (ctx->uring->inflight == n)
+				break;
 		}
+	}
+#else
+	(void)ctx;
+#endif
+	return r;
+}
 
-		/*
-		 * Now that we are done operating on the drain list we
-		 * unlock again.
-		 */
-		pthread_mutex_unlock(&ctx->drain_mtx);
+/*
+ * A write failed: nothing written from now on can be made durable, so
+ * fail the producers waiting for it, and those to come. The buffers
+ * still to be written out are dropped (see _bc_io_skip()).
+ */
+static
+void
+_bc_io_failed(struct buffer_cache_ctx *ctx)
+{
+	int err = errno;
+
+	pthread_mutex_lock(&ctx->sync_mtx);
+	if (!ctx->sync_failed)
+		fprintf(stderr, "Failed to write to %s: %s\n", ctx->file,
+		    strerror(err));
+	ctx->sync_failed = 1;
+	pthread_cond_broadcast(&ctx->durable_cv);
+	pthread_mutex_unlock(&ctx->sync_mtx);
+}
 
-		/*
-		 * Do the actual I/O: drain the buffer we picked from
-		 * the drain list, ideally in buffer-sized chunks.
-		 */
-		switch (ctx->compress) {
+/*
+ * Once a write has failed, the output has a hole in it; rather than
+ * write what comes after, count it as dropped and recycle buf. Only the
+ * I/O thread sets sync_failed, so it can check it without the lock.
+ */
+static
+int
+_bc_io_skip(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	if (!ctx->sync_failed)
+		return 0;
+
+	_bc_drop(ctx, _buf_len(buf), buf->rec_cnt);
+	_recycle_buf(ctx, buf);
+
+	return 1;
+}
+
+/*
+ * Write count bytes at data on behalf of buf, and put buf back on the
+ * empty list once that's done, whether the write succeeded or not. With
+ * io_uring the write is only queued here, and buf is recycled when it
+ * completes.
+ */
+static
+int
+_bc_output(struct buffer_cache_ctx *ctx, struct bc_buffer *buf,
+    unsigned char *data, size_t count)
+{
+	int r;
+
+	/* The rest of a buffer flushed early can't be written in place */
+	if ((ctx->flags & BC_OPT_DIRECT_IO) &&
+	    ((uintptr_t)data & (ctx->dio_align - 1)) != 0) {
+		r = _bc_dio_write(ctx, data, count);
+		_recycle_buf(ctx, buf);
+		return r;
+	}
+
+	if (ctx->flags & BC_OPT_DIRECT_IO)
+		data = _bc_dio_prepare(ctx, data, &count);
+
+#ifdef _WITH_IO_URING
+	if (ctx->uring != NULL && count > 0)
+		return bc_uring_write(ctx, buf, data, count);
+#endif
+
+	r = _bc_pwrite(ctx, data, count);
+	_recycle_buf(ctx, buf);
+
+	return r;
+}
+
+
+#if !defined(_WITHOUT_LZ4) || defined(_WITH_ZLIB)
+#ifdef _WITH_ZLIB
+/*
+ * log2(x) for x > 0, in sixteenths of a bit.
+ */
+static
+unsigned int
+_bc_log2(uint32_t x)
+{
+	unsigned int r = 31 - (unsigned int)__builtin_clz(x), i;
+	uint64_t m = ((uint64_t)x << 16) >> r;	/* 1.0 to 2.0 in 16.16 */
+
+	r <<= 4;
+	for (i = 8; i > 0; i >>= 1) {
+		m = (m * m) >> 16;
+		if (m >= (2 << 16)) {
+			m >>= 1;
+			r |= i;
+		}
+	}
+
+	return r;
+}
+
+/*
+ * Whether the byte frequencies of the len bytes at p alone make them
+ * compressible by at least 1/16th: what Huffman coding gets out of data
+ * that has no repeats for LZ77 to find, text over a small alphabet for
+ * one.
+ */
+static
+int
+_bc_low_entropy(const unsigned char *p, size_t len)
+{
+	uint32_t cnt[256];
+	uint64_t bits = 0;
+	unsigned int lg_len;
+	size_t i;
+
+	memset(cnt, 0, sizeof(cnt));
+	for (i = 0; i < len; i++)
+		cnt[p[i]]++;
+
+	/* Order-0 entropy, in sixteenths of a bit */
+	lg_len = _bc_log2((uint32_t)len);
+	for (i = 0; i < 256; i++) {
+		if (cnt[i] > 0)
+			bits += (uint64_t)cnt[i] * (lg_len - _bc_log2(cnt[i]));
+	}
+
+	return (bits <= (uint64_t)len * 8 * 16 * 15 / 16);
+}
+#endif
+
+/*
+ * Guess whether a block is worth compressing by compressing a few
+ * samples taken from across it with LZ4. Data that is already compressed
+ * comes out of a full compression barely smaller, and storing it as it
+ * is right away saves all of that work. LZ4 finds repeats only, so for
+ * deflate (huffman set) the samples' byte frequencies are looked at
+ * first. scratch must have room for SAMPLE_SCRATCH bytes.
+ */
+static
+int
+_bc_compressible(const unsigned char *src, size_t len, unsigned char *scratch,
+    int huffman)
+{
+	size_t i, step;
 #ifndef _WITHOUT_LZ4
-		case BC_COMP_LZ4:
-			assert (lz4_write_buf(ctx, buf) == 0);
-			break;
+	unsigned char *out = scratch + SAMPLE_CNT*SAMPLE_SZ;
+	int out_sz;
 #endif
 
+	/* Small blocks might as well be compressed in full */
+	if (len < 4*SAMPLE_CNT*SAMPLE_SZ)
+		return 1;
+
+	step = (len - SAMPLE_SZ) / (SAMPLE_CNT - 1);
+	for (i = 0; i < SAMPLE_CNT; i++)
+		memcpy(scratch + i*SAMPLE_SZ, src + i*step, SAMPLE_SZ);
+
 #ifdef _WITH_ZLIB
-		case BC_COMP_ZLIB:
-			assert (zlib_write_buf(ctx, buf) == 0);
-			break;
+	if (huffman && _bc_low_entropy(scratch, SAMPLE_CNT*SAMPLE_SZ))
+		return 1;
+#else
+	(void)huffman;
 #endif
 
-		case BC_COMP_NONE:
-		default:
-			sz_left = buf->bytes_used;
-			buf->bufp = buf->buf + LZ4_EXTRA_SZ;
-			while (sz_left > 0) {
-				ssz_written = write(ctx->fd, buf->bufp, sz_left);
-				assert (ssz_written >= 0);
-				buf->bufp += ssz_written;
-				sz_left -= (size_t)ssz_written;
-			}
-			break;
-		}
+#ifndef _WITHOUT_LZ4
+	/* Worth it if that saves at least 1/16th */
+	out_sz = LZ4_compress_limitedOutput((const char *)scratch, (char *)out,
+	    SAMPLE_CNT*SAMPLE_SZ, SAMPLE_CNT*SAMPLE_SZ - SAMPLE_CNT*SAMPLE_SZ/16);
 
+	return (out_sz > 0);
+#else
+	return 1;
+#endif
+}
+#endif
 
-		/*
-		 * Lock the empty mutex, reinitialize the now-empty
-		 * buffer and place it on the head of the empty
-		 * list.
-		 * Signal any listeners that are waiting for buffers
-		 * to become empty (either _write or _destroy).
-		 */
-		pthread_mutex_lock(&ctx->empty_mtx);
 
-		buf->bytes_left = ctx->buffer_size;
-		buf->bytes_used = 0;
-		buf->bufp = buf->buf + LZ4_EXTRA_SZ;
-		buf->prev = NULL;
-		buf->next = ctx->empty;
-		ctx->empty = buf;
-		assert (ctx->empty != NULL);
-		++ctx->empty_cnt;
+#ifndef _WITHOUT_LZ4
+static
+int
+lz4_write_hdr(struct buffer_cache_ctx *ctx)
+{
+	struct lz4_state *lz4_ctx = &ctx->lz4_state;
+	unsigned char buf[19];
+	unsigned int magic = 0x184D2204;
+	int hdr_sz = 0;
 
-		pthread_cond_broadcast(&ctx->empty_cv);
-		pthread_mutex_unlock(&ctx->empty_mtx);
+	memset(buf, 0, sizeof(buf));
+	memcpy(&buf[0], &magic, sizeof(magic));
+	hdr_sz += sizeof(magic);
+	/* FLG: version, block independence, block and stream checksums */
+	buf[hdr_sz++] = (0x1 << 6) | ((!lz4_ctx->linked) << 5) |
+	    (lz4_ctx->block_checksum << 4) | (lz4_ctx->stream_checksum << 2);
+	buf[hdr_sz++] = (0x7 << 4); // BD:{4MB blocks}
+	buf[hdr_sz++] = (XXH32(&buf[4], 2, 0) >> 8) & 0xFF; // HC
+
+	assert ((size_t)hdr_sz <= sizeof(buf));
+
+	if (_bc_write(ctx, buf, (size_t)hdr_sz) != 0)
+		return 1;
+
+	lz4_ctx->hdr_written = 1;
+	return 0;
+}
+
+static
+int
+lz4_write_tail(struct buffer_cache_ctx *ctx)
+{
+	struct lz4_state *lz4_ctx = &ctx->lz4_state;
+	unsigned int eos = 0;
+	unsigned int cksum = 0;
+
+	/* XXH32_digest() frees the state, so leave none behind */
+	if (lz4_ctx->stream_checksum) {
+		cksum = XXH32_digest(lz4_ctx->xxh32_state);
+		lz4_ctx->xxh32_state = NULL;
 	}
 
-	return NULL;
+	/* Write End-of-Stream marker */
+	if (_bc_write(ctx, &eos, 4) != 0)
+		return 1;
+
+	/* Write stream checksum, if enabled */
+	if (lz4_ctx->stream_checksum && _bc_write(ctx, &cksum, 4) != 0)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Compresses a single block into dst+4 and prefixes it with the
+ * compressed block size. dst must have room for at least in_sz+4 bytes.
+ * Returns the number of bytes placed into dst, or 0 if the block didn't
+ * (or wouldn't) compress and should be stored uncompressed instead.
+ */
+static
+unsigned int
+lz4_compress_block(void *strm, const unsigned char *src, unsigned int in_sz,
+    unsigned char *dst)
+{
+	int out_sz;
+
+	if (!_bc_compressible(src, in_sz, dst, 0)) {
+		/*
+		 * The stream has to continue right after this block, with
+		 * the block's tail as the history for the next one.
+		 */
+		if (strm != NULL) {
+			LZ4_resetStreamState(strm,
+			    (const char *)src + in_sz - LZ4_EXTRA_SZ);
+			LZ4_compress_continue(strm,
+			    (const char *)src + in_sz - LZ4_EXTRA_SZ,
+			    (char *)dst, LZ4_EXTRA_SZ);
+		}
+		return 0;
+	}
+
+	/*
+	 * (Try to) compress into dst+4, keeping the first 4 bytes for
+	 * size information. With a stream (linked blocks), the block
+	 * may refer back to the previous 64 KB of input.
+	 */
+	if (strm != NULL)
+		out_sz = LZ4_compress_limitedOutput_continue(strm,
+		    (const char *)src, (char *)dst+4, (int)in_sz, (int)in_sz-1);
+	else
+		out_sz = LZ4_compress_limitedOutput((const char *)src,
+		    (char *)dst+4, (int)in_sz, (int)in_sz-1);
+
+	if (out_sz <= 0)
+		return 0;
+
+	/* XXX: all things lz4 assume little endian */
+	memcpy(dst, &out_sz, 4);
+
+	return (unsigned int)out_sz + 4;
+}
+
+/*
+ * Linked blocks: add n bytes of data to the stream history kept for the
+ * next buffer, of which only the last (up to) 64 KB matter.
+ */
+static
+void
+lz4_link_keep(struct lz4_state *lz4_ctx, const unsigned char *data, size_t n)
+{
+	size_t keep;
+
+	if (n >= LZ4_EXTRA_SZ) {
+		memcpy(lz4_ctx->lz4_link_buf, data + n - LZ4_EXTRA_SZ, LZ4_EXTRA_SZ);
+		lz4_ctx->link_len = LZ4_EXTRA_SZ;
+	} else {
+		keep = LZ4_EXTRA_SZ - n;
+		if (keep > lz4_ctx->link_len)
+			keep = lz4_ctx->link_len;
+
+		memmove(lz4_ctx->lz4_link_buf,
+		    lz4_ctx->lz4_link_buf + lz4_ctx->link_len - keep, keep);
+		memcpy(lz4_ctx->lz4_link_buf + keep, data, n);
+		lz4_ctx->link_len = keep + n;
+	}
+}
+
+/*
+ * Linked blocks: place the last (up to) 64 KB of the stream so far in
+ * front of the data of buf still to be written, where the compressor can
+ * refer back to it, and keep buf's own tail around for the next buffer.
+ * Buffers have to pass through here in stream order.
+ */
+static
+void
+lz4_link(struct lz4_state *lz4_ctx, struct bc_buffer *buf)
+{
+	unsigned char *data = _buf_data(buf);
+
+	buf->link_len = lz4_ctx->link_len;
+	memcpy(data - buf->link_len, lz4_ctx->lz4_link_buf, buf->link_len);
+
+	lz4_link_keep(lz4_ctx, data, _buf_len(buf));
+}
+
+/*
+ * Linked blocks: start compressing buf with strm. The history in front of
+ * the payload is run through the compressor first so that the first
+ * block can find matches in it; that output (in scratch, which must hold
+ * LZ4_COMPRESSBOUND(LZ4_EXTRA_SZ) bytes) is thrown away.
+ */
+static
+void
+lz4_stream_begin(void *strm, struct bc_buffer *buf, unsigned char *scratch)
+{
+	const char *hist = (const char *)_buf_data(buf) - buf->link_len;
+
+	LZ4_resetStreamState(strm, hist);
+
+	if (buf->link_len > 0)
+		LZ4_compress_continue(strm, hist, (char *)scratch, (int)buf->link_len);
+}
+
+/*
+ * Compress sz_left bytes at src (linked to whatever strm has seen, if not
+ * NULL) and write out the blocks.
+ */
+static
+int
+lz4_write_data(struct buffer_cache_ctx *ctx, void *strm,
+    const unsigned char *src, size_t sz_left)
+{
+	struct lz4_state *lz4_ctx = &ctx->lz4_state;
+	const unsigned char *blk;
+	unsigned int in_sz, out_sz;
+	unsigned int sz_val;
+
+	while (sz_left > 0) {
+		in_sz = (sz_left < LZ4_BLOCK_SZ) ? (int)sz_left : LZ4_BLOCK_SZ;
+
+		if (lz4_ctx->stream_checksum)
+			XXH32_update(lz4_ctx->xxh32_state, src, in_sz);
+
+		out_sz = lz4_compress_block(strm, src, in_sz, ctx->comp_obuf);
+		if (out_sz > 0) {
+			/* Write the compressed block, prefixed with the block size */
+			if (_bc_write(ctx, ctx->comp_obuf, out_sz) != 0)
+				return 1;
+			blk = ctx->comp_obuf + 4;
+			out_sz -= 4;
+		} else {
+			/* Couldn't compress */
+
+			/* First, write the size, with the "uncompressed" flag */
+			sz_val = in_sz | 0x80000000;
+			if (_bc_write(ctx, &sz_val, 4) != 0)
+				return 1;
+
+			/* Now, write the uncompressed input block */
+			if (_bc_write(ctx, src, in_sz) != 0)
+				return 1;
+			blk = src;
+			out_sz = in_sz;
+		}
+
+		if (lz4_ctx->block_checksum) {
+			sz_val = XXH32(blk, (int)out_sz, 0);
+			if (_bc_write(ctx, &sz_val, 4) != 0)
+				return 1;
+		}
+
+		src += in_sz;
+		sz_left -= (size_t)in_sz;
+	}
+
+	return 0;
+}
+
+static
+int
+lz4_write_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	struct lz4_state *lz4_ctx = &ctx->lz4_state;
+	void *strm = NULL;
+
+	if (lz4_ctx->linked) {
+		strm = lz4_ctx->lz4_state;
+		lz4_stream_begin(strm, buf, ctx->comp_obuf);
+	}
+
+	return lz4_write_data(ctx, strm, _buf_data(buf), _buf_len(buf));
+}
+
+/*
+ * Compress all of the buffer's data into its obuf as a sequence of
+ * complete, size-prefixed LZ4 blocks, each followed by its checksum if
+ * cksum is set. strm is only needed for linked blocks, in which case buf
+ * must have been through lz4_link().
+ */
+static
+void
+lz4_compress_buf(void *strm, struct bc_buffer *buf, int cksum)
+{
+	unsigned char *src = _buf_data(buf);
+	unsigned char *dst = buf->obuf;
+	size_t sz_left = _buf_len(buf);
+	unsigned int in_sz, out_sz;
+	unsigned int sz_val;
+
+	if (strm != NULL)
+		lz4_stream_begin(strm, buf, buf->obuf);
+
+	while (sz_left > 0) {
+		in_sz = (sz_left < LZ4_BLOCK_SZ) ? (int)sz_left : LZ4_BLOCK_SZ;
+
+		out_sz = lz4_compress_block(strm, src, in_sz, dst);
+		if (out_sz == 0) {
+			/* Couldn't compress, store it with the "uncompressed" flag */
+			sz_val = in_sz | 0x80000000;
+			memcpy(dst, &sz_val, 4);
+			memcpy(dst+4, src, in_sz);
+			out_sz = in_sz + 4;
+		}
+
+		if (cksum) {
+			sz_val = XXH32(dst+4, (int)out_sz - 4, 0);
+			memcpy(dst + out_sz, &sz_val, 4);
+			out_sz += 4;
+		}
+
+		src += in_sz;
+		dst += out_sz;
+		sz_left -= (size_t)in_sz;
+	}
+
+	buf->obuf_used = (size_t)(dst - buf->obuf);
+}
+
+/*
+ * Write out (and hand off) a buffer compressed by lz4_compress_buf(). The
+ * stream checksum has to be computed in order, so it's done here rather
+ * than in the compression workers; with workers, the blocks are
+ * checksummed instead (see buffer_cache_init_opts()).
+ */
+static
+int
+lz4_write_obuf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	struct lz4_state *lz4_ctx = &ctx->lz4_state;
+	unsigned char *bufp = _buf_data(buf);
+	size_t sz_left = _buf_len(buf);
+	unsigned int in_sz;
+
+	while (lz4_ctx->stream_checksum && sz_left > 0) {
+		in_sz = (sz_left < LZ4_BLOCK_SZ) ? (int)sz_left : LZ4_BLOCK_SZ;
+		XXH32_update(lz4_ctx->xxh32_state, bufp, in_sz);
+		bufp += in_sz;
+		sz_left -= (size_t)in_sz;
+	}
+
+	return _bc_output(ctx, buf, buf->obuf, buf->obuf_used);
+}
+#endif
+
+
+#ifdef _WITH_ZLIB
+static
+int
+zlib_write_hdr(struct buffer_cache_ctx *ctx)
+{
+	struct zlib_state *zlib_ctx = &ctx->zlib_state;
+	unsigned char buf[10];
+	int hdr_sz = 0;
+	unsigned int mtime = 0;
+
+	buf[hdr_sz++] = 0x1f; // ID1
+	buf[hdr_sz++] = 0x8b; // ID2
+	buf[hdr_sz++] = 0x08; // CM:{deflate}
+	buf[hdr_sz++] = 0x00; // FLG
+	memcpy(&buf[4], &mtime, 4);
+	hdr_sz += 4;
+	buf[hdr_sz++] = 0x00; // XFL:{used fastest algorithm}
+	buf[hdr_sz++] = 0xff; // OS:{unknown}
+
+	assert ((size_t)hdr_sz <= sizeof(buf));
+
+	if (_bc_write(ctx, buf, (size_t)hdr_sz) != 0)
+		return 1;
+
+	zlib_ctx->hdr_written = 1;
+	return 0;
+}
+
+static
+int
+zlib_write_tail(struct buffer_cache_ctx *ctx)
+{
+	struct zlib_state *zlib_ctx = &ctx->zlib_state;
+	size_t out_sz;
+	int r;
+
+	/* Finish stream */
+	do {
+		zlib_ctx->zlib_strm.next_out = ctx->comp_obuf;
+		zlib_ctx->zlib_strm.avail_out = ZLIB_BLOCK_SZ;
+
+		r = deflate(&zlib_ctx->zlib_strm, Z_FINISH);
+		assert (r != Z_STREAM_ERROR);
+		assert (r != Z_BUF_ERROR);
+
+		out_sz = ZLIB_BLOCK_SZ - zlib_ctx->zlib_strm.avail_out;
+
+		/* Write the compressed output zlib has provided so far */
+		if (_bc_write(ctx, ctx->comp_obuf, out_sz) != 0)
+			return 1;
+
+	} while (r != Z_STREAM_END);
+
+	/* Write checksum */
+	if (_bc_write(ctx, &zlib_ctx->zlib_crc32, 4) != 0)
+		return 1;
+
+	/* Write isize (length % 2^32) */
+	if (_bc_write(ctx, &zlib_ctx->isize, 4) != 0)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Deflate in_sz bytes at src (or nothing, for just a flush) and write
+ * out the output.
+ */
+static
+int
+zlib_write_block(struct buffer_cache_ctx *ctx, unsigned char *src,
+    size_t in_sz, int flush)
+{
+	struct zlib_state *zlib_ctx = &ctx->zlib_state;
+	size_t out_sz;
+	int r;
+
+	zlib_ctx->zlib_strm.next_in = src;
+	zlib_ctx->zlib_strm.avail_in = in_sz;
+
+	do {
+		zlib_ctx->zlib_strm.next_out = ctx->comp_obuf;
+		zlib_ctx->zlib_strm.avail_out = ZLIB_BLOCK_SZ;
+
+		r = deflate(&zlib_ctx->zlib_strm, flush);
+		assert (r != Z_STREAM_ERROR);
+		assert (r != Z_BUF_ERROR);
+
+		out_sz = ZLIB_BLOCK_SZ - zlib_ctx->zlib_strm.avail_out;
+
+		/* Write the compressed output zlib has provided so far */
+		if (_bc_write(ctx, ctx->comp_obuf, out_sz) != 0)
+			return 1;
+	} while (zlib_ctx->zlib_strm.avail_out == 0);
+
+	assert (zlib_ctx->zlib_strm.avail_in == 0);
+
+	if (flush != Z_NO_FLUSH)
+		ctx->comp_pending = 0;
+	else if (in_sz > 0)
+		ctx->comp_pending = 1;
+
+	return 0;
+}
+
+/*
+ * Switch strm to storing the next block (level 0) if it doesn't look
+ * compressible, or back to ZLIB_LEVEL. Must be called with no input
+ * pending; the output of the data so far is flushed into next_out.
+ * scratch (SAMPLE_SCRATCH bytes) must not overlap with that.
+ */
+static
+void
+zlib_set_level(z_stream *strm, const unsigned char *src, size_t in_sz,
+    unsigned char *scratch)
+{
+	int r;
+
+	r = deflateParams(strm, _bc_compressible(src, in_sz, scratch, 1) ?
+	    ZLIB_LEVEL : 0, Z_DEFAULT_STRATEGY);
+	assert (r == Z_OK);
+}
+
+/*
+ * Deflate sz_left bytes at src into the ctx's stream and write out the
+ * output, finishing with the given flush.
+ */
+static
+int
+zlib_write_data(struct buffer_cache_ctx *ctx, unsigned char *src,
+    size_t sz_left, int flush)
+{
+	struct zlib_state *zlib_ctx = &ctx->zlib_state;
+	z_stream *strm = &zlib_ctx->zlib_strm;
+	unsigned char *start = src;
+	size_t in_sz, out_sz;
+
+	zlib_ctx->isize += (unsigned int)sz_left;
+	zlib_ctx->zlib_crc32 = crc32(zlib_ctx->zlib_crc32, src, sz_left);
+
+	while (sz_left > 0) {
+		in_sz = (sz_left < ZLIB_BLOCK_SZ) ? sz_left : ZLIB_BLOCK_SZ;
+
+		/* The sample scratch space is done with before any output */
+		strm->next_out = ctx->comp_obuf;
+		strm->avail_out = ZLIB_BLOCK_SZ;
+		zlib_set_level(strm, src, in_sz, ctx->comp_obuf);
+
+		out_sz = ZLIB_BLOCK_SZ - strm->avail_out;
+		if (_bc_write(ctx, ctx->comp_obuf, out_sz) != 0)
+			return 1;
+
+		if (zlib_write_block(ctx, src, in_sz, Z_NO_FLUSH) != 0)
+			return 1;
+
+		src += in_sz;
+		sz_left -= in_sz;
+	}
+
+	/* Without any data, the last flush still stands (and zlib refuses) */
+	if (flush != Z_NO_FLUSH && src != start &&
+	    zlib_write_block(ctx, NULL, 0, flush) != 0)
+		return 1;
+
+	return 0;
+}
+
+static
+int
+zlib_write_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	/* With an index, each buffer has to start a new deflate block */
+	return zlib_write_data(ctx, _buf_data(buf), _buf_len(buf),
+	    (ctx->flags & BC_OPT_INDEX) ? Z_FULL_FLUSH : Z_NO_FLUSH);
+}
+
+static
+int
+zlib_init_strm(z_stream *strm)
+{
+	strm->zalloc = NULL;
+	strm->zfree = NULL;
+	strm->opaque = NULL;
+
+	return deflateInit2(strm, ZLIB_LEVEL, Z_DEFLATED, (-MAX_WBITS), 8,
+	    Z_DEFAULT_STRATEGY);
+}
+
+/*
+ * Deflate all of the buffer's data into its obuf. The output ends on a
+ * sync (or full, for an index) flush, so that the byte-aligned pieces
+ * produced for each buffer can simply be concatenated into one deflate
+ * stream, no matter whether they came from the ctx's stream or from a
+ * compression worker's.
+ */
+static
+void
+zlib_compress_buf(z_stream *strm, struct bc_buffer *buf, size_t obuf_size,
+    int flush)
+{
+	unsigned char *src = _buf_data(buf);
+	size_t sz_left = _buf_len(buf);
+	size_t in_sz;
+	int r;
+
+	strm->next_out = buf->obuf;
+	strm->avail_out = obuf_size;
+
+	while (sz_left > 0) {
+		in_sz = (sz_left < ZLIB_BLOCK_SZ) ? sz_left : ZLIB_BLOCK_SZ;
+
+		/*
+		 * The rest of obuf has room for at least this block, so
+		 * its end is free for sampling.
+		 */
+		assert (strm->avail_out >= in_sz);
+		zlib_set_level(strm, src, in_sz, strm->next_out +
+		    strm->avail_out - ((in_sz < SAMPLE_SCRATCH) ? 0 : SAMPLE_SCRATCH));
+
+		strm->next_in = src;
+		strm->avail_in = in_sz;
+
+		r = deflate(strm, Z_NO_FLUSH);
+		assert (r == Z_OK);
+		assert (strm->avail_in == 0);
+
+		src += in_sz;
+		sz_left -= in_sz;
+	}
+
+	/* With no data since the last flush, there's nothing to flush */
+	r = deflate(strm, flush);
+	assert (r == Z_OK || (r == Z_BUF_ERROR && _buf_len(buf) == 0));
+	assert (strm->avail_out > 0);
+
+	buf->obuf_used = obuf_size - strm->avail_out;
+	buf->crc32 = crc32(crc32(0L, Z_NULL, 0), _buf_data(buf), _buf_len(buf));
+}
+
+/*
+ * Write out (and hand off) a buffer compressed by zlib_compress_buf() and
+ * fold its crc into the stream's.
+ */
+static
+int
+zlib_write_obuf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	struct zlib_state *zlib_ctx = &ctx->zlib_state;
+
+	zlib_ctx->isize += (unsigned int)_buf_len(buf);
+	zlib_ctx->zlib_crc32 = crc32_combine(zlib_ctx->zlib_crc32, buf->crc32,
+	    (z_off_t)_buf_len(buf));
+
+	return _bc_output(ctx, buf, buf->obuf, buf->obuf_used);
+}
+#endif
+
+
+#ifdef _WITH_ZSTD
+static
+int
+zstd_init_cctx(struct buffer_cache_ctx *ctx,
+    const struct buffer_cache_opts *opts)
+{
+	struct zstd_state *zstd_ctx = &ctx->zstd_state;
+	size_t r;
+
+	if ((zstd_ctx->cctx = ZSTD_createCCtx()) == NULL) {
+		fprintf(stderr, "Failed to allocate zstd context\n");
+		return 1;
+	}
+
+	r = ZSTD_CCtx_setParameter(zstd_ctx->cctx, ZSTD_c_compressionLevel,
+	    opts->zstd_level);
+	if (!ZSTD_isError(r))
+		r = ZSTD_CCtx_setParameter(zstd_ctx->cctx, ZSTD_c_checksumFlag,
+		    !(ctx->flags & BC_OPT_FRAMED));
+	if (!ZSTD_isError(r) && (ctx->flags & BC_OPT_ZSTD_LONG))
+		r = ZSTD_CCtx_setParameter(zstd_ctx->cctx,
+		    ZSTD_c_enableLongDistanceMatching, 1);
+	if (ZSTD_isError(r)) {
+		fprintf(stderr, "Failed to set up zstd: %s\n", ZSTD_getErrorName(r));
+		return 1;
+	}
+
+	/* Without multi-threading support in libzstd, do without */
+	if (opts->comp_workers > 0) {
+		r = ZSTD_CCtx_setParameter(zstd_ctx->cctx, ZSTD_c_nbWorkers,
+		    (int)opts->comp_workers);
+		if (ZSTD_isError(r))
+			fprintf(stderr, "Not using zstd worker threads: %s\n",
+			    ZSTD_getErrorName(r));
+	}
+
+	return 0;
+}
+
+/*
+ * Run data through the zstd stream with the given directive and write
+ * out all the output produced.
+ */
+static
+int
+zstd_write_block(struct buffer_cache_ctx *ctx, const void *data, size_t count,
+    ZSTD_EndDirective mode)
+{
+	struct zstd_state *zstd_ctx = &ctx->zstd_state;
+	ZSTD_inBuffer in = { data, count, 0 };
+	ZSTD_outBuffer out;
+	size_t r;
+
+	/*
+	 * With ZSTD_e_continue, zstd keeps back whatever output it likes
+	 * once all input is taken; ZSTD_e_flush and ZSTD_e_end have to go
+	 * on until all of it (and, for the latter, the frame) is out.
+	 */
+	do {
+		out.dst = ctx->comp_obuf;
+		out.size = ZSTD_OBUF_SZ;
+		out.pos = 0;
+
+		r = ZSTD_compressStream2(zstd_ctx->cctx, &out, &in, mode);
+		if (ZSTD_isError(r)) {
+			fprintf(stderr, "Failed to compress: %s\n",
+			    ZSTD_getErrorName(r));
+			return 1;
+		}
+
+		/* Write the compressed output zstd has provided so far */
+		if (_bc_write(ctx, ctx->comp_obuf, out.pos) != 0)
+			return 1;
+	} while ((mode != ZSTD_e_continue) ? (r != 0) : (in.pos < in.size));
+
+	zstd_ctx->ended = (mode == ZSTD_e_end);
+
+	if (mode != ZSTD_e_continue)
+		ctx->comp_pending = 0;
+	else if (count > 0)
+		ctx->comp_pending = 1;
+
+	return 0;
+}
+
+static
+int
+zstd_write_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	if (_buf_len(buf) == 0)
+		return 0;
+
+	/* With an index, each buffer has to be a frame of its own */
+	return zstd_write_block(ctx, _buf_data(buf), _buf_len(buf),
+	    (ctx->flags & BC_OPT_INDEX) ? ZSTD_e_end : ZSTD_e_continue);
+}
+
+static
+int
+zstd_write_tail(struct buffer_cache_ctx *ctx)
+{
+	/* Even without any data, the file has to hold a (empty) frame */
+	if (ctx->zstd_state.ended)
+		return 0;
+
+	return zstd_write_block(ctx, NULL, 0, ZSTD_e_end);
+}
+#endif
+
+
+/*
+ * Add an index entry for the next len bytes of buf, which are about to be
+ * written out. Must be called by the thread doing the writes, in stream
+ * order. A buffer flushed early gets an entry for each piece.
+ */
+static
+void
+_bc_index_add(struct buffer_cache_ctx *ctx, struct bc_buffer *buf, size_t len)
+{
+	struct bc_index_ent *ent;
+	size_t size;
+
+	if (buf->key_set) {
+		ctx->index_key = buf->key;
+		ctx->index_keys = 1;
+		buf->key_set = 0;
+	}
+
+	if (len == 0 || ctx->index_failed)
+		return;
+
+	if (ctx->index_cnt == ctx->index_size) {
+		size = (ctx->index_size > 0) ? 2*ctx->index_size : 1024;
+		ent = realloc(ctx->index, size * sizeof(*ent));
+		if (ent == NULL) {
+			fprintf(stderr, "Failed to grow index of %s, not writing "
+			    "one\n", ctx->file);
+			ctx->index_failed = 1;
+			return;
+		}
+		ctx->index = ent;
+		ctx->index_size = size;
+	}
+
+	ent = &ctx->index[ctx->index_cnt++];
+	ent->uoff = ctx->index_uoff;
+	ent->coff = (uint64_t)ctx->out_off + ctx->dio_len;
+	ent->key = ctx->index_key;
+
+	ctx->index_uoff += len;
+}
+
+/*
+ * Append the index to the (otherwise complete) output. LZ4 readers skip
+ * the skippable frame holding it; for gzip it's split over as many empty
+ * members as needed, each carrying a piece of it in a "BX" extra field.
+ */
+static
+int
+_bc_index_write(struct buffer_cache_ctx *ctx)
+{
+	static const unsigned char gz_tail[BC_INDEX_GZ_TAIL] = { 0x03, 0x00 };
+	unsigned char hdr[16];
+	unsigned char *blob, *ftr;
+	size_t blob_sz, off, n;
+	uint64_t v;
+	uint32_t u;
+	int r = 0;
+
+	if (ctx->index_failed)
+		return 1;
+
+	blob_sz = ctx->index_cnt * sizeof(struct bc_index_ent) + BC_INDEX_FTR_SZ;
+	if (blob_sz > UINT32_MAX || (blob = malloc(blob_sz)) == NULL)
+		return 1;
+
+	if (ctx->index_cnt > 0)
+		memcpy(blob, ctx->index, blob_sz - BC_INDEX_FTR_SZ);
+
+	ftr = blob + blob_sz - BC_INDEX_FTR_SZ;
+	v = (uint64_t)ctx->out_off + ctx->dio_len;
+	memcpy(&ftr[0], &v, 8);
+	v = ctx->index_cnt;
+	memcpy(&ftr[8], &v, 8);
+	u = ctx->index_keys ? BC_INDEX_KEYS : 0;
+	memcpy(&ftr[16], &u, 4);
+	u = BC_INDEX_MAGIC;
+	memcpy(&ftr[20], &u, 4);
+
+	switch (ctx->compress) {
+	case BC_COMP_LZ4:
+	case BC_COMP_ZSTD:
+		/* zstd skips the same skippable frames */
+		u = BC_INDEX_LZ4_MAGIC;
+		memcpy(&hdr[0], &u, 4);
+		u = (uint32_t)blob_sz;
+		memcpy(&hdr[4], &u, 4);
+
+		if (_bc_write(ctx, hdr, 8) != 0 ||
+		    _bc_write(ctx, blob, blob_sz) != 0)
+			r = 1;
+		break;
+
+	case BC_COMP_ZLIB:
+		memset(hdr, 0, sizeof(hdr));
+		hdr[0] = 0x1f; // ID1
+		hdr[1] = 0x8b; // ID2
+		hdr[2] = 0x08; // CM:{deflate}
+		hdr[3] = 0x04; // FLG:{FEXTRA}
+		hdr[9] = 0xff; // OS:{unknown}
+		hdr[12] = 'B'; // SI1
+		hdr[13] = 'X'; // SI2
+
+		for (off = 0; off < blob_sz && r == 0; off += n) {
+			n = blob_sz - off;
+			if (n > BC_INDEX_GZ_CHUNK)
+				n = BC_INDEX_GZ_CHUNK;
+
+			hdr[10] = (n + 4) & 0xFF; // XLEN
+			hdr[11] = (n + 4) >> 8;
+			hdr[14] = n & 0xFF; // LEN
+			hdr[15] = n >> 8;
+
+			/* Followed by an empty deflate stream, crc and isize */
+			if (_bc_write(ctx, hdr, sizeof(hdr)) != 0 ||
+			    _bc_write(ctx, blob + off, n) != 0 ||
+			    _bc_write(ctx, gz_tail, sizeof(gz_tail)) != 0)
+				r = 1;
+		}
+		break;
+
+	default:
+		r = 1;
+	}
+
+	free(blob);
+
+	return r;
+}
+
+/*
+ * Takes the buffer at the head of the drain list. Must be called with
+ * the drain mutex held and a non-empty drain list.
+ */
+static
+struct bc_buffer *
+_drain_pop(struct buffer_cache_ctx *ctx)
+{
+	struct bc_buffer *buf;
+
+	assert (ctx->drain_cnt > 0);
+
+	__atomic_store_n(&ctx->drain_cnt, ctx->drain_cnt - 1, __ATOMIC_RELAXED);
+
+	buf = ctx->drain;
+	ctx->drain = buf->next;
+
+	if (ctx->drain_tail == buf) {
+		ctx->drain_tail = NULL;
+	} else {
+		ctx->drain->prev = NULL;
+		if (ctx->drain->next != NULL)
+			ctx->drain->next->prev = ctx->drain;
+	}
+
+	return buf;
+}
+
+static
+void
+_reset_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	buf->bytes_left = ctx->buffer_size;
+	buf->bytes_used = 0;
+	buf->flushed = 0;
+	buf->bufp = buf->buf + LZ4_EXTRA_SZ;
+	buf->key_set = 0;
+	buf->rec_cnt = 0;
+}
+
+/*
+ * Lock the empty mutex, reinitialize the now-empty buffer and place it
+ * on the head of the empty list.
+ * Signal any listeners that are waiting for buffers to become empty
+ * (either _write or _destroy).
+ */
+static
+void
+_recycle_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	/* A stripe's buffers belong to the striped ctx */
+	if (ctx->pool != NULL)
+		ctx = ctx->pool;
+
+	/* An engine's go straight back to the engine */
+	if (ctx->engine != NULL) {
+		_engine_put_buf(ctx, buf);
+
+		pthread_mutex_lock(&ctx->empty_mtx);
+		--ctx->buf_alloc_cnt;
+		++ctx->eng_wake;
+		pthread_cond_broadcast(&ctx->empty_cv);
+		pthread_mutex_unlock(&ctx->empty_mtx);
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->empty_mtx);
+
+	_reset_buf(ctx, buf);
+	buf->idle_since = _bc_now();
+	buf->prev = NULL;
+	buf->next = ctx->empty;
+	ctx->empty = buf;
+	assert (ctx->empty != NULL);
+	++ctx->empty_cnt;
+
+	pthread_cond_broadcast(&ctx->empty_cv);
+	pthread_mutex_unlock(&ctx->empty_mtx);
+}
+
+/*
+ * Prefer ctx->numa_node for the pages of mem. Failure (say, without NUMA
+ * support in the kernel) just leaves them wherever they'd go anyway.
+ */
+static
+void
+_bc_mem_bind(struct buffer_cache_ctx *ctx, void *mem, size_t len)
+{
+	unsigned long mask[NUMA_NODES / (8 * sizeof(unsigned long))];
+	unsigned int bits = 8 * sizeof(unsigned long);
+
+	memset(mask, 0, sizeof(mask));
+	mask[ctx->numa_node / bits] = 1UL << (ctx->numa_node % bits);
+
+	(void)syscall(SYS_mbind, mem, len, MPOL_PREFERRED, mask, NUMA_NODES + 1, 0);
+}
+
+/*
+ * Maps at least *len bytes of memory aligned to ctx->buf_align, and sets
+ * *len to the size of the mapping. With BC_OPT_HUGE_PAGES, reserved huge
+ * pages are used if there are any left; otherwise the mapping is aligned
+ * to the huge page size and offered to transparent huge pages. The memory
+ * is only faulted in as it's written to, going where it's been placed.
+ */
+static
+void *
+_bc_mem_alloc(struct buffer_cache_ctx *ctx, size_t *len)
+{
+	size_t page_sz = (size_t)sysconf(_SC_PAGESIZE);
+	size_t align, sz, head, tail;
+	unsigned char *mem;
+
+	if (ctx->flags & BC_OPT_HUGE_PAGES) {
+		sz = (*len + HUGE_PAGE_SZ - 1) & ~((size_t)HUGE_PAGE_SZ - 1);
+		mem = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED)
+			goto place;
+	}
+
+	align = (ctx->flags & BC_OPT_HUGE_PAGES) ? HUGE_PAGE_SZ : ctx->buf_align;
+	if (align < page_sz)
+		align = page_sz;
+	sz = (*len + page_sz - 1) & ~(page_sz - 1);
+
+	/* Map enough to trim it down to an aligned mapping */
+	mem = mmap(NULL, sz + align - page_sz, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	head = (align - ((uintptr_t)mem & (align - 1))) & (align - 1);
+	tail = align - page_sz - head;
+	if (head > 0)
+		munmap(mem, head);
+	if (tail > 0)
+		munmap(mem + head + sz, tail);
+	mem += head;
+
+	if (ctx->flags & BC_OPT_HUGE_PAGES)
+		madvise(mem, sz, MADV_HUGEPAGE);
+
+place:
+	if (ctx->flags & BC_OPT_NUMA_LOCAL)
+		_bc_mem_bind(ctx, mem, sz);
+
+	*len = sz;
+
+	return mem;
+}
+
+static
+struct bc_buffer *
+_alloc_buf(struct buffer_cache_ctx *ctx)
+{
+	struct bc_buffer *buf;
+	size_t len;
+
+	if ((buf = malloc(sizeof(*buf))) == NULL)
+		return NULL;
+
+	memset(buf, 0, sizeof(*buf));
+
+	len = ctx->buffer_size + LZ4_EXTRA_SZ;
+	if ((buf->buf = _bc_mem_alloc(ctx, &len)) == NULL) {
+		free(buf);
+		return NULL;
+	}
+	buf->buf_len = len;
+
+	/*
+	 * The output buffer gets a block of scratch space in front for
+	 * O_DIRECT, see _bc_dio_prepare().
+	 */
+	if (ctx->obuf_size > 0) {
+		len = ctx->obuf_size + ctx->dio_align;
+		if ((buf->obuf_mem = _bc_mem_alloc(ctx, &len)) == NULL) {
+			munmap(buf->buf, buf->buf_len);
+			free(buf);
+			return NULL;
+		}
+
+		buf->obuf_len = len;
+		buf->obuf = buf->obuf_mem + ctx->dio_align;
+	}
+
+	buf->bufp = buf->buf + LZ4_EXTRA_SZ;
+	buf->bytes_left = ctx->buffer_size;
+	buf->bytes_used = 0;
+	buf->idle_since = _bc_now();
+
+	return buf;
+}
+
+static
+void
+_free_buf(struct bc_buffer *buf)
+{
+	if (buf->obuf_mem != NULL)
+		munmap(buf->obuf_mem, buf->obuf_len);
+
+	munmap(buf->buf, buf->buf_len);
+	free(buf);
+}
+
+/*
+ * Hand work to a thread waiting in _bc_wait(), with the mutex it waits
+ * with held.
+ */
+static
+void
+_bc_wake(pthread_cond_t *cv, unsigned int parked)
+{
+	if (parked > 0)
+		pthread_cond_signal(cv);
+}
+
+/*
+ * Put ctx on the ready queue of its engine, unless it is there already
+ * or being worked on. Called with the drain mutex and the engine mutex
+ * held.
+ */
+static
+void
+_engine_queue(struct buffer_cache_engine *eng, struct buffer_cache_ctx *ctx)
+{
+	if (ctx->eng_sched)
+		return;
+
+	ctx->eng_sched = 1;
+	ctx->eng_next = NULL;
+	if (eng->ready_tail == NULL)
+		__atomic_store_n(&eng->ready, ctx, __ATOMIC_RELAXED);
+	else
+		eng->ready_tail->eng_next = ctx;
+	eng->ready_tail = ctx;
+	_bc_wake(&eng->cv, eng->parked);
+}
+
+/*
+ * _engine_queue() for callers holding just the drain mutex.
+ */
+static
+void
+_engine_sched(struct buffer_cache_ctx *ctx)
+{
+	struct buffer_cache_engine *eng = ctx->engine;
+
+	if (ctx->eng_sched)
+		return;
+
+	pthread_mutex_lock(&eng->mtx);
+	_engine_queue(eng, ctx);
+	pthread_mutex_unlock(&eng->mtx);
+}
+
+/*
+ * Find the producer of ctx whose current buffer has been current the
+ * longest, if that is before *oldest (which is then updated), skipping
+ * those that are busy with theirs. Called with the producers mutex held.
+ */
+static
+struct bc_producer *
+_engine_oldest(struct buffer_cache_ctx *ctx, uint64_t *oldest)
+{
+	struct bc_producer *prod, *found = NULL;
+	uint64_t t;
+
+	for (prod = &ctx->sp; prod != NULL;
+	    prod = (prod == &ctx->sp) ? ctx->producers : prod->next) {
+		if (__atomic_load_n(&prod->current_wr, __ATOMIC_RELAXED) == NULL)
+			continue;
+
+		if (__atomic_load_n(&prod->busy, __ATOMIC_RELAXED))
+			continue;
+
+		if ((t = __atomic_load_n(&prod->held_since,
+		    __ATOMIC_RELAXED)) < *oldest) {
+			*oldest = t;
+			found = prod;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * The pool is used up and every buffer in it is some producer's current
+ * one, so none would ever come back if those producers have gone idle:
+ * take the buffer that has been current the longest away from its
+ * producer and drain it, like the producer would have. Producers that
+ * are in the middle of a write (or hold a reservation) keep theirs, and
+ * so does one that is only just installing its buffer; returns 1 if one
+ * of those, or a mutex that's taken, kept it from taking any.
+ *
+ * Called with the engine mutex held, which keeps the ctxs from going
+ * away. Their producers and drain mutexes come before it, so those are
+ * only tried.
+ */
+static
+int
+_engine_steal(struct buffer_cache_engine *eng)
+{
+	struct buffer_cache_ctx *ctx, *victim = NULL;
+	struct bc_producer *prod;
+	struct bc_buffer *buf = NULL;
+	uint64_t oldest = UINT64_MAX;
+
+	for (ctx = eng->ctxs; ctx != NULL; ctx = ctx->eng_ctx_next) {
+		if (pthread_mutex_trylock(&ctx->prod_mtx) != 0)
+			continue;
+		if (_engine_oldest(ctx, &oldest) != NULL)
+			victim = ctx;
+		pthread_mutex_unlock(&ctx->prod_mtx);
+	}
+
+	if (victim == NULL)
+		return 1;
+
+	if (pthread_mutex_trylock(&victim->prod_mtx) != 0)
+		return 1;
+	if (pthread_mutex_trylock(&victim->drain_mtx) != 0) {
+		pthread_mutex_unlock(&victim->prod_mtx);
+		return 1;
+	}
+
+	oldest = UINT64_MAX;
+	if ((prod = _engine_oldest(victim, &oldest)) != NULL) {
+		__atomic_store_n(&prod->stealing, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&prod->busy, __ATOMIC_SEQ_CST)) {
+			buf = prod->current_wr;
+			__atomic_store_n(&prod->current_wr, NULL,
+			    __ATOMIC_RELAXED);
+
+			prod->seq = buf->prod_seq + buf->bytes_used;
+			prod->ticket = _drain_push(victim, buf);
+			--eng->held;
+			_engine_queue(eng, victim);
+		}
+		__atomic_store_n(&prod->stealing, 0, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&victim->drain_mtx);
+	pthread_mutex_unlock(&victim->prod_mtx);
+
+	return (buf == NULL);
+}
+
+/*
+ * Take a buffer from the engine's pool for ctx, allocating one if the
+ * pool isn't at its limit yet, or else making one come back by taking it
+ * from an idle producer. Otherwise, ctx goes on the starved list and NULL
+ * is returned; eng_wake changes when it is worth another try.
+ *
+ * Must not be called with the empty mutex held, which _engine_put_buf()
+ * takes with the engine mutex held.
+ */
+static
+struct bc_buffer *
+_engine_get_buf(struct buffer_cache_ctx *ctx)
+{
+	struct buffer_cache_engine *eng = ctx->engine;
+	struct bc_buffer *buf;
+
+	pthread_mutex_lock(&eng->mtx);
+
+	for (;;) {
+		if ((buf = eng->free) != NULL) {
+			eng->free = buf->next;
+			++eng->held;
+			pthread_mutex_unlock(&eng->mtx);
+			return buf;
+		}
+
+		if (eng->buf_cnt < eng->buf_max) {
+			++eng->buf_cnt;
+			++eng->held;
+			pthread_mutex_unlock(&eng->mtx);
+
+			if ((buf = _alloc_buf(ctx)) != NULL)
+				return buf;
+
+			pthread_mutex_lock(&eng->mtx);
+			--eng->buf_cnt;
+			--eng->held;
+			fprintf(stderr, "Failed to allocate buffer, engine "
+			    "staying at %ju\n", eng->buf_cnt);
+			eng->buf_max = eng->buf_cnt;
+		}
+
+		/*
+		 * Wait for the buffers on their way back, if any. If the
+		 * only ones to take were busy, look again shortly.
+		 */
+		if (eng->held < eng->buf_cnt || !_engine_steal(eng))
+			break;
+
+		pthread_mutex_unlock(&eng->mtx);
+		sched_yield();
+		pthread_mutex_lock(&eng->mtx);
+	}
+
+	if (!ctx->eng_starved) {
+		ctx->eng_starved = 1;
+		ctx->eng_starved_next = eng->starved;
+		eng->starved = ctx;
+	}
+
+	pthread_mutex_unlock(&eng->mtx);
+
+	return NULL;
+}
+
+/*
+ * Return a buffer of ctx to the engine's pool and wake everyone waiting
+ * for one: they all get to try, so a ctx that still has buffers of its
+ * own coming back can't keep the others waiting forever.
+ */
+static
+void
+_engine_put_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	struct buffer_cache_engine *eng = ctx->engine;
+	struct buffer_cache_ctx *c;
+
+	_reset_buf(ctx, buf);
+	buf->prev = NULL;
+
+	pthread_mutex_lock(&eng->mtx);
+
+	buf->next = eng->free;
+	eng->free = buf;
+
+	while ((c = eng->starved) != NULL) {
+		eng->starved = c->eng_starved_next;
+		c->eng_starved = 0;
+
+		pthread_mutex_lock(&c->empty_mtx);
+		++c->eng_wake;
+		pthread_cond_broadcast(&c->empty_cv);
+		pthread_mutex_unlock(&c->empty_mtx);
+	}
+
+	pthread_mutex_unlock(&eng->mtx);
+}
+
+/*
+ * Take ctx off its engine, once it has no buffers any more and isn't
+ * scheduled.
+ */
+static
+void
+_engine_detach(struct buffer_cache_ctx *ctx)
+{
+	struct buffer_cache_engine *eng = ctx->engine;
+	struct buffer_cache_ctx **cp;
+
+	pthread_mutex_lock(&eng->mtx);
+
+	for (cp = &eng->starved; *cp != NULL; cp = &(*cp)->eng_starved_next) {
+		if (*cp == ctx) {
+			*cp = ctx->eng_starved_next;
+			break;
+		}
+	}
+
+	for (cp = &eng->ctxs; *cp != ctx; cp = &(*cp)->eng_ctx_next)
+		;
+	*cp = ctx->eng_ctx_next;
+
+	--eng->ctx_cnt;
+	pthread_mutex_unlock(&eng->mtx);
+}
+
+/*
+ * Free the buffers that have been on the empty list for ctx->idle_ns or
+ * longer, as long as more than ctx->buf_min are allocated.
+ */
+static
+void
+_bc_pool_shrink(struct buffer_cache_ctx *ctx)
+{
+	struct bc_buffer **bufp, *buf, *idle = NULL;
+	uint64_t now = _bc_now();
+
+	pthread_mutex_lock(&ctx->empty_mtx);
+
+	for (bufp = &ctx->empty; (buf = *bufp) != NULL; ) {
+		if (ctx->buf_alloc_cnt <= ctx->buf_min ||
+		    now - buf->idle_since < ctx->idle_ns) {
+			bufp = &buf->next;
+			continue;
+		}
+
+		*bufp = buf->next;
+		--ctx->empty_cnt;
+		--ctx->buf_alloc_cnt;
+
+		buf->next = idle;
+		idle = buf;
+	}
+
+	/* buffer_cache_destroy() may be waiting on buf_alloc_cnt */
+	if (idle != NULL)
+		pthread_cond_broadcast(&ctx->empty_cv);
+
+	pthread_mutex_unlock(&ctx->empty_mtx);
+
+	while ((buf = idle) != NULL) {
+		idle = buf->next;
+		_free_buf(buf);
+	}
+}
+
+/*
+ * Write out len bytes of a producer's current buffer at data, ending the
+ * compressed stream's output on a boundary so that all of it goes out.
+ */
+static
+int
+_bc_flush_data(struct buffer_cache_ctx *ctx, unsigned char *data, size_t len)
+{
+#ifndef _WITHOUT_LZ4
+	void *strm = NULL;
+#endif
+
+	switch (ctx->compress) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		/*
+		 * The data in front of it isn't necessarily what precedes
+		 * it in the stream, so it doesn't link back. It's already
+		 * been kept for the buffers that follow by _bc_age_claim().
+		 */
+		if (ctx->lz4_state.linked) {
+			strm = ctx->lz4_state.lz4_state;
+			LZ4_resetStreamState(strm, (const char *)data);
+		}
+		return lz4_write_data(ctx, strm, data, len);
+#endif
+
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		/* The workers' output since may not refer back into it */
+		if (ctx->comp_workers > 0)
+			deflateReset(&ctx->zlib_state.zlib_strm);
+		return zlib_write_data(ctx, data, len,
+		    (ctx->flags & BC_OPT_INDEX) ? Z_FULL_FLUSH : Z_SYNC_FLUSH);
+#endif
+
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		return zstd_write_block(ctx, data, len,
+		    (ctx->flags & BC_OPT_INDEX) ? ZSTD_e_end : ZSTD_e_flush);
+#endif
+
+	case BC_COMP_NONE:
+	default:
+		return _bc_write(ctx, data, len);
+	}
+}
+
+/*
+ * With O_DIRECT, write out the partial block held back at the end, padded
+ * like at the end of the file, without moving on: the next write covers
+ * that block again.
+ */
+static
+int
+_bc_dio_flush_tail(struct buffer_cache_ctx *ctx)
+{
+	off_t off = ctx->out_off;
+	int r;
+
+	if (ctx->dio_len == 0)
+		return 0;
+
+	memset(ctx->dio_buf + ctx->dio_len, 0, ctx->dio_align - ctx->dio_len);
+	r = _bc_pwrite(ctx, ctx->dio_buf, ctx->dio_align);
+	ctx->out_off = off;
+
+	return r;
+}
+
+static int _bc_rotate_due(struct buffer_cache_ctx *ctx);
+static void _bc_rotate(struct buffer_cache_ctx *ctx);
+
+/*
+ * Claim whatever prod's current buffer holds beyond what was flushed
+ * before for _bc_age_flush(), if that has been waiting for max_age_ns,
+ * by putting the buffer on the end of list (tail points at its last
+ * next pointer). Called with the drain mutex held, which is also what
+ * the history of linked LZ4 blocks is kept under, in stream order.
+ */
+static
+void
+_bc_age_claim(struct buffer_cache_ctx *ctx, struct bc_producer *prod,
+    uint64_t now, struct bc_buffer ***tail)
+{
+	struct bc_buffer *buf;
+	size_t used;
+
+	if ((buf = __atomic_load_n(&prod->current_wr, __ATOMIC_ACQUIRE)) == NULL)
+		return;
+
+	used = __atomic_load_n(&buf->bytes_used, __ATOMIC_ACQUIRE);
+	if (used == buf->flushed || now - buf->dirty_at < ctx->max_age_ns)
+		return;
+
+#ifndef _WITHOUT_LZ4
+	if (ctx->compress == BC_COMP_LZ4 && ctx->lz4_state.link_bufs)
+		lz4_link_keep(&ctx->lz4_state, _buf_data(buf),
+		    used - buf->flushed);
+#endif
+
+	buf->age_off = buf->flushed;
+	buf->flushed = used;
+	buf->dirty_at = now;
+	buf->age_flushing = 1;
+	buf->age_next = NULL;
+	**tail = buf;
+	*tail = &buf->age_next;
+}
+
+/*
+ * max_age_ms: flush the producers' partially filled buffers that have
+ * been holding data for too long. The producers keep on writing to them
+ * meanwhile; only their committed bytes (bytes_used, see
+ * buffer_cache_write()) are written out, and the rest of the buffer
+ * follows once it's drained as usual.
+ *
+ * To keep the output in order, this is only done once everything drained
+ * before has been written out (or queued, with io_uring). Under the
+ * drain mutex, the bytes to flush are claimed by moving the buffers'
+ * flushed offset past them; a producer clears its current_wr before
+ * draining its buffer, so the one seen here is not on the drain list
+ * yet. The writing is done without holding any locks, so producers
+ * don't wait for it. Buffers drained meanwhile are only written out
+ * (and recycled) by this same thread, after the flush, but one that is
+ * being flushed mustn't be taken by _drain_steal() or by a compression
+ * worker (which puts the link history in front of the rest) before then.
+ */
+static
+void
+_bc_age_flush(struct buffer_cache_ctx *ctx)
+{
+	struct bc_buffer *list = NULL, **tail = &list, *buf;
+	struct bc_producer *prod;
+	uint64_t now = _bc_now();
+	size_t len;
+	int r;
+
+	pthread_mutex_lock(&ctx->prod_mtx);
+	pthread_mutex_lock(&ctx->drain_mtx);
+
+	if (ctx->drain_cnt == 0 && ctx->pop_seq == ctx->write_seq) {
+		_bc_age_claim(ctx, &ctx->sp, now, &tail);
+		for (prod = ctx->producers; prod != NULL; prod = prod->next)
+			_bc_age_claim(ctx, prod, now, &tail);
+	}
+
+	pthread_mutex_unlock(&ctx->drain_mtx);
+	pthread_mutex_unlock(&ctx->prod_mtx);
+
+	if (list == NULL)
+		return;
+
+	for (buf = list; buf != NULL; buf = buf->age_next) {
+		len = buf->flushed - buf->age_off;
+		if (ctx->sync_failed) {
+			_bc_drop(ctx, len, 0);
+			continue;
+		}
+		if (_bc_rotate_due(ctx))
+			_bc_rotate(ctx);
+		if (ctx->flags & BC_OPT_INDEX)
+			_bc_index_add(ctx, buf, len);
+
+		__atomic_fetch_add(&ctx->st_bytes_in, len, __ATOMIC_RELAXED);
+		r = _bc_flush_data(ctx, buf->buf + LZ4_EXTRA_SZ + buf->age_off,
+		    len);
+		if (r != 0)
+			_bc_io_failed(ctx);
+		ctx->sync_dirty = 1;
+	}
+
+	if ((ctx->flags & BC_OPT_DIRECT_IO) && _bc_dio_flush_tail(ctx) != 0)
+		fprintf(stderr, "Failed to flush %s\n", ctx->file);
+
+	pthread_mutex_lock(&ctx->drain_mtx);
+	for (buf = list; buf != NULL; buf = buf->age_next)
+		buf->age_flushing = 0;
+	if (ctx->comp_workers > 0)
+		pthread_cond_broadcast(&ctx->drain_cv);
+	pthread_mutex_unlock(&ctx->drain_mtx);
+}
+
+/*
+ * Have the compressor put out everything it has taken in so far.
+ */
+static
+int
+_bc_comp_flush(struct buffer_cache_ctx *ctx)
+{
+	if (!ctx->comp_pending)
+		return 0;
+
+	switch (ctx->compress) {
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		return zlib_write_block(ctx, NULL, 0, Z_SYNC_FLUSH);
+#endif
+
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		return zstd_write_block(ctx, NULL, 0, ZSTD_e_flush);
+#endif
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Whether the I/O thread should sync now: a producer is waiting for what
+ * has been written out, or the durability mode asks for it. idle is set
+ * if there is no buffer to write out right now.
+ */
+static
+int
+_bc_sync_due(struct buffer_cache_ctx *ctx, int idle)
+{
+	uint64_t req;
+
+	if (!ctx->sync_dirty || ctx->sync_failed)
+		return 0;
+
+	req = __atomic_load_n(&ctx->sync_req, __ATOMIC_ACQUIRE);
+	if (req > ctx->synced_ticket && ctx->written_ticket >= req)
+		return 1;
+
+	switch (ctx->durability) {
+	case BC_DUR_BUFFER:
+		/* Group commit: one sync for all the buffers queued up */
+		return idle || ctx->written_ticket - ctx->synced_ticket >=
+		    ctx->buf_max;
+
+	case BC_DUR_PERIODIC:
+		return _bc_now() >= ctx->sync_at;
+
+	case BC_DUR_NONE:
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Let the producers waiting for tickets up to ticket know that those are
+ * durable now, or that they never will be (r != 0).
+ */
+static
+void
+_bc_sync_done(struct buffer_cache_ctx *ctx, uint64_t ticket, int r)
+{
+	ctx->sync_dirty = 0;
+	ctx->sync_at = _bc_now() + ctx->sync_ns;
+
+	pthread_mutex_lock(&ctx->sync_mtx);
+	if (r != 0) {
+		fprintf(stderr, "Failed to sync %s\n", ctx->file);
+		ctx->sync_failed = 1;
+	} else {
+		ctx->synced_ticket = ticket;
+	}
+	pthread_cond_broadcast(&ctx->durable_cv);
+	pthread_mutex_unlock(&ctx->sync_mtx);
+}
+
+/*
+ * Make everything written out so far durable and let the producers
+ * waiting for it know. Called by the I/O thread, between writes.
+ */
+static
+void
+_bc_sync(struct buffer_cache_ctx *ctx)
+{
+	uint64_t ticket = ctx->written_ticket;
+	int r;
+
+	r = _bc_comp_flush(ctx);
+	if (r == 0)
+		r = _bc_io_wait(ctx);
+	if (r == 0 && (ctx->flags & BC_OPT_DIRECT_IO))
+		r = _bc_dio_flush_tail(ctx);
+	if (r == 0 && fdatasync(ctx->fd) != 0)
+		r = 1;
+
+	_bc_sync_done(ctx, ticket, r);
+}
+
+/*
+ * Finish the output file: end the compressed stream, append the index and
+ * cut an O_DIRECT file back to its real size. With index 0, no index is
+ * written (the ctx never got as far as writing anything).
+ */
+static
+int
+_bc_finish_file(struct buffer_cache_ctx *ctx, int index)
+{
+	int r = 0;
+
+	switch (ctx->compress) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		if (ctx->lz4_state.hdr_written)
+			r = lz4_write_tail(ctx);
+		break;
+#endif
+
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		if (ctx->zlib_state.hdr_written)
+			r = zlib_write_tail(ctx);
+		break;
+#endif
+
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		if (ctx->zstd_state.cctx != NULL)
+			r = zstd_write_tail(ctx);
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	if (index && (ctx->flags & BC_OPT_INDEX) && _bc_index_write(ctx) != 0) {
+		fprintf(stderr, "Failed to write index to %s\n", ctx->file);
+		r = 1;
+	}
+
+	if (ctx->flags & BC_OPT_DIRECT_IO)
+		r |= _bc_dio_finish(ctx);
+
+	return r;
+}
+
+/*
+ * Name of output file number idx, started at time t; see rotate_mb in
+ * buffer_cache.h. Returns NULL if it doesn't fit.
+ */
+static
+char *
+_bc_file_name(struct buffer_cache_ctx *ctx, unsigned int idx, time_t t)
+{
+	const char *p = ctx->file_pattern;
+	char fmt[PATH_MAX], name[PATH_MAX];
+	struct tm tm;
+	size_t n = 0;
+
+	/* Leaves room for a number or a conversion on every round */
+	while (*p != '\0' && n < sizeof(fmt) - 16) {
+		if (p[0] == '%' && p[1] == 'i') {
+			n += (size_t)snprintf(fmt + n, sizeof(fmt) - n, "%u", idx);
+			p += 2;
+			continue;
+		}
+		if (p[0] == '%' && p[1] != '\0')
+			fmt[n++] = *p++;
+		fmt[n++] = *p++;
+	}
+
+	if (*p != '\0')
+		return NULL;
+	fmt[n] = '\0';
+
+	localtime_r(&t, &tm);
+	if (strftime(name, sizeof(name), fmt, &tm) == 0)
+		return NULL;
+
+	/*
+	 * Files that would get the same name as the one before (always,
+	 * without any % in the pattern) are told apart by their number.
+	 */
+	if (ctx->file_stem != NULL && strcmp(name, ctx->file_stem) == 0) {
+		n = strlen(name);
+		if (snprintf(name + n, sizeof(name) - n, ".%u", idx) >=
+		    (int)(sizeof(name) - n))
+			return NULL;
+	} else {
+		free(ctx->file_stem);
+		if ((ctx->file_stem = strdup(name)) == NULL)
+			return NULL;
+	}
+
+	return strdup(name);
+}
+
+/*
+ * Open (and truncate) an output file, with O_DIRECT for BC_OPT_DIRECT_IO
+ * if the file system supports it.
+ */
+static
+int
+_bc_open(const char *file, int flags)
+{
+	int fd;
+
+	if (flags & BC_OPT_DIRECT_IO) {
+		fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 00666);
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+	}
+
+	return open(file, O_WRONLY | O_CREAT | O_TRUNC, 00666);
+}
+
+/*
+ * rotate_sec: schedule the next rotation for the next multiple of it in
+ * wall clock time, past the last one.
+ */
+static
+void
+_bc_rotate_sched(struct buffer_cache_ctx *ctx)
+{
+	struct timespec ts;
+	uint64_t rt, next;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rt = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+
+	next = (rt / ctx->rotate_ns + 1) * ctx->rotate_ns;
+	if (next <= ctx->rotate_rt)
+		next = ctx->rotate_rt + ctx->rotate_ns;
+
+	ctx->rotate_at = _bc_now() + (next - rt);
+	ctx->rotate_rt = next;
+}
+
+static
+int
+_bc_rotate_due(struct buffer_cache_ctx *ctx)
+{
+	if (ctx->rotate_bytes > 0 &&
+	    (uint64_t)ctx->out_off + ctx->dio_len >= ctx->rotate_limit)
+		return 1;
+
+	return (ctx->rotate_ns > 0 && _bc_now() >= ctx->rotate_at);
+}
+
+/*
+ * Move on to the next output file: finish and sync the current one, and
+ * start the next one with a fresh stream. Called by the I/O thread,
+ * between writes. If the next file can't be opened, output stays in the
+ * current one until the next rotation is due.
+ */
+static
+void
+_bc_rotate(struct buffer_cache_ctx *ctx)
+{
+	uint64_t ticket = ctx->written_ticket;
+	time_t t = time(NULL);
+	char *file;
+	int fd = -1;
+	int r;
+
+	if (ctx->rotate_ns > 0 && _bc_now() >= ctx->rotate_at) {
+		/* Named for the time it was due, not a moment before */
+		if ((uint64_t)t < ctx->rotate_rt / 1000000000ULL)
+			t = (time_t)(ctx->rotate_rt / 1000000000ULL);
+		_bc_rotate_sched(ctx);
+	}
+
+	/* Try again after another rotate_mb */
+	ctx->rotate_limit = (uint64_t)ctx->out_off + ctx->dio_len +
+	    ctx->rotate_bytes;
+
+	file = _bc_file_name(ctx, ctx->file_idx + 1, t);
+	if (file == NULL || (fd = _bc_open(file, ctx->flags)) < 0) {
+		fprintf(stderr, "Failed to open file %s, staying at %s\n",
+		    (file != NULL) ? file : ctx->file_pattern, ctx->file);
+		free(file);
+		return;
+	}
+
+	/* Writes in flight go to the current file */
+	r = _bc_io_wait(ctx);
+	if (r == 0)
+		r = _bc_finish_file(ctx, 1);
+	if (r == 0 && fdatasync(ctx->fd) != 0)
+		r = 1;
+
+	_bc_sync_done(ctx, ticket, r);
+	close(ctx->fd);
+	free(ctx->file);
+
+	ctx->fd = fd;
+	ctx->file = file;
+	++ctx->file_idx;
+
+	ctx->out_off = 0;
+	ctx->dio_len = 0;
+	ctx->rotate_limit = ctx->rotate_bytes;
+	ctx->comp_pending = 0;
+
+	ctx->index_cnt = 0;
+	ctx->index_uoff = 0;
+	ctx->index_failed = 0;
+
+	r = 0;
+	switch (ctx->compress) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		/*
+		 * With compression workers, buffers may already have been
+		 * linked to the data so far, see _seq_thr().
+		 */
+		if (ctx->comp_workers > 0)
+			ctx->lz4_state.new_file = 1;
+		else
+			ctx->lz4_state.link_len = 0;
+
+		if (ctx->lz4_state.stream_checksum &&
+		    (ctx->lz4_state.xxh32_state = XXH32_init(0)) == NULL)
+			ctx->lz4_state.stream_checksum = 0;
+		r = lz4_write_hdr(ctx);
+		break;
+#endif
+
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		deflateReset(&ctx->zlib_state.zlib_strm);
+		ctx->zlib_state.isize = 0;
+		ctx->zlib_state.zlib_crc32 = crc32(0L, Z_NULL, 0);
+		r = zlib_write_hdr(ctx);
+		break;
+#endif
+
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		/* The next frame starts with the next data */
+		ctx->zstd_state.ended = 0;
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	if (r != 0)
+		fprintf(stderr, "Failed to write header to %s\n", ctx->file);
+}
+
+/*
+ * Wait on cv for the I/O thread. Every tick_ns, no matter how often the
+ * thread is woken up, it looks for idle buffers to free (idle_shrink_ms,
+ * every half of that, so they are freed after at most one and a half
+ * times it) and for buffers to flush (max_age_ms, every quarter). With
+ * BC_DUR_PERIODIC, it also wakes up every quarter of sync_interval_ms to
+ * see if it's time to sync. With rotate_sec, it wakes up to rotate on
+ * time. The caller has to check whatever it is waiting for again in any
+ * case.
+ */
+static
+void
+_bc_idle_wait(struct buffer_cache_ctx *ctx, pthread_cond_t *cv,
+    pthread_mutex_t *mtx)
+{
+	struct timespec ts;
+	uint64_t now, until;
+
+	if (ctx->tick_ns == 0 && ctx->rotate_ns == 0) {
+		pthread_cond_wait(cv, mtx);
+		return;
+	}
+
+	now = _bc_now();
+
+	if (ctx->rotate_ns > 0 && now >= ctx->rotate_at) {
+		pthread_mutex_unlock(mtx);
+		_bc_rotate(ctx);
+		pthread_mutex_lock(mtx);
+		return;
+	}
+
+	if (ctx->tick_ns > 0 && now >= ctx->tick_at) {
+		ctx->tick_at = now + ctx->tick_ns;
+		pthread_mutex_unlock(mtx);
+		if (ctx->idle_ns > 0)
+			_bc_pool_shrink(ctx);
+		if (ctx->max_age_ns > 0)
+			_bc_age_flush(ctx);
+		pthread_mutex_lock(mtx);
+		return;
+	}
+
+	until = (ctx->tick_ns > 0) ? ctx->tick_at : UINT64_MAX;
+	if (ctx->rotate_ns > 0 && ctx->rotate_at < until)
+		until = ctx->rotate_at;
+
+	ts.tv_sec = (time_t)(until / 1000000000ULL);
+	ts.tv_nsec = (long)(until % 1000000000ULL);
+
+	pthread_cond_timedwait(cv, mtx, &ts);
+}
+
+/*
+ * How all threads consuming work (I/O threads, compression workers and
+ * engine threads) wait for it, with mtx held. The first call, with *spun
+ * clear, polls ready(arg) for spin_ns without the mutex; later ones go
+ * to sleep on cv. A thread is only counted in *parked while asleep, and
+ * whoever hands it work need only signal cv when that's non-zero (see
+ * _bc_wake()): a thread still spinning or busy finds the work without
+ * the system call. With ctx, the sleep is an _bc_idle_wait(). Either
+ * way, the caller has to check again whatever it is waiting for.
+ */
+static
+void
+_bc_wait(struct buffer_cache_ctx *ctx, uint64_t spin_ns,
+    int (*ready)(void *), void *arg, pthread_cond_t *cv,
+    pthread_mutex_t *mtx, unsigned int *parked, int *spun)
+{
+	uint64_t until;
+	unsigned int i;
+
+	if (!*spun && spin_ns > 0) {
+		*spun = 1;
+		pthread_mutex_unlock(mtx);
+
+		until = _bc_now() + spin_ns;
+		for (i = 0; !ready(arg); i++) {
+			if ((i & 63) == 63 && _bc_now() >= until)
+				break;
+			CPU_RELAX();
+		}
+
+		pthread_mutex_lock(mtx);
+		return;
+	}
+
+	++*parked;
+	if (ctx != NULL)
+		_bc_idle_wait(ctx, cv, mtx);
+	else
+		pthread_cond_wait(cv, mtx);
+	--*parked;
+}
+
+static
+int
+_drain_ready(void *arg)
+{
+	struct buffer_cache_ctx *ctx = (struct buffer_cache_ctx *)arg;
+
+	return (__atomic_load_n(&ctx->drain_cnt, __ATOMIC_RELAXED) > 0);
+}
+
+static
+int
+_seq_ready(void *arg)
+{
+	struct bc_buffer **slotp = (struct bc_buffer **)arg;
+
+	return (__atomic_load_n(slotp, __ATOMIC_RELAXED) != NULL);
+}
+
+static
+int
+_engine_ready(void *arg)
+{
+	struct buffer_cache_engine *eng = (struct buffer_cache_engine *)arg;
+
+	return (__atomic_load_n(&eng->ready, __ATOMIC_RELAXED) != NULL);
+}
+
+/*
+ * Compression worker: takes buffers off the drain list, compresses them
+ * into their obuf and hands them on to the I/O thread (_seq_thr) via the
+ * sequence ring.
+ */
+static
+void *
+_comp_thr(void *priv)
+{
+	struct bc_worker *wrk = (struct bc_worker *)priv;
+	struct buffer_cache_ctx *ctx = wrk->ctx;
+	struct bc_buffer *buf;
+	uint64_t start;
+	int spun;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->drain_mtx);
+
+		/* Not one that is still being flushed, see _bc_age_flush() */
+		spun = 0;
+		while ((ctx->drain_cnt == 0 || ctx->drain->age_flushing) &&
+		    !ctx->exit_drain)
+			_bc_wait(NULL, ctx->spin_ns, _drain_ready, ctx,
+			    &ctx->drain_cv, &ctx->drain_mtx, &ctx->drain_parked,
+			    &spun);
+
+		if (ctx->drain_cnt == 0) {
+			pthread_mutex_unlock(&ctx->drain_mtx);
+			return NULL;
+		}
+
+		/*
+		 * The sequence number has to be assigned while still
+		 * holding the drain mutex so that it reflects the order
+		 * of the drain list.
+		 */
+		buf = _drain_pop(ctx);
+		buf->seq = ctx->pop_seq++;
+
+#ifndef _WITHOUT_LZ4
+		if (ctx->compress == BC_COMP_LZ4 && ctx->lz4_state.link_bufs)
+			lz4_link(&ctx->lz4_state, buf);
+#endif
+
+		pthread_mutex_unlock(&ctx->drain_mtx);
+
+		start = _bc_now();
+
+		switch (ctx->compress) {
+#ifndef _WITHOUT_LZ4
+		case BC_COMP_LZ4:
+			lz4_compress_buf(wrk->lz4_strm, buf,
+			    ctx->lz4_state.block_checksum);
+			break;
+#endif
+
+#ifdef _WITH_ZLIB
+		case BC_COMP_ZLIB:
+			deflateReset(&wrk->zlib_strm);
+			zlib_compress_buf(&wrk->zlib_strm, buf, ctx->obuf_size,
+			    Z_SYNC_FLUSH);
+			break;
+#endif
+
+		default:
+			assert (0);
+		}
+
+		_bc_hist_add(ctx->st_comp_hist, _bc_now() - start);
+
+		/*
+		 * At most buffer_cnt buffers can be between the drain list
+		 * and the I/O thread, so their sequence numbers map onto
+		 * distinct ring slots.
+		 */
+		pthread_mutex_lock(&ctx->seq_mtx);
+		assert (ctx->seq_ring[buf->seq % ctx->buffer_cnt] == NULL);
+		__atomic_store_n(&ctx->seq_ring[buf->seq % ctx->buffer_cnt], buf,
+		    __ATOMIC_RELAXED);
+		if (buf->seq == ctx->write_seq)
+			_bc_wake(&ctx->seq_cv, ctx->seq_parked);
+		pthread_mutex_unlock(&ctx->seq_mtx);
+	}
+
+	return NULL;
+}
+
+/*
+ * I/O thread when compression workers are used: writes out compressed
+ * buffers in the order in which they were drained, no matter in which
+ * order the workers finish them.
+ */
+static
+void *
+_seq_thr(void *priv)
+{
+	struct buffer_cache_ctx *ctx = (struct buffer_cache_ctx *)priv;
+	struct bc_buffer **slotp;
+	struct bc_buffer *buf;
+	uint64_t ticket, start;
+	int r, spun;
+
+	pthread_mutex_lock(&ctx->seq_mtx);
+
+	for (;;) {
+		slotp = &ctx->seq_ring[ctx->write_seq % ctx->buffer_cnt];
+
+		if (_bc_sync_due(ctx, *slotp == NULL)) {
+			pthread_mutex_unlock(&ctx->seq_mtx);
+			_bc_sync(ctx);
+			pthread_mutex_lock(&ctx->seq_mtx);
+			continue;
+		}
+
+		/*
+		 * Nothing to write right now; finish the writes in flight
+		 * so their buffers are recycled before going to sleep.
+		 */
+		if (*slotp == NULL && _bc_io_pending(ctx)) {
+			pthread_mutex_unlock(&ctx->seq_mtx);
+			if (_bc_io_wait(ctx) != 0)
+				_bc_io_failed(ctx);
+			pthread_mutex_lock(&ctx->seq_mtx);
+			continue;
+		}
+
+		spun = 0;
+		while (*slotp == NULL && !ctx->exit_seq &&
+		    !_bc_sync_due(ctx, 1))
+			_bc_wait(ctx, ctx->spin_ns, _seq_ready, slotp,
+			    &ctx->seq_cv, &ctx->seq_mtx, &ctx->seq_parked, &spun);
+
+		if ((buf = *slotp) == NULL) {
+			if (ctx->exit_seq)
+				break;
+			continue;
+		}
+
+		assert (buf->seq == ctx->write_seq);
+		*slotp = NULL;
+		++ctx->write_seq;
+
+		pthread_mutex_unlock(&ctx->seq_mtx);
+
+		if (_bc_io_skip(ctx, buf)) {
+			pthread_mutex_lock(&ctx->seq_mtx);
+			continue;
+		}
+
+		if (_bc_rotate_due(ctx))
+			_bc_rotate(ctx);
+
+#ifndef _WITHOUT_LZ4
+		/*
+		 * The first buffer of a new file may have been linked to the
+		 * end of the previous one; compress it again on its own.
+		 */
+		if (ctx->compress == BC_COMP_LZ4 && ctx->lz4_state.new_file) {
+			if (buf->link_len > 0) {
+				buf->link_len = 0;
+				lz4_compress_buf(ctx->lz4_state.lz4_state, buf,
+				    ctx->lz4_state.block_checksum);
+			}
+			ctx->lz4_state.new_file = 0;
+		}
+#endif
+
+		/* buf may be recycled as soon as it's written out */
+		ticket = buf->ticket;
+
+		if (ctx->flags & BC_OPT_INDEX)
+			_bc_index_add(ctx, buf, _buf_len(buf));
+
+		__atomic_fetch_add(&ctx->st_bytes_in, _buf_len(buf),
+		    __ATOMIC_RELAXED);
+		ctx->st_io_ns = 0;
+		start = _bc_now();
+
+		switch (ctx->compress) {
+#ifndef _WITHOUT_LZ4
+		case BC_COMP_LZ4:
+			r = lz4_write_obuf(ctx, buf);
+			break;
+#endif
+
+#ifdef _WITH_ZLIB
+		case BC_COMP_ZLIB:
+			r = zlib_write_obuf(ctx, buf);
+			break;
+#endif
+
+		default:
+			_recycle_buf(ctx, buf);
+			errno = EINVAL;
+			r = 1;
+		}
+
+		if (r != 0)
+			_bc_io_failed(ctx);
+		_bc_stat_buf(ctx, start, 0);
+
+		ctx->written_ticket = ticket;
+		ctx->sync_dirty = 1;
+
+		pthread_mutex_lock(&ctx->seq_mtx);
+	}
+
+	pthread_mutex_unlock(&ctx->seq_mtx);
+
+	return NULL;
+}
+
+/*
+ * Compress and write out a single buffer taken off the drain list.
+ * Called by whichever thread owns the output of the context: its own
+ * drain thread or a thread of the engine it is attached to.
+ */
+static
+void
+_drain_one(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	uint64_t ticket = buf->ticket, start;
+	int r;
+
+	if (_bc_io_skip(ctx, buf))
+		return;
+
+	if (_bc_rotate_due(ctx))
+		_bc_rotate(ctx);
+
+#ifndef _WITHOUT_LZ4
+	if (ctx->compress == BC_COMP_LZ4 && ctx->lz4_state.link_bufs)
+		lz4_link(&ctx->lz4_state, buf);
+#endif
+
+	if (ctx->flags & BC_OPT_INDEX)
+		_bc_index_add(ctx, buf, _buf_len(buf));
+
+	__atomic_fetch_add(&ctx->st_bytes_in, _buf_len(buf),
+	    __ATOMIC_RELAXED);
+	ctx->st_io_ns = 0;
+	start = _bc_now();
+
+	/*
+	 * Do the actual I/O: drain the buffer we picked from
+	 * the drain list, ideally in buffer-sized chunks.
+	 *
+	 * With an output buffer (io_uring), compress all of it
+	 * up front so it can be written with a single request.
+	 */
+	switch (ctx->compress) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		if (buf->obuf != NULL) {
+			lz4_compress_buf(ctx->lz4_state.linked ?
+			    ctx->lz4_state.lz4_state : NULL, buf,
+			    ctx->lz4_state.block_checksum);
+			r = lz4_write_obuf(ctx, buf);
+		} else {
+			r = lz4_write_buf(ctx, buf);
+			_recycle_buf(ctx, buf);
+		}
+		break;
+#endif
+
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		if (buf->obuf != NULL) {
+			zlib_compress_buf(&ctx->zlib_state.zlib_strm, buf,
+			    ctx->obuf_size, (ctx->flags & BC_OPT_INDEX) ?
+			    Z_FULL_FLUSH : Z_SYNC_FLUSH);
+			r = zlib_write_obuf(ctx, buf);
+		} else {
+			r = zlib_write_buf(ctx, buf);
+			_recycle_buf(ctx, buf);
+		}
+		break;
+#endif
+
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		r = zstd_write_buf(ctx, buf);
+		_recycle_buf(ctx, buf);
+		break;
+#endif
+
+	case BC_COMP_NONE:
+	default:
+		r = _bc_output(ctx, buf, _buf_data(buf), _buf_len(buf));
+		break;
+	}
+
+	if (r != 0)
+		_bc_io_failed(ctx);
+	_bc_stat_buf(ctx, start, ctx->compress != BC_COMP_NONE);
+
+	ctx->written_ticket = ticket;
+	ctx->sync_dirty = 1;
+}
+
+static
+void *
+_drain_thr(void *priv)
+{
+	struct buffer_cache_ctx *ctx = (struct buffer_cache_ctx *)priv;
+	struct bc_buffer *buf;
+	int spun;
+
+	for (;;) {
+		/*
+		 * Lock the drain mutex and check if there is anything to
+		 * drain.
+		 * If there isn't, then wait on the drain cv until the
+		 * write signals us to say that there now is some data
+		 * on the drain list.
+		 */
+		pthread_mutex_lock(&ctx->drain_mtx);
+
+		if (_bc_sync_due(ctx, ctx->drain_cnt == 0)) {
+			pthread_mutex_unlock(&ctx->drain_mtx);
+			_bc_sync(ctx);
+			continue;
+		}
+
+		/*
+		 * Before going to sleep, finish the writes still in flight
+		 * so that their buffers make it back to the empty list.
+		 */
+		if (ctx->drain_cnt == 0 && _bc_io_pending(ctx)) {
+			pthread_mutex_unlock(&ctx->drain_mtx);
+			if (_bc_io_wait(ctx) != 0)
+				_bc_io_failed(ctx);
+			continue;
+		}
+
+		/*
+		 * A sync requested while spinning (see _bc_io_wake())
+		 * finds nobody to wake, so check for one before sleeping.
+		 */
+		spun = 0;
+		while (ctx->drain_cnt == 0 && !ctx->exit_drain &&
+		    !_bc_sync_due(ctx, 1))
+			_bc_wait(ctx, ctx->spin_ns, _drain_ready, ctx,
+			    &ctx->drain_cv, &ctx->drain_mtx, &ctx->drain_parked,
+			    &spun);
+
+		if (ctx->drain_cnt == 0 && ctx->exit_drain) {
+			pthread_mutex_unlock(&ctx->drain_mtx);
+			return NULL;
+		}
+
+		if (ctx->drain_cnt == 0) {
+			pthread_mutex_unlock(&ctx->drain_mtx);
+			continue;
+		}
+
+		/*
+		 * Grab a buffer from the head of the drain list.
+		 */
+		buf = _drain_pop(ctx);
+
+		/*
+		 * Now that we are done operating on the drain list we
+		 * unlock again.
+		 */
+		pthread_mutex_unlock(&ctx->drain_mtx);
+
+		_drain_one(ctx, buf);
+	}
+
+	return NULL;
+}
+
+/*
+ * Give ctx its turn on an engine thread: sync it if that is due, or else
+ * write out one buffer. Taking turns a buffer at a time keeps a ctx with
+ * many buffers queued from holding up the others. For its turn, the ctx
+ * compresses into the thread's comp_obuf.
+ */
+static
+void
+_engine_step(struct buffer_cache_ctx *ctx, unsigned char *comp_obuf)
+{
+	struct bc_buffer *buf = NULL;
+	int sync;
+
+	ctx->comp_obuf = comp_obuf;
+
+	pthread_mutex_lock(&ctx->drain_mtx);
+	sync = _bc_sync_due(ctx, ctx->drain_cnt == 0);
+	if (!sync && ctx->drain_cnt > 0)
+		buf = _drain_pop(ctx);
+	pthread_mutex_unlock(&ctx->drain_mtx);
+
+	if (sync)
+		_bc_sync(ctx);
+	else if (buf != NULL)
+		_drain_one(ctx, buf);
+
+	ctx->comp_obuf = NULL;
+
+	/*
+	 * Back on the ready queue if there is more to do. Otherwise
+	 * whoever is waiting for the ctx to go idle gets told.
+	 */
+	pthread_mutex_lock(&ctx->drain_mtx);
+	ctx->eng_sched = 0;
+	if (ctx->drain_cnt > 0 || _bc_sync_due(ctx, ctx->drain_cnt == 0))
+		_engine_sched(ctx);
+	else
+		pthread_cond_broadcast(&ctx->drain_cv);
+	pthread_mutex_unlock(&ctx->drain_mtx);
+}
+
+static
+void *
+_engine_thr(void *priv)
+{
+	struct bc_engine_thr *thr = (struct bc_engine_thr *)priv;
+	struct buffer_cache_engine *eng = thr->eng;
+	struct buffer_cache_ctx *ctx;
+	int spun;
+
+	pthread_mutex_lock(&eng->mtx);
+
+	for (;;) {
+		spun = 0;
+		while (eng->ready == NULL && !eng->exit)
+			_bc_wait(NULL, eng->spin_ns, _engine_ready, eng, &eng->cv,
+			    &eng->mtx, &eng->parked, &spun);
+
+		if (eng->ready == NULL)
+			break;
+
+		ctx = eng->ready;
+		__atomic_store_n(&eng->ready, ctx->eng_next, __ATOMIC_RELAXED);
+		if (eng->ready == NULL)
+			eng->ready_tail = NULL;
+
+		pthread_mutex_unlock(&eng->mtx);
+		_engine_step(ctx, thr->comp_obuf);
+		pthread_mutex_lock(&eng->mtx);
+	}
+
+	pthread_mutex_unlock(&eng->mtx);
+
+	return NULL;
+}
+
+
+static void _producer_drain(struct buffer_cache_ctx *ctx,
+    struct bc_producer *prod);
+
+static
+void
+_producer_dtor(void *priv)
+{
+	struct bc_producer *prod = (struct bc_producer *)priv;
+	struct buffer_cache_ctx *ctx = prod->ctx;
+
+	/*
+	 * The producer thread is exiting; hand whatever it had written
+	 * so far to the drain thread and forget about the producer.
+	 */
+	pthread_mutex_lock(&ctx->prod_mtx);
+
+	if (prod->current_wr != NULL)
+		_producer_drain(ctx, prod);
+
+	if (prod->prev != NULL)
+		prod->prev->next = prod->next;
+	else
+		ctx->producers = prod->next;
+	if (prod->next != NULL)
+		prod->next->prev = prod->prev;
+
+	pthread_mutex_unlock(&ctx->prod_mtx);
+
+	free(prod);
+}
+
+static
+struct bc_producer *
+_producer_register(struct buffer_cache_ctx *ctx)
+{
+	struct bc_producer *prod;
+
+	if ((prod = malloc(sizeof(*prod))) == NULL)
+		return NULL;
+
+	memset(prod, 0, sizeof(*prod));
+	prod->ctx = ctx;
+
+	pthread_mutex_lock(&ctx->prod_mtx);
+	prod->next = ctx->producers;
+	if (ctx->producers != NULL)
+		ctx->producers->prev = prod;
+	ctx->producers = prod;
+	pthread_mutex_unlock(&ctx->prod_mtx);
+
+	pthread_setspecific(ctx->prod_key, prod);
+
+	return prod;
+}
+
+/*
+ * Returns the calling thread's producer, which holds its current write
+ * buffer. In single producer mode that's simply the one in the ctx,
+ * otherwise each thread has its own, reached via thread-specific data.
+ */
+static inline
+struct bc_producer *
+_producer(struct buffer_cache_ctx *ctx)
+{
+	struct bc_producer *prod;
+
+	if ((ctx->flags & BC_OPT_MULTI_PRODUCER) == 0)
+		return &ctx->sp;
+
+	if ((prod = pthread_getspecific(ctx->prod_key)) == NULL)
+		prod = _producer_register(ctx);
+
+	return prod;
+}
+
+/*
+ * Engine ctxs: keep _engine_steal() away from the producer's current
+ * buffer until _prod_unpin(). If it got there first, wait for it to be
+ * done; the buffer may be gone then.
+ */
+static inline
+void
+_prod_pin(struct buffer_cache_ctx *ctx, struct bc_producer *prod)
+{
+	if (ctx->engine == NULL ||
+	    __atomic_load_n(&prod->busy, __ATOMIC_RELAXED))
+		return;
+
+	for (;;) {
+		__atomic_store_n(&prod->busy, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&prod->stealing, __ATOMIC_SEQ_CST))
+			return;
+
+		__atomic_store_n(&prod->busy, 0, __ATOMIC_RELAXED);
+		while (__atomic_load_n(&prod->stealing, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+}
+
+/*
+ * A reservation keeps the buffer pinned until it is committed.
+ */
+static inline
+void
+_prod_unpin(struct buffer_cache_ctx *ctx, struct bc_producer *prod)
+{
+	if (ctx->engine != NULL && prod->reserved == 0)
+		__atomic_store_n(&prod->busy, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Alignment for O_DIRECT I/O on fd; at least DIO_ALIGN, or more if the
+ * file system says so.
+ */
+static
+size_t
+_bc_dio_align(int fd)
+{
+	size_t align = DIO_ALIGN;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+	    (stx.stx_mask & STATX_DIOALIGN)) {
+		if (stx.stx_dio_offset_align > align)
+			align = stx.stx_dio_offset_align;
+		if (stx.stx_dio_mem_align > align)
+			align = stx.stx_dio_mem_align;
+	}
+#endif
+
+	/* The scratch space in front of each buffer needs to hold a block */
+	assert (align <= LZ4_EXTRA_SZ);
+
+	return align;
+}
+
+void
+buffer_cache_opts_init(struct buffer_cache_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->compress = BC_COMP_NONE;
+	opts->buffer_size_mb = 64;
+	opts->buffer_cnt = 4;
+	opts->sync_interval_ms = 1000;
+	opts->spin_us = SPIN_US;
+}
+
+struct buffer_cache_ctx *
+buffer_cache_init(const char *file, int compress, size_t buffer_size_mb, size_t buffer_cnt)
+{
+	struct buffer_cache_opts opts;
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.buffer_size_mb = buffer_size_mb;
+	opts.buffer_cnt = buffer_cnt;
+
+	return buffer_cache_init_opts(file, &opts);
+}
+
+static struct buffer_cache_ctx *_bc_init(const char *file,
+    const struct buffer_cache_opts *opts, struct buffer_cache_ctx *pool);
+
+/*
+ * Set up the stripes of a striped ctx, each a ctx of its own writing one
+ * of the files. The striped ctx allocates the buffers, so they have to
+ * suit all of them.
+ */
+static
+int
+_stripe_init(struct buffer_cache_ctx *ctx, const struct buffer_cache_opts *opts)
+{
+	struct buffer_cache_opts st_opts = *opts;
+	struct buffer_cache_ctx *st;
+	size_t i;
+
+	st_opts.flags &= ~BC_OPT_MULTI_PRODUCER;
+	st_opts.idle_shrink_ms = 0;
+	st_opts.max_age_ms = 0;
+	st_opts.rotate_mb = 0;
+	st_opts.rotate_sec = 0;
+	st_opts.stripe_files = NULL;
+	st_opts.stripe_cnt = 0;
+
+	if ((ctx->stripes = calloc(opts->stripe_cnt, sizeof(*ctx->stripes))) == NULL) {
+		fprintf(stderr, "Failed to allocate stripe memory\n");
+		return 1;
+	}
+	ctx->stripe_cnt = opts->stripe_cnt;
+
+	for (i = 0; i < ctx->stripe_cnt; i++) {
+		if ((st = _bc_init(opts->stripe_files[i], &st_opts, ctx)) == NULL)
+			return 1;
+
+		ctx->stripes[i] = st;
+		if (st->obuf_size > ctx->obuf_size)
+			ctx->obuf_size = st->obuf_size;
+		if (st->dio_align > ctx->dio_align)
+			ctx->dio_align = st->dio_align;
+		if (st->buf_align > ctx->buf_align)
+			ctx->buf_align = st->buf_align;
+	}
+
+	return 0;
+}
+
+/*
+ * Set up a ctx, or one of the stripes of pool (see _stripe_init()), which
+ * has no buffers or producers of its own.
+ */
+static
+struct buffer_cache_ctx *
+_bc_init(const char *file, const struct buffer_cache_opts *opts,
+    struct buffer_cache_ctx *pool)
+{
+	struct bc_buffer *buf;
+	struct buffer_cache_ctx *ctx = NULL;
+	size_t buffer_size_mb = opts->buffer_size_mb;
+	size_t buffer_cnt = opts->buffer_cnt;
+	size_t buffer_size_b, buf_sz;
+	pthread_condattr_t cv_attr;
+	pthread_mutexattr_t mtx_attr;
+	size_t i;
+	int r;
+
+	/*
+	 * An engine only does the plain work of writing out buffers, and
+	 * its buffers are all the same size.
+	 */
+	if (opts->engine != NULL) {
+		if (opts->comp_workers > 0 || opts->stripe_cnt > 0 ||
+		    opts->max_age_ms > 0 || opts->idle_shrink_ms > 0 ||
+		    opts->rotate_mb > 0 || opts->rotate_sec > 0 ||
+		    opts->durability == BC_DUR_PERIODIC ||
+		    (opts->flags & (BC_OPT_IO_URING | BC_OPT_DIRECT_IO))) {
+			fprintf(stderr, "Option not available with an engine\n");
+			return NULL;
+		}
+
+		buffer_size_mb = opts->engine->buffer_size_mb;
+	}
+
+	buffer_size_b = buffer_size_mb*1024*1024;
+
+	if (buffer_size_mb < 1 || buffer_cnt < 1) {
+		fprintf(stderr, "Didn't specify at least one buffer of at least 1 MB\n");
+		return NULL;
+	}
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL) {
+		fprintf(stderr, "Failed to allocate ctx memory\n");
+		return NULL;
+	}
+
+	ctx->fd = -1;
+	ctx->compress = opts->compress;
+	ctx->flags = opts->flags;
+
+	ctx->pool = pool;
+
+	/* With stripes, file is the manifest, written as it is */
+	if (opts->stripe_cnt > 0) {
+		ctx->compress = BC_COMP_NONE;
+		ctx->flags &= ~(BC_OPT_IO_URING | BC_OPT_DIRECT_IO);
+	}
+
+	/* Uncompressed files can be seeked in without an index */
+	if (ctx->compress == BC_COMP_NONE)
+		ctx->flags &= ~BC_OPT_INDEX;
+
+	/* Timed waits go by CLOCK_MONOTONIC */
+	pthread_condattr_init(&cv_attr);
+	pthread_condattr_setclock(&cv_attr, CLOCK_MONOTONIC);
+
+	/*
+	 * The producers and the I/O thread only hold these for a few
+	 * instructions at a time, so rather than going to sleep right away
+	 * when they find them taken, they spin for a bit.
+	 */
+	pthread_mutexattr_init(&mtx_attr);
+	pthread_mutexattr_settype(&mtx_attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+
+	pthread_cond_init(&ctx->empty_cv, &cv_attr);
+	pthread_cond_init(&ctx->drain_cv, &cv_attr);
+	pthread_mutex_init(&ctx->empty_mtx, &mtx_attr);
+	pthread_mutex_init(&ctx->drain_mtx, &mtx_attr);
+	pthread_mutexattr_destroy(&mtx_attr);
+	pthread_mutex_init(&ctx->prod_mtx, NULL);
+	pthread_cond_init(&ctx->seq_cv, &cv_attr);
+	pthread_cond_init(&ctx->durable_cv, &cv_attr);
+	pthread_condattr_destroy(&cv_attr);
+	pthread_mutex_init(&ctx->seq_mtx, NULL);
+	pthread_mutex_init(&ctx->sync_mtx, NULL);
+
+	if (ctx->flags & BC_OPT_MULTI_PRODUCER) {
+		if ((r = pthread_key_create(&ctx->prod_key, _producer_dtor)) != 0) {
+			fprintf(stderr, "Failed to pthread_key_create()\n");
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+		ctx->prod_key_created = 1;
+	}
+
+	ctx->rotate_bytes = (uint64_t)opts->rotate_mb * 1024 * 1024;
+	ctx->rotate_limit = ctx->rotate_bytes;
+	ctx->rotate_ns = (uint64_t)opts->rotate_sec * 1000000000ULL;
+
+	/* With rotation, file is a pattern for the names */
+	if (opts->stripe_cnt == 0 &&
+	    (ctx->rotate_bytes > 0 || ctx->rotate_ns > 0)) {
+		if ((ctx->file_pattern = strdup(file)) == NULL ||
+		    (ctx->file = _bc_file_name(ctx, 0, time(NULL))) == NULL) {
+			fprintf(stderr, "Failed to make file name from %s\n", file);
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+
+		if (ctx->rotate_ns > 0)
+			_bc_rotate_sched(ctx);
+	} else {
+		ctx->file = strdup(file);
+	}
+
+	if (ctx->file == NULL) {
+		fprintf(stderr, "Failed to allocate strdup memory\n");
+		buffer_cache_destroy(ctx);
+		return NULL;
+	}
+
+	if ((ctx->fd = _bc_open(ctx->file, ctx->flags)) < 0) {
+		fprintf(stderr, "Failed to open file %s\n", ctx->file);
+		buffer_cache_destroy(ctx);
+		return NULL;
+	}
+
+	/* Not every file system supports O_DIRECT */
+	if ((fcntl(ctx->fd, F_GETFL) & O_DIRECT) == 0)
+		ctx->flags &= ~BC_OPT_DIRECT_IO;
+
+	ctx->buf_align = 64;
+
+	/*
+	 * The buffers go on the node of the calling thread; producers are
+	 * expected to run there.
+	 */
+	if ((ctx->flags & BC_OPT_NUMA_LOCAL) &&
+	    (syscall(SYS_getcpu, NULL, &ctx->numa_node, NULL) != 0 ||
+	    ctx->numa_node >= NUMA_NODES))
+		ctx->flags &= ~BC_OPT_NUMA_LOCAL;
+
+	if (ctx->flags & BC_OPT_DIRECT_IO) {
+		ctx->dio_align = _bc_dio_align(ctx->fd);
+		ctx->buf_align = ctx->dio_align;
+
+		if (posix_memalign((void **)&ctx->dio_buf, ctx->dio_align, DIO_STAGE_SZ) != 0) {
+			fprintf(stderr, "Failed to allocate O_DIRECT staging buffer\n");
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+	}
+
+	switch (ctx->compress) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		/*
+		 * The stream checksum has to be computed in order, on the
+		 * I/O thread; with compression workers, they checksum each
+		 * block instead, so that it doesn't hold up the output.
+		 * Framed records carry their own CRCs, but a damaged block
+		 * can decompress into copies of earlier, intact records, so
+		 * recovering needs the blocks checked too.
+		 */
+		if ((ctx->flags & BC_OPT_FRAMED) || opts->comp_workers > 0) {
+			ctx->lz4_state.block_checksum = 1;
+		} else {
+			ctx->lz4_state.stream_checksum = 1;
+			ctx->lz4_state.xxh32_state = XXH32_init(0);
+		}
+
+		/*
+		 * Linked blocks are compressed with the streaming API, which
+		 * works with 32-bit offsets from the start of the history.
+		 */
+		if (ctx->flags & BC_OPT_LZ4_LINKED) {
+			if (buffer_size_b + LZ4_EXTRA_SZ >= 0xE0000000) {
+				fprintf(stderr, "Buffers too large for linked LZ4 blocks\n");
+				buffer_cache_destroy(ctx);
+				return NULL;
+			}
+
+			/*
+			 * With an index, blocks are only linked within a
+			 * buffer, so that each buffer can be decompressed on
+			 * its own.
+			 */
+			ctx->lz4_state.linked = 1;
+			ctx->lz4_state.link_bufs = !(ctx->flags & BC_OPT_INDEX);
+			if ((ctx->lz4_state.lz4_state = malloc(LZ4_sizeofStreamState())) == NULL) {
+				fprintf(stderr, "Failed to allocate LZ4 stream state\n");
+				buffer_cache_destroy(ctx);
+				return NULL;
+			}
+		}
+
+		if ((r = lz4_write_hdr(ctx)) != 0) {
+			fprintf(stderr, "Failed to write LZ4 header");
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+		break;
+#endif
+
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		ctx->zlib_state.isize = 0;
+		ctx->zlib_state.zlib_crc32 = crc32(0L, Z_NULL, 0);
+		if ((r = zlib_init_strm(&ctx->zlib_state.zlib_strm)) != Z_OK) {
+			fprintf(stderr, "Failed to initialize deflate");
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+		if ((r = zlib_write_hdr(ctx)) != 0) {
+			fprintf(stderr, "Failed to write gzip header");
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+		break;
+#endif
+
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		if ((r = zstd_init_cctx(ctx, opts)) != 0) {
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+		break;
+#endif
+
+	case BC_COMP_NONE:
+		break;
+
+	default:
+		fprintf(stderr, "Invalid compression option\n");
+		buffer_cache_destroy(ctx);
+		return NULL;
+	}
+
+	ctx->buffer_size = buffer_size_b;
+	ctx->buffer_cnt = buffer_cnt;
+
+#ifdef _WITH_IO_URING
+	/*
+	 * Set up io_uring if requested; no more writes than there are
+	 * buffers can ever be in flight. If it isn't available, quietly
+	 * stick to write(2).
+	 */
+	if (ctx->flags & BC_OPT_IO_URING) {
+		ctx->uring = bc_uring_init((unsigned int)
+		    ((opts->io_depth > 0 && opts->io_depth < buffer_cnt) ?
+		    opts->io_depth : buffer_cnt));
+	}
+#endif
+
+	/*
+	 * Compression workers need a private output buffer per buffer, large
+	 * enough for the worst case output of a whole buffer. So does
+	 * io_uring, which needs to be able to write all of a buffer's
+	 * compressed output in one go. zstd runs its own workers behind a
+	 * single stream, which is written as it comes.
+	 */
+	if (ctx->compress != BC_COMP_NONE && ctx->compress != BC_COMP_ZSTD)
+		ctx->comp_workers = opts->comp_workers;
+
+	if (ctx->comp_workers > 0 ||
+	    (ctx->compress != BC_COMP_NONE && _bc_async_io(ctx))) {
+		switch (ctx->compress) {
+#ifndef _WITHOUT_LZ4
+		case BC_COMP_LZ4:
+			/* Plus every block's size and checksum */
+			ctx->obuf_size = buffer_size_b +
+			    8 * (buffer_size_b / LZ4_BLOCK_SZ + 1);
+			break;
+#endif
+
+#ifdef _WITH_ZLIB
+		case BC_COMP_ZLIB:
+			/* Plus room for a block flush at every level change */
+			ctx->obuf_size = deflateBound(&ctx->zlib_state.zlib_strm,
+			    buffer_size_b) + 16 * (buffer_size_b / ZLIB_BLOCK_SZ + 2);
+			break;
+#endif
+		}
+
+	}
+
+	/* An engine's threads bring their own, see _engine_step() */
+	if (ctx->compress != BC_COMP_NONE && opts->engine == NULL &&
+	    (ctx->comp_obuf = malloc(COMP_OBUF_SZ)) == NULL) {
+		fprintf(stderr, "Failed to allocate compressor memory\n");
+		buffer_cache_destroy(ctx);
+		return NULL;
+	}
+
+	if (ctx->comp_workers > 0) {
+		ctx->seq_ring = calloc(buffer_cnt, sizeof(*ctx->seq_ring));
+		ctx->workers = calloc(ctx->comp_workers, sizeof(*ctx->workers));
+		if (ctx->seq_ring == NULL || ctx->workers == NULL) {
+			fprintf(stderr, "Failed to allocate worker memory\n");
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+	}
+
+	if (opts->stripe_cnt > 0 && _stripe_init(ctx, opts) != 0) {
+		buffer_cache_destroy(ctx);
+		return NULL;
+	}
+
+	/*
+	 * Size the pool: at most buffer_cnt buffers, and no more than fit
+	 * in pool_max_mb (output buffers included), but at least one.
+	 */
+	buf_sz = buffer_size_b + LZ4_EXTRA_SZ;
+	if (ctx->obuf_size > 0)
+		buf_sz += ctx->obuf_size + ctx->dio_align;
+
+	ctx->buf_max = buffer_cnt;
+	if (opts->pool_max_mb > 0 &&
+	    opts->pool_max_mb*1024*1024 / buf_sz < ctx->buf_max)
+		ctx->buf_max = opts->pool_max_mb*1024*1024 / buf_sz;
+	if (ctx->buf_max < 1)
+		ctx->buf_max = 1;
+
+	ctx->buf_min = opts->buffer_min;
+	if (ctx->buf_min < 1)
+		ctx->buf_min = 1;
+	if (ctx->buf_min > ctx->buf_max)
+		ctx->buf_min = ctx->buf_max;
+	if (pool != NULL || opts->engine != NULL)
+		ctx->buf_min = 0;
+
+	ctx->idle_ns = (uint64_t)opts->idle_shrink_ms * 1000000;
+	if (opts->stripe_cnt == 0)
+		ctx->max_age_ns = (uint64_t)opts->max_age_ms * 1000000;
+
+	ctx->durability = opts->durability;
+	ctx->sync_ns = (uint64_t)opts->sync_interval_ms * 1000000;
+
+	/* See _bc_idle_wait() */
+	ctx->tick_ns = ctx->idle_ns / 2;
+	if (ctx->max_age_ns > 0 &&
+	    (ctx->tick_ns == 0 || ctx->max_age_ns / 4 < ctx->tick_ns))
+		ctx->tick_ns = ctx->max_age_ns / 4;
+	if (ctx->durability == BC_DUR_PERIODIC && ctx->sync_ns / 4 > 0 &&
+	    (ctx->tick_ns == 0 || ctx->sync_ns / 4 < ctx->tick_ns))
+		ctx->tick_ns = ctx->sync_ns / 4;
+
+	ctx->backpressure = opts->backpressure;
+	ctx->bp_timeout_ns = (uint64_t)opts->bp_timeout_us * 1000;
+
+	/* Polling only pays off with another CPU to poll on */
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		ctx->spin_ns = (uint64_t)opts->spin_us * 1000;
+
+	/*
+	 * Allocate just the buffers that are kept at all times and place
+	 * them on the empty list; the rest are only allocated once they are
+	 * needed, see _make_room().
+	 */
+	for (i = 0; i < ctx->buf_min; i++) {
+		if ((buf = _alloc_buf(ctx)) == NULL) {
+			fprintf(stderr, "Failed to allocate %ju bytes for buffer %ju\n", buf_sz, i);
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+
+		buf->prev = NULL;
+		buf->next = ctx->empty;
+		ctx->empty = buf;
+
+		++ctx->empty_cnt;
+		++ctx->buf_alloc_cnt;
+	}
+
+	/*
+	 * Remove the first buffer from the empty list and use it as the
+	 * current write buffer. Producers in multi-producer mode grab
+	 * their own on their first write instead, as does the producer of
+	 * a ctx on an engine.
+	 */
+	if ((ctx->flags & BC_OPT_MULTI_PRODUCER) == 0 && pool == NULL &&
+	    opts->engine == NULL) {
+		ctx->sp.current_wr = ctx->empty;
+		ctx->sp.current_wr->dirty_at = _bc_now();
+		ctx->empty = ctx->empty->next;
+		--ctx->empty_cnt;
+	}
+
+	/* The engine's threads do the I/O for this one */
+	if (opts->engine != NULL) {
+		ctx->engine = opts->engine;
+
+		pthread_mutex_lock(&opts->engine->mtx);
+		++opts->engine->ctx_cnt;
+		ctx->eng_ctx_next = opts->engine->ctxs;
+		opts->engine->ctxs = ctx;
+		pthread_mutex_unlock(&opts->engine->mtx);
+
+		return ctx;
+	}
+
+	/*
+	 * Initialize the compression workers, if any, and the drain
+	 * thread. With workers, the latter only writes out what the
+	 * workers have compressed.
+	 */
+	for (i = 0; i < ctx->comp_workers; i++) {
+		ctx->workers[i].ctx = ctx;
+
+#ifndef _WITHOUT_LZ4
+		if (ctx->compress == BC_COMP_LZ4 && ctx->lz4_state.linked &&
+		    (ctx->workers[i].lz4_strm = malloc(LZ4_sizeofStreamState())) == NULL) {
+			fprintf(stderr, "Failed to allocate LZ4 stream state\n");
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+#endif
+
+#ifdef _WITH_ZLIB
+		if (ctx->compress == BC_COMP_ZLIB) {
+			if ((r = zlib_init_strm(&ctx->workers[i].zlib_strm)) != Z_OK) {
+				fprintf(stderr, "Failed to initialize deflate");
+				buffer_cache_destroy(ctx);
+				return NULL;
+			}
+			ctx->workers[i].zlib_init = 1;
+		}
+#endif
+
+		if ((r = pthread_create(&ctx->workers[i].thread, NULL, _comp_thr, &ctx->workers[i])) != 0) {
+			fprintf(stderr, "Failed to pthread_create()\n");
+			buffer_cache_destroy(ctx);
+			return NULL;
+		}
+
+		ctx->workers[i].thr_created = 1;
+	}
+
+	if ((r = pthread_create(&ctx->io_thread, NULL,
+	    (ctx->comp_workers > 0) ? _seq_thr : _drain_thr, ctx)) != 0) {
+		fprintf(stderr, "Failed to pthread_create()\n");
+		buffer_cache_destroy(ctx);
+		return NULL;
+	}
+
+	ctx->thr_created = 1;
+
+	return ctx;
+}
+
+struct buffer_cache_ctx *
+buffer_cache_init_opts(const char *file, const struct buffer_cache_opts *opts)
+{
+	return _bc_init(file, opts, NULL);
+}
+
+struct buffer_cache_engine *
+buffer_cache_engine_init(size_t threads, size_t buffer_size_mb,
+    size_t pool_max_mb)
+{
+	struct buffer_cache_engine *eng;
+	struct bc_engine_thr *thr;
+	size_t buf_sz;
+
+	if (threads < 1 || buffer_size_mb < 1) {
+		fprintf(stderr, "Didn't specify at least one thread and buffers "
+		    "of at least 1 MB\n");
+		return NULL;
+	}
+
+	if ((eng = malloc(sizeof(*eng))) == NULL) {
+		fprintf(stderr, "Failed to allocate engine memory\n");
+		return NULL;
+	}
+
+	memset(eng, 0, sizeof(*eng));
+	eng->buffer_size_mb = buffer_size_mb;
+
+	/* Sized like a ctx's pool, see _bc_init() */
+	buf_sz = buffer_size_mb*1024*1024 + LZ4_EXTRA_SZ;
+	eng->buf_max = SIZE_MAX;
+	if (pool_max_mb > 0)
+		eng->buf_max = pool_max_mb*1024*1024 / buf_sz;
+	if (eng->buf_max < 1)
+		eng->buf_max = 1;
+
+	/* The threads poll for work like a ctx's I/O thread by default */
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		eng->spin_ns = (uint64_t)SPIN_US * 1000;
+
+	pthread_cond_init(&eng->cv, NULL);
+	pthread_mutex_init(&eng->mtx, NULL);
+
+	if ((eng->threads = calloc(threads, sizeof(*eng->threads))) == NULL) {
+		fprintf(stderr, "Failed to allocate engine memory\n");
+		buffer_cache_engine_destroy(eng);
+		return NULL;
+	}
+
+	for (; eng->thread_cnt < threads; eng->thread_cnt++) {
+		thr = &eng->threads[eng->thread_cnt];
+		thr->eng = eng;
+
+		/* Only faulted in once a compressed ctx uses it */
+		if ((thr->comp_obuf = malloc(COMP_OBUF_SZ)) == NULL) {
+			fprintf(stderr, "Failed to allocate engine memory\n");
+			buffer_cache_engine_destroy(eng);
+			return NULL;
+		}
+
+		if (pthread_create(&thr->thread, NULL, _engine_thr, thr) != 0) {
+			fprintf(stderr, "Failed to pthread_create()\n");
+			free(thr->comp_obuf);
+			buffer_cache_engine_destroy(eng);
+			return NULL;
+		}
+	}
+
+	return eng;
+}
+
+void
+buffer_cache_engine_destroy(struct buffer_cache_engine *eng)
+{
+	struct bc_buffer *buf;
+	size_t i;
+
+	pthread_mutex_lock(&eng->mtx);
+	assert (eng->ctx_cnt == 0);
+	eng->exit = 1;
+	pthread_cond_broadcast(&eng->cv);
+	pthread_mutex_unlock(&eng->mtx);
+
+	for (i = 0; i < eng->thread_cnt; i++) {
+		pthread_join(eng->threads[i].thread, NULL);
+		free(eng->threads[i].comp_obuf);
+	}
+
+	while ((buf = eng->free) != NULL) {
+		eng->free = buf->next;
+		_free_buf(buf);
+	}
+
+	pthread_cond_destroy(&eng->cv);
+	pthread_mutex_destroy(&eng->mtx);
+
+	if (eng->threads != NULL)
+		free(eng->threads);
+
+	free(eng);
+}
+
+/*
+ * Returns the ticket buf was given, see buffer_cache_wait_durable().
+ */
+static uint64_t _drain_buf(struct buffer_cache_ctx *ctx,
+    struct bc_buffer *buf);
+
+/*
+ * Note len bytes going to stripe s in the manifest. If it can't grow, no
+ * manifest is written at all rather than a wrong one.
+ */
+static
+void
+_stripe_note(struct buffer_cache_ctx *ctx, size_t s, size_t len)
+{
+	struct bc_stripe_ent *ent;
+	size_t size;
+
+	if (len == 0 || ctx->stripe_failed)
+		return;
+
+	/* Runs on the same stripe make a single entry */
+	if (ctx->stripe_ent_cnt > 0) {
+		ent = &ctx->stripe_ents[ctx->stripe_ent_cnt - 1];
+		if (ent->stripe == s) {
+			ent->len += len;
+			return;
+		}
+	}
+
+	if (ctx->stripe_ent_cnt == ctx->stripe_ent_size) {
+		size = (ctx->stripe_ent_size > 0) ? 2 * ctx->stripe_ent_size : 1024;
+		if ((ent = realloc(ctx->stripe_ents, size * sizeof(*ent))) == NULL) {
+			fprintf(stderr, "Failed to grow manifest of %s, not writing it\n",
+			    ctx->file);
+			ctx->stripe_failed = 1;
+			return;
+		}
+		ctx->stripe_ents = ent;
+		ctx->stripe_ent_size = size;
+	}
+
+	ent = &ctx->stripe_ents[ctx->stripe_ent_cnt++];
+	ent->len = len;
+	ent->stripe = s;
+}
+
+/*
+ * Hand buf on to the stripe with the fewest buffers queued, taking turns
+ * among those. The striped ctx's drain mutex is held throughout, so the
+ * manifest has the buffers in the order the stripes get them. Returns the
+ * ticket the stripe gave buf.
+ */
+static
+uint64_t
+_stripe_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	struct buffer_cache_ctx *st;
+	size_t i, s, cnt, best = 0, best_cnt = SIZE_MAX;
+	uint64_t ticket;
+
+	pthread_mutex_lock(&ctx->drain_mtx);
+
+	for (i = 0; i < ctx->stripe_cnt; i++) {
+		s = (ctx->stripe_next + i) % ctx->stripe_cnt;
+		st = ctx->stripes[s];
+
+		pthread_mutex_lock(&st->drain_mtx);
+		cnt = st->drain_cnt;
+		pthread_mutex_unlock(&st->drain_mtx);
+
+		if (cnt < best_cnt) {
+			best = s;
+			best_cnt = cnt;
+		}
+	}
+
+	ctx->stripe_next = best + 1;
+	_stripe_note(ctx, best, _buf_len(buf));
+	ticket = _drain_buf(ctx->stripes[best], buf);
+
+	pthread_mutex_unlock(&ctx->drain_mtx);
+
+	return ticket;
+}
+
+/*
+ * Write the manifest of a striped ctx to its file, see BC_STRIPE_MAGIC.
+ */
+static
+int
+_stripe_write(struct buffer_cache_ctx *ctx)
+{
+	unsigned char hdr[16];
+	char *path;
+	uint32_t u32;
+	uint64_t u64;
+	size_t i;
+	int r = 0;
+
+	if (ctx->stripe_failed)
+		return 1;
+
+	u32 = BC_STRIPE_MAGIC;
+	memcpy(&hdr[0], &u32, sizeof(u32));
+	u32 = (uint32_t)ctx->stripe_cnt;
+	memcpy(&hdr[4], &u32, sizeof(u32));
+	u64 = ctx->stripe_ent_cnt;
+	memcpy(&hdr[8], &u64, sizeof(u64));
+
+	if (_bc_write(ctx, hdr, sizeof(hdr)) != 0)
+		return 1;
+
+	/* Readers look for the stripes where they were written */
+	for (i = 0; i < ctx->stripe_cnt && r == 0; i++) {
+		if ((path = realpath(ctx->stripes[i]->file, NULL)) == NULL &&
+		    (path = strdup(ctx->stripes[i]->file)) == NULL)
+			return 1;
+
+		u32 = (uint32_t)strlen(path);
+		if (_bc_write(ctx, &u32, sizeof(u32)) != 0 ||
+		    _bc_write(ctx, path, u32) != 0)
+			r = 1;
+
+		free(path);
+	}
+
+	if (r == 0 && ctx->stripe_ent_cnt > 0 &&
+	    _bc_write(ctx, ctx->stripe_ents,
+	    ctx->stripe_ent_cnt * sizeof(*ctx->stripe_ents)) != 0)
+		r = 1;
+
+	return r;
+}
+
+/*
+ * Move the (previously current) write buffer onto the tail of the drain
+ * list and return its ticket. Called with the drain mutex held; whoever
+ * drains it is told by the caller.
+ */
+static
+uint64_t
+_drain_push(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	buf->prev = NULL;
+	buf->next = NULL;
+
+	if (ctx->drain_tail == NULL) {
+		assert (ctx->drain == NULL);
+		ctx->drain = buf;
+	} else {
+		ctx->drain_tail->next = buf;
+		buf->prev = ctx->drain_tail;
+	}
+
+	ctx->drain_tail = buf;
+	__atomic_store_n(&ctx->drain_cnt, ctx->drain_cnt + 1, __ATOMIC_RELAXED);
+	++ctx->st_drained;
+
+	return (buf->ticket = ++ctx->drain_ticket);
+}
+
+static
+uint64_t
+_drain_buf(struct buffer_cache_ctx *ctx, struct bc_buffer *buf)
+{
+	uint64_t ticket;
+
+	assert (buf != NULL);
+
+	if (ctx->stripe_cnt > 0)
+		return _stripe_buf(ctx, buf);
+
+	/*
+	 * Lock the drain mutex, put the buffer on the drain list and
+	 * signal the drain thread that there's something for it to
+	 * drain now.
+	 */
+	pthread_mutex_lock(&ctx->drain_mtx);
+
+	ticket = _drain_push(ctx, buf);
+
+	if (ctx->engine != NULL)
+		_engine_sched(ctx);
+	else
+		_bc_wake(&ctx->drain_cv, ctx->drain_parked);
+	pthread_mutex_unlock(&ctx->drain_mtx);
+
+	return ticket;
+}
+
+/*
+ * Move the producer's current buffer to the drain list. The I/O thread
+ * may be looking for the buffer to flush it (see _bc_age_flush()), and
+ * must not find it once it's been drained. On an engine, that's one
+ * buffer less that only its producer can give back.
+ */
+static
+void
+_producer_drain(struct buffer_cache_ctx *ctx, struct bc_producer *prod)
+{
+	struct bc_buffer *buf = prod->current_wr;
+
+	__atomic_store_n(&prod->current_wr, NULL, __ATOMIC_RELAXED);
+
+	if (ctx->engine != NULL) {
+		pthread_mutex_lock(&ctx->engine->mtx);
+		--ctx->engine->held;
+		pthread_mutex_unlock(&ctx->engine->mtx);
+	}
+
+	prod->seq = buf->prod_seq + buf->bytes_used;
+	prod->ticket = _drain_buf(ctx, buf);
+}
+
+static
+void
+_bc_drop(struct buffer_cache_ctx *ctx, size_t bytes, size_t recs)
+{
+	__atomic_fetch_add(&ctx->drop_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ctx->drop_recs, recs, __ATOMIC_RELAXED);
+}
+
+static
+void
+_bc_note_wait(struct buffer_cache_ctx *ctx, uint64_t since)
+{
+	__atomic_fetch_add(&ctx->wait_cnt, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ctx->wait_ns, _bc_now() - since, __ATOMIC_RELAXED);
+}
+
+/*
+ * BC_BP_DROP_OLDEST: take the buffer at the head of the drain list (the
+ * oldest one not being written out yet) and throw away its contents.
+ */
+static
+struct bc_buffer *
+_drain_steal(struct buffer_cache_ctx *ctx)
+{
+	struct bc_buffer *buf = NULL;
+
+	/* Not while the I/O thread reads it, see _bc_age_flush() */
+	pthread_mutex_lock(&ctx->drain_mtx);
+	if (ctx->drain_cnt > 0 && !ctx->drain->age_flushing) {
+		/* It's about to be current, see _engine_get_buf() */
+		if (ctx->engine != NULL) {
+			pthread_mutex_lock(&ctx->engine->mtx);
+			++ctx->engine->held;
+			buf = _drain_pop(ctx);
+			pthread_mutex_unlock(&ctx->engine->mtx);
+		} else
+			buf = _drain_pop(ctx);
+	}
+	pthread_mutex_unlock(&ctx->drain_mtx);
+
+	if (buf != NULL) {
+		_bc_drop(ctx, _buf_len(buf), buf->rec_cnt);
+		_reset_buf(ctx, buf);
+	}
+
+	return buf;
+}
+
+/*
+ * Make sure the producer's current buffer has room for count more bytes
+ * and return it. If it doesn't have enough space, move it to the drain
+ * list, lock the empty mutex and grab an empty buffer if one is
+ * available - otherwise, unless the pool can grow, go by the backpressure
+ * policy. Returns NULL (with errno set) if the write has to be dropped.
+ */
+static
+struct bc_buffer *
+_make_room(struct buffer_cache_ctx *ctx, struct bc_producer *prod, size_t count)
+{
+	struct bc_buffer *buf = prod->current_wr;
+	struct timespec ts;
+	uint64_t t, wait_start = 0;
+	unsigned int wake;
+
+	if ((buf != NULL) && (buf->bytes_left >= count))
+		return buf;
+
+	if (buf != NULL)
+		_producer_drain(ctx, prod);
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 0;
+
+	pthread_mutex_lock(&ctx->empty_mtx);
+
+	while (ctx->empty_cnt == 0) {
+		wake = ctx->eng_wake;
+
+		if (ctx->buf_alloc_cnt < ctx->buf_max) {
+			/* Grow the pool instead of waiting */
+			++ctx->buf_alloc_cnt;
+			pthread_mutex_unlock(&ctx->empty_mtx);
+			if (ctx->engine != NULL)
+				buf = _engine_get_buf(ctx);
+			else
+				buf = _alloc_buf(ctx);
+			pthread_mutex_lock(&ctx->empty_mtx);
+
+			if (buf != NULL)
+				goto out;
+
+			--ctx->buf_alloc_cnt;
+			if (ctx->engine == NULL) {
+				fprintf(stderr, "Failed to allocate buffer, "
+				    "staying at %ju\n", ctx->buf_alloc_cnt);
+				ctx->buf_max = ctx->buf_alloc_cnt;
+				continue;
+			}
+
+			/* A buffer came back to the engine meanwhile */
+			if (ctx->eng_wake != wake)
+				continue;
+		}
+
+		if (wait_start == 0 && ctx->backpressure != BC_BP_FAIL)
+			wait_start = _bc_now();
+
+		switch (ctx->backpressure) {
+		case BC_BP_FAIL:
+			errno = EAGAIN;
+			goto fail;
+
+		case BC_BP_TIMED:
+			if (ts.tv_sec == 0 && ts.tv_nsec == 0) {
+				t = _bc_now() + ctx->bp_timeout_ns;
+				ts.tv_sec = (time_t)(t / 1000000000ULL);
+				ts.tv_nsec = (long)(t % 1000000000ULL);
+			}
+
+			if (pthread_cond_timedwait(&ctx->empty_cv, &ctx->empty_mtx,
+			    &ts) == ETIMEDOUT && ctx->empty_cnt == 0 &&
+			    ctx->eng_wake == wake) {
+				errno = ETIMEDOUT;
+				goto fail;
+			}
+			break;
+
+		case BC_BP_DROP_OLDEST:
+			pthread_mutex_unlock(&ctx->empty_mtx);
+			buf = _drain_steal(ctx);
+			pthread_mutex_lock(&ctx->empty_mtx);
+
+			if (buf != NULL)
+				goto out;
+
+			/* All buffers are being written out; wait after all */
+			if (ctx->empty_cnt == 0 && ctx->eng_wake == wake)
+				pthread_cond_wait(&ctx->empty_cv, &ctx->empty_mtx);
+			break;
+
+		case BC_BP_BLOCK:
+		default:
+			pthread_cond_wait(&ctx->empty_cv, &ctx->empty_mtx);
+			break;
+		}
+	}
+
+	assert (ctx->empty_cnt > 0);
+	assert (ctx->empty != NULL);
+	--ctx->empty_cnt;
+
+	buf = ctx->empty;
+	ctx->empty = buf->next;
+
+out:
+	pthread_mutex_unlock(&ctx->empty_mtx);
+
+	if (wait_start != 0)
+		_bc_note_wait(ctx, wait_start);
+
+	buf->key = prod->key;
+	buf->key_set = prod->key_set;
+	buf->prod_seq = prod->seq;
+	if (ctx->max_age_ns > 0)
+		buf->dirty_at = _bc_now();
+	if (ctx->engine != NULL)
+		__atomic_store_n(&prod->held_since, _bc_now(), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&prod->current_wr, buf, __ATOMIC_RELEASE);
+
+	return buf;
+
+fail:
+	pthread_mutex_unlock(&ctx->empty_mtx);
+
+	if (wait_start != 0)
+		_bc_note_wait(ctx, wait_start);
+	_bc_drop(ctx, count, 1);
+
+	return NULL;
+}
+
+/*
+ * Size of the varint for len.
+ */
+static inline
+size_t
+_frame_hdr_sz(size_t len)
+{
+	size_t n = 1;
+
+	while (len >= 0x80) {
+		len >>= 7;
+		++n;
+	}
+
+	return n;
+}
+
+/*
+ * Write len as a varint of exactly hdr_sz bytes, which may be more than it
+ * needs: a reserved record's header is sized before its length is known.
+ */
+static inline
+void
+_frame_hdr(unsigned char *p, size_t len, size_t hdr_sz)
+{
+	for (; hdr_sz > 1; hdr_sz--) {
+		*p++ = (unsigned char)(len | 0x80);
+		len >>= 7;
+	}
+	*p = (unsigned char)(len & 0x7F);
+}
+
+/*
+ * Checksum the header and data of a frame starting at p, hdr_sz + len
+ * bytes, and put the CRC after them.
+ */
+static inline
+void
+_frame_crc(unsigned char *p, size_t hdr_sz, size_t len)
+{
+	uint32_t crc = crc32c(0, p, hdr_sz + len);
+
+	p += hdr_sz + len;
+	p[0] = (unsigned char)crc;
+	p[1] = (unsigned char)(crc >> 8);
+	p[2] = (unsigned char)(crc >> 16);
+	p[3] = (unsigned char)(crc >> 24);
+}
+
+int
+buffer_cache_write(struct buffer_cache_ctx *ctx, const void *data, size_t count)
+{
+	struct bc_producer *prod;
+	struct bc_buffer *buf;
+	struct iovec iov;
+
+	/* Framing is done in one place */
+	if (ctx->flags & BC_OPT_FRAMED) {
+		iov.iov_base = (void *)data;
+		iov.iov_len = count;
+		return buffer_cache_writev(ctx, &iov, 1);
+	}
+
+	if ((prod = _producer(ctx)) == NULL)
+		return 1;
+
+	if (count > ctx->buffer_size) {
+		errno = EMSGSIZE;
+		return 1;
+	}
+
+	prod->reserved = 0;
+	_prod_pin(ctx, prod);
+	if ((buf = _make_room(ctx, prod, count)) == NULL) {
+		_prod_unpin(ctx, prod);
+		return 1;
+	}
+
+	/*
+	 * The critical path is a simple memcpy and some minor pointer/
+	 * counter adjustments on the current buffer. No locking
+	 * necessary as the current buffer is only ever written by
+	 * this thread; the I/O thread only reads what bytes_used
+	 * says is there (see _bc_age_flush()), so that is updated
+	 * last, with a release store (a plain one on x86). On an
+	 * engine, the pin is an atomic exchange on top.
+	 */
+	memcpy(buf->bufp, data, count);
+	buf->bufp += count;
+	buf->bytes_left -= count;
+	buf->rec_cnt++;
+	__atomic_store_n(&buf->bytes_used, buf->bytes_used + count,
+	    __ATOMIC_RELEASE);
+	_prod_unpin(ctx, prod);
+
+	return 0;
+}
+
+/*
+ * Write a record made up of iovcnt pieces. The space check (and buffer
+ * switch) is done once for all of them, so the record always ends up in
+ * a single buffer.
+ */
+int
+buffer_cache_writev(struct buffer_cache_ctx *ctx, const struct iovec *iov,
+    int iovcnt)
+{
+	struct bc_producer *prod;
+	struct bc_buffer *buf;
+	unsigned char *frame;
+	size_t count = 0, hdr_sz = 0;
+	int i;
+
+	if ((prod = _producer(ctx)) == NULL)
+		return 1;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > ctx->buffer_size - count) {
+			errno = EMSGSIZE;
+			return 1;
+		}
+		count += iov[i].iov_len;
+	}
+
+	if (ctx->flags & BC_OPT_FRAMED) {
+		hdr_sz = _frame_hdr_sz(count);
+		if (count > FRAME_MAX ||
+		    hdr_sz + FRAME_CRC_SZ > ctx->buffer_size - count) {
+			errno = EMSGSIZE;
+			return 1;
+		}
+	}
+
+	prod->reserved = 0;
+	_prod_pin(ctx, prod);
+	if ((buf = _make_room(ctx, prod, count + (hdr_sz > 0 ?
+	    hdr_sz + FRAME_CRC_SZ : 0))) == NULL) {
+		_prod_unpin(ctx, prod);
+		return 1;
+	}
+
+	frame = buf->bufp;
+	buf->bufp += hdr_sz;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(buf->bufp, iov[i].iov_base, iov[i].iov_len);
+		buf->bufp += iov[i].iov_len;
+	}
+
+	if (hdr_sz > 0) {
+		_frame_hdr(frame, count, hdr_sz);
+		_frame_crc(frame, hdr_sz, count);
+		buf->bufp += FRAME_CRC_SZ;
+		count += hdr_sz + FRAME_CRC_SZ;
+	}
+
+	buf->bytes_left -= count;
+	buf->rec_cnt++;
+	__atomic_store_n(&buf->bytes_used, buf->bytes_used + count,
+	    __ATOMIC_RELEASE);
+	_prod_unpin(ctx, prod);
+
+	return 0;
 }
 
-
-struct buffer_cache_ctx *
-buffer_cache_init(const char *file, int compress, size_t buffer_size_mb, size_t buffer_cnt)
+void *
+buffer_cache_reserve(struct buffer_cache_ctx *ctx, size_t count)
 {
+	struct bc_producer *prod;
 	struct bc_buffer *buf;
-	struct buffer_cache_ctx *ctx = NULL;
-	size_t buffer_size_b;
-	size_t i;
-	int r;
+	size_t hdr_sz = 0;
 
-	buffer_size_b = buffer_size_mb*1024*1024;
+	if ((prod = _producer(ctx)) == NULL)
+		return NULL;
 
-	if (buffer_size_mb < 1 || buffer_cnt < 1) {
-		fprintf(stderr, "Didn't specify at least one buffer of at least 1 MB\n");
+	if (count > ctx->buffer_size) {
+		errno = EMSGSIZE;
 		return NULL;
 	}
 
-	if ((ctx = malloc(sizeof(*ctx))) == NULL) {
-		fprintf(stderr, "Failed to allocate ctx memory\n");
+	if (ctx->flags & BC_OPT_FRAMED) {
+		hdr_sz = _frame_hdr_sz(count);
+		if (count > FRAME_MAX ||
+		    hdr_sz + FRAME_CRC_SZ > ctx->buffer_size - count) {
+			errno = EMSGSIZE;
+			return NULL;
+		}
+	}
+
+	prod->reserved = 0;
+	_prod_pin(ctx, prod);
+	if ((buf = _make_room(ctx, prod, count + (hdr_sz > 0 ?
+	    hdr_sz + FRAME_CRC_SZ : 0))) == NULL) {
+		_prod_unpin(ctx, prod);
 		return NULL;
 	}
 
-	memset(ctx, 0, sizeof(*ctx));
-	ctx->fd = -1;
-	ctx->compress = compress;
+	/* Stays pinned until committed */
+	prod->reserved = count;
 
-	pthread_cond_init(&ctx->empty_cv, NULL);
-	pthread_cond_init(&ctx->drain_cv, NULL);
-	pthread_mutex_init(&ctx->empty_mtx, NULL);
-	pthread_mutex_init(&ctx->drain_mtx, NULL);
+	return buf->bufp + hdr_sz;
+}
 
-	ctx->file = strdup(file);
-	if (ctx->file == NULL) {
-		fprintf(stderr, "Failed to allocate strdup memory\n");
-		buffer_cache_destroy(ctx);
-		return NULL;
+int
+buffer_cache_commit(struct buffer_cache_ctx *ctx, size_t count)
+{
+	struct bc_producer *prod;
+	struct bc_buffer *buf;
+	size_t hdr_sz;
+
+	if ((prod = _producer(ctx)) == NULL)
+		return 1;
+
+	_prod_pin(ctx, prod);
+	buf = prod->current_wr;
+	if (buf == NULL || count > prod->reserved) {
+		_prod_unpin(ctx, prod);
+		return 1;
 	}
 
-	if ((ctx->fd = open(ctx->file, O_WRONLY | O_CREAT | O_TRUNC, 00666)) < 0) {
-		fprintf(stderr, "Failed to open file %s\n", ctx->file);
-		buffer_cache_destroy(ctx);
-		return NULL;
+	if (ctx->flags & BC_OPT_FRAMED) {
+		hdr_sz = _frame_hdr_sz(prod->reserved);
+		_frame_hdr(buf->bufp, count, hdr_sz);
+		_frame_crc(buf->bufp, hdr_sz, count);
+		count += hdr_sz + FRAME_CRC_SZ;
 	}
 
-	switch (ctx->compress) {
-#ifndef _WITHOUT_LZ4
-	case BC_COMP_LZ4:
-		ctx->lz4_state.stream_checksum = 1;
-		ctx->lz4_state.first = 1;
-		ctx->lz4_state.xxh32_state = XXH32_init(0);
-		if ((r = lz4_write_hdr(ctx)) != 0) {
-			fprintf(stderr, "Failed to write LZ4 header");
-			buffer_cache_destroy(ctx);
-			return NULL;
-		}
-		break;
-#endif
+	buf->bufp += count;
+	buf->bytes_left -= count;
+	buf->rec_cnt++;
+	__atomic_store_n(&buf->bytes_used, buf->bytes_used + count,
+	    __ATOMIC_RELEASE);
+	prod->reserved = 0;
+	_prod_unpin(ctx, prod);
 
-#ifdef _WITH_ZLIB
-	case BC_COMP_ZLIB:
-		ctx->zlib_state.zlib_strm.zalloc = NULL;
-		ctx->zlib_state.zlib_strm.zfree = NULL;
-		ctx->zlib_state.zlib_strm.opaque = NULL;
-		ctx->zlib_state.isize = 0;
-		ctx->zlib_state.zlib_crc32 = crc32(0L, Z_NULL, 0);
-		if ((r = deflateInit2(&ctx->zlib_state.zlib_strm, 1 /* level */, Z_DEFLATED, (-MAX_WBITS), 8, Z_DEFAULT_STRATEGY)) != Z_OK) {
-			fprintf(stderr, "Failed to initialize deflate");
-			buffer_cache_destroy(ctx);
-			return NULL;
-		}
-		if ((r = zlib_write_hdr(ctx)) != 0) {
-			fprintf(stderr, "Failed to write gzip header");
-			buffer_cache_destroy(ctx);
-			return NULL;
-		}
-		break;
-#endif
+	return 0;
+}
 
-	case BC_COMP_NONE:
-		break;
+int
+buffer_cache_drain(struct buffer_cache_ctx *ctx)
+{
+	struct bc_producer *prod;
 
-	default:
-		fprintf(stderr, "Invalid compression option\n");
-		buffer_cache_destroy(ctx);
-		return NULL;
-	}
+	if ((prod = _producer(ctx)) == NULL)
+		return 1;
 
-	ctx->buffer_size = buffer_size_b;
-	ctx->buffer_cnt = buffer_cnt;
+	_prod_pin(ctx, prod);
+	if (prod->current_wr != NULL)
+		_producer_drain(ctx, prod);
 
-	/*
-	 * Allocate all the buffers that have been requested and place them
-	 * on the empty list.
-	 */
-	for (i = 0; i < buffer_cnt; i++) {
-		if ((buf = malloc(sizeof(*buf) + buffer_size_b + LZ4_EXTRA_SZ)) == NULL) {
-			fprintf(stderr, "Failed to allocate %ju bytes for buffer %ju\n", sizeof(*buf) + buffer_size_b, i);
-			buffer_cache_destroy(ctx);
-			return NULL;
-		}
+	prod->reserved = 0;
+	_prod_unpin(ctx, prod);
 
-		memset(buf, 0, sizeof(*buf) + buffer_size_b + LZ4_EXTRA_SZ);
-		buf->bufp = buf->buf + LZ4_EXTRA_SZ;
-		buf->bytes_left = buffer_size_b;
-		buf->bytes_used = 0;
-		buf->prev = NULL;
-		buf->next = ctx->empty;
-		if (ctx->empty != NULL)
-			ctx->empty->prev = buf;
-		ctx->empty = buf;
+	return 0;
+}
 
-		++ctx->empty_cnt;
-	}
+int
+buffer_cache_set_key(struct buffer_cache_ctx *ctx, uint64_t key)
+{
+	struct bc_producer *prod;
+	struct bc_buffer *buf;
 
-	assert (ctx->empty_cnt == ctx->buffer_cnt);
+	if ((prod = _producer(ctx)) == NULL)
+		return 1;
 
-	/*
-	 * Remove the first buffer from the empty list and use it as the
-	 * current write buffer.
-	 */
-	ctx->current_wr = ctx->empty;
-	ctx->empty = ctx->empty->next;
-	--ctx->empty_cnt;
+	prod->key = key;
+	prod->key_set = 1;
 
-	/*
-	 * Initialize the drain thread.
-	 */
-	if ((r = pthread_create(&ctx->io_thread, NULL, _drain_thr, ctx)) != 0) {
-		fprintf(stderr, "Failed to pthread_create()\n");
-		buffer_cache_destroy(ctx);
-		return NULL;
+	/* Nothing in the current buffer yet, so it starts at this key */
+	_prod_pin(ctx, prod);
+	if ((buf = prod->current_wr) != NULL && buf->bytes_used == 0) {
+		buf->key = key;
+		buf->key_set = 1;
 	}
+	_prod_unpin(ctx, prod);
 
-	ctx->thr_created = 1;
+	return 0;
+}
 
-	return ctx;
+uint64_t
+buffer_cache_seq(struct buffer_cache_ctx *ctx)
+{
+	struct bc_producer *prod;
+	struct bc_buffer *buf;
+	uint64_t seq;
+
+	if ((prod = _producer(ctx)) == NULL)
+		return 0;
+
+	_prod_pin(ctx, prod);
+	if ((buf = prod->current_wr) != NULL)
+		seq = buf->prod_seq + buf->bytes_used;
+	else
+		seq = prod->seq;
+	_prod_unpin(ctx, prod);
+
+	return seq;
 }
 
+/*
+ * Wake up the I/O thread, wherever it waits, to look at sync_req.
+ */
 static
 void
-_drain_current(struct buffer_cache_ctx *ctx)
+_bc_io_wake(struct buffer_cache_ctx *ctx)
 {
-	struct bc_buffer *buf = ctx->current_wr;
+	pthread_mutex_t *mtx = &ctx->drain_mtx;
+	pthread_cond_t *cv = &ctx->drain_cv;
+
+	if (ctx->engine != NULL) {
+		pthread_mutex_lock(mtx);
+		_engine_sched(ctx);
+		pthread_mutex_unlock(mtx);
+		return;
+	}
 
-	assert (buf != NULL);
+	if (ctx->comp_workers > 0) {
+		mtx = &ctx->seq_mtx;
+		cv = &ctx->seq_cv;
+	}
 
-	/*
-	 * Lock the drain mutex and move the current write buffer
-	 * onto the tail of the drain list and signal the drain
-	 * thread that there's something for it to drain now.
-	 */
-	buf->prev = NULL;
-	buf->next = NULL;
+	pthread_mutex_lock(mtx);
+	pthread_cond_signal(cv);
+	pthread_mutex_unlock(mtx);
+}
 
-	pthread_mutex_lock(&ctx->drain_mtx);
+/*
+ * Wait for everything up to ticket to be synced.
+ */
+static
+int
+_bc_wait_ticket(struct buffer_cache_ctx *ctx, uint64_t ticket)
+{
+	int r = 0;
 
-	if (ctx->drain_tail == NULL) {
-		assert (ctx->drain == NULL);
-		ctx->drain = buf;
-	} else {
-		ctx->drain_tail->next = buf;
-		buf->prev = ctx->drain_tail;
+	pthread_mutex_lock(&ctx->sync_mtx);
+
+	if (ctx->synced_ticket < ticket && !ctx->sync_failed) {
+		if (__atomic_load_n(&ctx->sync_req, __ATOMIC_RELAXED) < ticket)
+			__atomic_store_n(&ctx->sync_req, ticket, __ATOMIC_RELEASE);
+
+		pthread_mutex_unlock(&ctx->sync_mtx);
+		_bc_io_wake(ctx);
+		pthread_mutex_lock(&ctx->sync_mtx);
 	}
 
-	ctx->drain_tail = buf;
-	++ctx->drain_cnt;
-	ctx->current_wr = NULL;
+	while (ctx->synced_ticket < ticket && !ctx->sync_failed)
+		pthread_cond_wait(&ctx->durable_cv, &ctx->sync_mtx);
 
-	pthread_cond_signal(&ctx->drain_cv);
-	pthread_mutex_unlock(&ctx->drain_mtx);
+	if (ctx->synced_ticket < ticket) {
+		errno = EIO;
+		r = 1;
+	}
+
+	pthread_mutex_unlock(&ctx->sync_mtx);
+
+	return r;
 }
 
 int
-buffer_cache_write(struct buffer_cache_ctx *ctx, const void *data, size_t count)
+buffer_cache_wait_durable(struct buffer_cache_ctx *ctx, uint64_t seq)
 {
-	struct bc_buffer *buf = ctx->current_wr;
+	struct bc_producer *prod;
+	struct bc_buffer *buf;
+	uint64_t ticket;
+	size_t i;
+	int r = 0;
+
+	if ((prod = _producer(ctx)) == NULL)
+		return 1;
+
+	/* Part of it is still in the current buffer, so that goes first */
+	_prod_pin(ctx, prod);
+	if ((buf = prod->current_wr) != NULL && seq > buf->prod_seq) {
+		_producer_drain(ctx, prod);
+		prod->reserved = 0;
+	}
+	ticket = prod->ticket;
+	_prod_unpin(ctx, prod);
+
+	if (ctx->stripe_cnt == 0)
+		return _bc_wait_ticket(ctx, ticket);
 
 	/*
-	 * If the current buffer doesn't have enough space to write the
-	 * new data into it, move it to the drain list, lock the empty
-	 * mutex and grab an empty buffer if one is available - otherwise
-	 * wait until we are told that there is.
+	 * Tickets are per stripe, so wait for everything that's gone to
+	 * any of them so far.
 	 */
-	if ((buf == NULL) || (buf->bytes_left < count)) {
-		if (buf != NULL)
-			_drain_current(ctx);
+	for (i = 0; i < ctx->stripe_cnt; i++) {
+		pthread_mutex_lock(&ctx->stripes[i]->drain_mtx);
+		ticket = ctx->stripes[i]->drain_ticket;
+		pthread_mutex_unlock(&ctx->stripes[i]->drain_mtx);
 
-		pthread_mutex_lock(&ctx->empty_mtx);
+		if (_bc_wait_ticket(ctx->stripes[i], ticket) != 0)
+			r = 1;
+	}
 
-		if (ctx->empty_cnt == 0)
-			pthread_cond_wait(&ctx->empty_cv, &ctx->empty_mtx);
+	return r;
+}
 
-		assert (ctx->empty_cnt > 0);
-		assert (ctx->empty != NULL);
-		--ctx->empty_cnt;
+void
+buffer_cache_drops(struct buffer_cache_ctx *ctx, uint64_t *bytes,
+    uint64_t *records)
+{
+	*bytes = __atomic_load_n(&ctx->drop_bytes, __ATOMIC_RELAXED);
+	*records = __atomic_load_n(&ctx->drop_recs, __ATOMIC_RELAXED);
+}
 
-		buf = ctx->current_wr = ctx->empty;
-		ctx->empty = buf->next;
+void
+buffer_cache_waits(struct buffer_cache_ctx *ctx, uint64_t *waits,
+    uint64_t *wait_ns)
+{
+	*waits = __atomic_load_n(&ctx->wait_cnt, __ATOMIC_RELAXED);
+	*wait_ns = __atomic_load_n(&ctx->wait_ns, __ATOMIC_RELAXED);
+}
 
-		pthread_mutex_unlock(&ctx->empty_mtx);
-	}
+/*
+ * Add the counters of ctx's I/O side to st.
+ */
+static
+void
+_bc_stats_add(struct buffer_cache_ctx *ctx, struct buffer_cache_stats *st)
+{
+	size_t i;
 
-	/*
-	 * The critical path is a simple memcpy and some minor pointer/
-	 * counter adjustments on the current buffer. No locking
-	 * necessary as the current buffer is only ever touched by
-	 * this thread.
-	 */
-	memcpy(buf->bufp, data, count);
-	buf->bufp += count;
-	buf->bytes_left -= count;
-	buf->bytes_used += count;
+	st->bytes_in += __atomic_load_n(&ctx->st_bytes_in, __ATOMIC_RELAXED);
+	st->bytes_out += __atomic_load_n(&ctx->st_bytes_out, __ATOMIC_RELAXED);
 
-	return 0;
+	for (i = 0; i < BC_STATS_HIST; i++) {
+		st->compress_hist[i] += __atomic_load_n(&ctx->st_comp_hist[i],
+		    __ATOMIC_RELAXED);
+		st->write_hist[i] += __atomic_load_n(&ctx->st_write_hist[i],
+		    __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock(&ctx->drain_mtx);
+	st->bufs_drained += ctx->st_drained;
+	st->drain_cnt += ctx->drain_cnt;
+	pthread_mutex_unlock(&ctx->drain_mtx);
 }
 
-int
-buffer_cache_drain(struct buffer_cache_ctx *ctx)
+void
+buffer_cache_stats(struct buffer_cache_ctx *ctx, struct buffer_cache_stats *st)
 {
-	if (ctx->current_wr != NULL)
-		_drain_current(ctx);
+	size_t i;
 
-	return 0;
+	memset(st, 0, sizeof(*st));
+
+	/* A striped ctx's buffers are written out by its stripes */
+	_bc_stats_add(ctx, st);
+	for (i = 0; i < ctx->stripe_cnt; i++)
+		_bc_stats_add(ctx->stripes[i], st);
+
+	pthread_mutex_lock(&ctx->empty_mtx);
+	st->empty_cnt = ctx->empty_cnt;
+	st->buf_cnt = ctx->buf_alloc_cnt;
+	pthread_mutex_unlock(&ctx->empty_mtx);
+
+	buffer_cache_waits(ctx, &st->waits, &st->wait_ns);
+	buffer_cache_drops(ctx, &st->drop_bytes, &st->drop_recs);
 }
 
-void
+int
 buffer_cache_destroy(struct buffer_cache_ctx *ctx)
 {
 	struct bc_buffer *buf;
 	struct bc_buffer *next;
+	struct bc_producer *prod;
+	size_t i;
+	int r;
+
+	/*
+	 * Stop tracking producer threads; all of them are required to
+	 * be done writing by now. Their current buffers are collected
+	 * below.
+	 */
+	if (ctx->prod_key_created)
+		pthread_key_delete(ctx->prod_key);
 
-	if (ctx->thr_created) {
+	if (ctx->thr_created || ctx->engine != NULL) {
 		/*
 		 * If the drain thread already exists, make sure the
-		 * current buffer is moved onto the drain list before
+		 * current buffer(s) are moved onto the drain list before
 		 * doing anything else.
 		 */
-		if (ctx->current_wr != NULL) {
-			_drain_current(ctx);
+		_prod_pin(ctx, &ctx->sp);
+		if (ctx->sp.current_wr != NULL)
+			_producer_drain(ctx, &ctx->sp);
+
+		for (prod = ctx->producers; prod != NULL; prod = prod->next) {
+			_prod_pin(ctx, prod);
+			if (prod->current_wr != NULL)
+				_producer_drain(ctx, prod);
 		}
 
 		/*
@@ -737,60 +5321,185 @@ buffer_cache_destroy(struct buffer_cache_ctx *ctx)
 		 * exit.
 		 */
 		pthread_mutex_lock(&ctx->empty_mtx);
-		while (ctx->empty_cnt != ctx->buffer_cnt)
+		while (ctx->empty_cnt != ctx->buf_alloc_cnt)
 			pthread_cond_wait(&ctx->empty_cv, &ctx->empty_mtx);
 		pthread_mutex_unlock(&ctx->empty_mtx);
+	}
 
-		pthread_mutex_lock(&ctx->drain_mtx);
-		ctx->exit_drain = 1;
-		pthread_cond_signal(&ctx->drain_cv);
-		pthread_mutex_unlock(&ctx->drain_mtx);
+	pthread_mutex_lock(&ctx->drain_mtx);
+	ctx->exit_drain = 1;
+	pthread_cond_broadcast(&ctx->drain_cv);
 
-		pthread_join(ctx->io_thread, NULL);
+	/* Let the engine finish its last turn on this ctx, if any */
+	while (ctx->eng_sched)
+		pthread_cond_wait(&ctx->drain_cv, &ctx->drain_mtx);
+	pthread_mutex_unlock(&ctx->drain_mtx);
+
+	if (ctx->engine != NULL)
+		_engine_detach(ctx);
+
+	for (i = 0; i < ctx->comp_workers && ctx->workers != NULL; i++) {
+		if (ctx->workers[i].thr_created)
+			pthread_join(ctx->workers[i].thread, NULL);
+#ifndef _WITHOUT_LZ4
+		if (ctx->workers[i].lz4_strm != NULL)
+			free(ctx->workers[i].lz4_strm);
+#endif
+#ifdef _WITH_ZLIB
+		if (ctx->workers[i].zlib_init)
+			deflateEnd(&ctx->workers[i].zlib_strm);
+#endif
 	}
 
+	pthread_mutex_lock(&ctx->seq_mtx);
+	ctx->exit_seq = 1;
+	pthread_cond_broadcast(&ctx->seq_cv);
+	pthread_mutex_unlock(&ctx->seq_mtx);
+
+	if (ctx->thr_created)
+		pthread_join(ctx->io_thread, NULL);
+
 	pthread_cond_destroy(&ctx->drain_cv);
 	pthread_cond_destroy(&ctx->empty_cv);
 	pthread_mutex_destroy(&ctx->drain_mtx);
 	pthread_mutex_destroy(&ctx->empty_mtx);
+	pthread_mutex_destroy(&ctx->prod_mtx);
+
+#ifdef _WITH_IO_URING
+	if (ctx->uring != NULL)
+		bc_uring_free(ctx->uring);
+#endif
+	pthread_cond_destroy(&ctx->seq_cv);
+	pthread_mutex_destroy(&ctx->seq_mtx);
+	pthread_cond_destroy(&ctx->durable_cv);
+	pthread_mutex_destroy(&ctx->sync_mtx);
+
+	/* The threads are gone, so sync_failed is final */
+	r = ctx->sync_failed;
 
 	if (ctx->fd >= 0) {
-		switch (ctx->compress) {
+		/*
+		 * A ctx on an engine ends its stream through scratch space
+		 * of its own, there being no turn on a thread to borrow the
+		 * thread's any more.
+		 */
+		if (ctx->compress != BC_COMP_NONE && ctx->comp_obuf == NULL)
+			ctx->comp_obuf = malloc(COMP_OBUF_SZ);
+
+		/* After a failed write, the end of the file is lost anyway */
+		if (!ctx->sync_failed &&
+		    ((ctx->compress != BC_COMP_NONE && ctx->comp_obuf == NULL) ||
+		    _bc_finish_file(ctx, ctx->thr_created ||
+		    ctx->engine != NULL) != 0)) {
+			fprintf(stderr, "Failed to finish %s\n", ctx->file);
+			r = 1;
+		}
+
+		if (ctx->stripe_cnt > 0 && ctx->thr_created &&
+		    _stripe_write(ctx) != 0) {
+			fprintf(stderr, "Failed to write manifest %s\n", ctx->file);
+			r = 1;
+		}
+
+		if (!r && ctx->durability != BC_DUR_NONE &&
+		    fdatasync(ctx->fd) != 0) {
+			fprintf(stderr, "Failed to sync %s\n", ctx->file);
+			r = 1;
+		}
+
+		if (close(ctx->fd) != 0)
+			r = 1;
+	}
+
+	/* All buffers have come back, so the stripes are idle */
+	for (i = 0; i < ctx->stripe_cnt; i++) {
+		if (ctx->stripes[i] != NULL &&
+		    buffer_cache_destroy(ctx->stripes[i]) != 0)
+			r = 1;
+	}
+
+	switch (ctx->compress) {
 #ifndef _WITHOUT_LZ4
-		case BC_COMP_LZ4:
-			if (ctx->lz4_state.hdr_written)
-				lz4_write_tail(ctx);
-			break;
+	case BC_COMP_LZ4:
+		if (ctx->lz4_state.lz4_state != NULL)
+			free(ctx->lz4_state.lz4_state);
+		/* Only left if the file wasn't finished */
+		if (ctx->lz4_state.xxh32_state != NULL)
+			free(ctx->lz4_state.xxh32_state);
+		break;
 #endif
 
 #ifdef _WITH_ZLIB
-		case BC_COMP_ZLIB:
-			if (ctx->zlib_state.hdr_written)
-				zlib_write_tail(ctx);
-			break;
+	case BC_COMP_ZLIB:
+		deflateEnd(&ctx->zlib_state.zlib_strm);
+		break;
 #endif
 
-		default:
-			break;
-		}
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		if (ctx->zstd_state.cctx != NULL)
+			ZSTD_freeCCtx(ctx->zstd_state.cctx);
+		break;
+#endif
 
-		close(ctx->fd);
+	default:
+		break;
 	}
 
+	if (ctx->comp_obuf != NULL)
+		free(ctx->comp_obuf);
+
+	if (ctx->dio_buf != NULL)
+		free(ctx->dio_buf);
+
 	if (ctx->file != NULL)
 		free(ctx->file);
 
-	if (ctx->current_wr != NULL)
-		free(ctx->current_wr);
+	if (ctx->file_pattern != NULL)
+		free(ctx->file_pattern);
+
+	if (ctx->file_stem != NULL)
+		free(ctx->file_stem);
 
+	if (ctx->stripes != NULL)
+		free(ctx->stripes);
+
+	if (ctx->stripe_ents != NULL)
+		free(ctx->stripe_ents);
+
+	if (ctx->sp.current_wr != NULL)
+		_free_buf(ctx->sp.current_wr);
+
+	while ((prod = ctx->producers) != NULL) {
+		ctx->producers = prod->next;
+		if (prod->current_wr != NULL)
+			_free_buf(prod->current_wr);
+		free(prod);
+	}
 
 	for (buf = ctx->drain; buf != NULL; buf = next) {
 		next = buf->next;
-		free(buf);
+		_free_buf(buf);
 	}
 
 	for (buf = ctx->empty; buf != NULL; buf = next) {
 		next = buf->next;
-		free(buf);
+		_free_buf(buf);
 	}
+
+	if (ctx->workers != NULL)
+		free(ctx->workers);
+
+	if (ctx->seq_ring != NULL)
+		free(ctx->seq_ring);
+
+	if (ctx->index != NULL)
+		free(ctx->index);
+
+	free(ctx);
+
+	if (r)
+		errno = EIO;
+
+	return r;
 }
@@ -27,14 +27,405 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
 struct buffer_cache_ctx;
+struct buffer_cache_engine;
+struct buffer_cache_reader;
 
 #define BC_COMP_NONE	0x00
 #define BC_COMP_LZ4	0x01
 #define BC_COMP_ZLIB	0x02
+#define BC_COMP_ZSTD	0x03
+
+/*
+ * BC_OPT_MULTI_PRODUCER allows any number of threads to call
+ * buffer_cache_write() on the same ctx concurrently. Each thread gets its
+ * own current buffer from the shared empty list, so buffer_cnt should be
+ * larger than the number of producer threads. buffer_cache_drain() only
+ * drains the calling thread's buffer, and all producers must be done
+ * before calling buffer_cache_destroy().
+ */
+#define BC_OPT_MULTI_PRODUCER	0x0001
+
+/*
+ * BC_OPT_IO_URING writes drained buffers through io_uring, keeping up to
+ * io_depth writes (default: buffer_cnt) in flight. A buffer only returns
+ * to the empty list once its write has completed. If io_uring isn't
+ * available (or not compiled in with _WITH_IO_URING), write(2) is used.
+ */
+#define BC_OPT_IO_URING		0x0002
+
+/*
+ * BC_OPT_DIRECT_IO opens the output file with O_DIRECT to keep it out of
+ * the page cache. The final partial block is written padded and the file
+ * truncated to its real size by buffer_cache_destroy(). If the file
+ * system doesn't support O_DIRECT, buffered I/O is used instead.
+ */
+#define BC_OPT_DIRECT_IO	0x0004
+
+/*
+ * BC_OPT_LZ4_LINKED compresses LZ4 blocks as dependent blocks, each able
+ * to refer back to the previous 64 KB of data, including across buffer
+ * boundaries. This improves the ratio for small repetitive records, but
+ * blocks can no longer be decompressed independently.
+ */
+#define BC_OPT_LZ4_LINKED	0x0008
+
+/*
+ * BC_OPT_INDEX records where each buffer starts in the compressed output,
+ * along with the key last set by buffer_cache_set_key() (a timestamp, for
+ * example) at that point. buffer_cache_destroy() appends the index to the
+ * file: as a skippable frame for LZ4 and zstd, and as empty gzip members
+ * carrying it in their extra field for gzip. Every buffer is then
+ * compressed without reference to earlier ones (as a frame of its own,
+ * for zstd), so that readers can start at any of them; see
+ * buffer_cache_reader_seek(). Ignored without compression.
+ */
+#define BC_OPT_INDEX		0x0010
+
+/*
+ * BC_OPT_ZSTD_LONG enables zstd's long distance matching, with a 128 MB
+ * window, which finds repetitions far further back than the default
+ * window does. Decompressing the output takes as much memory.
+ */
+#define BC_OPT_ZSTD_LONG	0x0020
+
+/*
+ * BC_OPT_HUGE_PAGES backs the buffers with 2 MB pages, cutting down on TLB
+ * misses when copying into them: reserved huge pages (see
+ * /proc/sys/vm/nr_hugepages) as long as there are any, transparent huge
+ * pages otherwise.
+ */
+#define BC_OPT_HUGE_PAGES	0x0040
+
+/*
+ * BC_OPT_NUMA_LOCAL places the buffers on the NUMA node of the thread
+ * calling buffer_cache_init_opts(), which should be the node the
+ * producers run on. Where that node runs out of memory, others are used.
+ */
+#define BC_OPT_NUMA_LOCAL	0x0080
+
+/*
+ * BC_OPT_FRAMED writes every record (each write, writev or commit) as a
+ * frame: its length as a varint, the data, and a CRC-32C of both (little
+ * endian). Records take up to 9 more bytes, and can be read back one by
+ * one with buffer_cache_reader_record(), which checks them. A reader
+ * opened with buffer_cache_reader_recover() uses the frames to salvage
+ * the intact records around damage. As the records are checked anyway,
+ * LZ4 and zstd output goes without a checksum over the whole stream; gzip
+ * has to have its crc32. LZ4 blocks still have theirs, as a damaged block
+ * can decompress into copies of earlier records.
+ */
+#define BC_OPT_FRAMED		0x0100
+
+/*
+ * backpressure decides what a write does once all buffers are full and
+ * waiting to be written out. Writes that are given up on, and data that
+ * is thrown away, are counted; see buffer_cache_drops().
+ *
+ * BC_BP_BLOCK waits for a buffer to be written out.
+ * BC_BP_FAIL fails the write right away, with errno EAGAIN.
+ * BC_BP_TIMED waits for up to bp_timeout_us, then fails the write with
+ * errno ETIMEDOUT.
+ * BC_BP_DROP_OLDEST throws away the oldest full buffer not being written
+ * out yet and reuses it; if there is none, it waits after all.
+ */
+#define BC_BP_BLOCK		0
+#define BC_BP_FAIL		1
+#define BC_BP_TIMED		2
+#define BC_BP_DROP_OLDEST	3
+
+/*
+ * durability decides when the I/O thread makes what it has written out
+ * durable, with fdatasync(2). Whatever the mode, it also does so when
+ * a producer waits for it, see buffer_cache_wait_durable().
+ *
+ * BC_DUR_NONE leaves it at that.
+ * BC_DUR_PERIODIC syncs at least every sync_interval_ms (1000 by
+ * default), if anything was written out since.
+ * BC_DUR_BUFFER syncs after each buffer, except that the buffers queued
+ * up one after the other (up to buffer_cnt) share a single sync.
+ */
+#define BC_DUR_NONE		0
+#define BC_DUR_PERIODIC		1
+#define BC_DUR_BUFFER		2
+
+/*
+ * Up to buffer_cnt buffers of buffer_size_mb are allocated, buffer_min
+ * (at least one) at init and the others only once producers run out of
+ * empty ones, rather than making them wait. Their memory is only faulted
+ * in as it's written to, a page at a time (2 MB with BC_OPT_HUGE_PAGES),
+ * and so is the compressor's scratch space (4 MB, one per engine thread
+ * rather than per ctx with an engine). pool_max_mb caps the memory of all
+ * buffers together, lowering buffer_cnt as needed. With
+ * idle_shrink_ms, buffers that haven't been used for that long are freed
+ * again, down to buffer_min.
+ *
+ * comp_workers > 0 compresses drained buffers on that many threads in
+ * parallel, while a single I/O thread writes them out in their original
+ * order. Each buffer then needs a second, output-sized buffer of its own.
+ * LZ4 output then has a checksum per block, computed by the workers,
+ * rather than one over the whole stream, which only the I/O thread could
+ * compute. zstd (compiled in with _WITH_ZSTD) uses its own worker threads
+ * instead, still producing a single stream. zstd_level is the zstd
+ * compression level, 0 being zstd's default.
+ *
+ * With max_age_ms, data doesn't sit in a partially filled buffer for much
+ * longer than that: the I/O thread writes out what's there by itself
+ * (once it has caught up with the buffers drained before), without the
+ * producer noticing. With compression, each such flush ends a deflate
+ * block or zstd block (a frame with BC_OPT_INDEX); LZ4 blocks it produces
+ * don't link back. With O_DIRECT, the last partial block is written out
+ * padded with zeros until the data following it overwrites it.
+ *
+ * With rotate_mb and/or rotate_sec, output moves on to a new file once the
+ * current one holds rotate_mb (it goes over by up to a buffer's output),
+ * and at every multiple of rotate_sec since the epoch (so hourly files
+ * start on the hour). The I/O thread finishes and syncs the current file
+ * as buffer_cache_destroy() would, then starts the next one; producers
+ * keep on writing throughout. file is then a pattern for the names: %i
+ * is replaced by the file's number, counting from 0, and the rest goes
+ * through strftime(3) with the local time the file starts at. Where that
+ * comes out the same as for the file before (always, without any % in
+ * it), .<number> is appended: file, file.1, file.2 and so on. Existing
+ * files are overwritten, as the first one is.
+ *
+ * With stripe_cnt > 0, the output is spread over the stripe_cnt files named
+ * in stripe_files (on different devices, ideally), each written by an I/O
+ * thread of its own (and compression workers of its own). Each drained
+ * buffer goes to the stripe with the fewest buffers queued, taking turns
+ * while they all keep up. Every stripe file is a complete file as above,
+ * holding its share of the data; file names the manifest instead, which
+ * records the stripes and the order their pieces go in. It is written by
+ * buffer_cache_destroy(). buffer_cache_reader_open() on the manifest reads
+ * the whole stream back; seeking in it needs BC_OPT_INDEX if compressed.
+ * max_age_ms and rotation aren't available with stripes, and
+ * BC_BP_DROP_OLDEST waits like BC_BP_BLOCK.
+ *
+ * Once it has written out all drained buffers, the I/O thread keeps
+ * looking for the next one for spin_us (50 by default) before it goes
+ * to sleep, and so do the compression workers. Producers that drain a
+ * buffer in the meantime, or while the threads are still busy, don't
+ * have to make a system call to wake them, at the cost of that much CPU
+ * time each time they run out of work. 0 (or a single CPU) has them go
+ * to sleep right away. Engine threads always spin for 50 us (if there
+ * is more than one CPU).
+ *
+ * With engine set, the ctx has no threads of its own: the threads of the
+ * engine (see buffer_cache_engine_init()) compress and write out its
+ * buffers, and its buffers come from the engine's pool. buffer_size_mb is
+ * then the engine's, while buffer_cnt and pool_max_mb still cap how many
+ * of the pool's buffers this ctx may hold. Compression workers, stripes,
+ * max_age_ms, idle_shrink_ms, rotation, BC_DUR_PERIODIC, BC_OPT_IO_URING
+ * and BC_OPT_DIRECT_IO aren't available with an engine.
+ */
+struct buffer_cache_opts {
+	int	compress;
+	size_t	buffer_size_mb;
+	size_t	buffer_cnt;
+	int	flags;
+	size_t	comp_workers;
+	size_t	io_depth;
+	int	zstd_level;
+	size_t	buffer_min;
+	size_t	pool_max_mb;
+	unsigned int idle_shrink_ms;
+	int	backpressure;
+	unsigned int bp_timeout_us;
+	unsigned int max_age_ms;
+	int	durability;
+	unsigned int sync_interval_ms;
+	size_t	rotate_mb;
+	unsigned int rotate_sec;
+	const char **stripe_files;
+	size_t	stripe_cnt;
+	unsigned int spin_us;
+	struct buffer_cache_engine *engine;
+};
 
+void buffer_cache_opts_init(struct buffer_cache_opts *opts);
+struct buffer_cache_ctx *buffer_cache_init_opts(const char *file,
+    const struct buffer_cache_opts *opts);
 struct buffer_cache_ctx *buffer_cache_init(const char *file, int compress,
     size_t buffer_size_mb, size_t buffer_cnt);
 int buffer_cache_write(struct buffer_cache_ctx *ctx, const void *data, size_t count);
+int buffer_cache_writev(struct buffer_cache_ctx *ctx, const struct iovec *iov,
+    int iovcnt);
+
+/*
+ * An engine serves any number of ctxs (attached through opts.engine) with
+ * threads I/O threads and a shared pool of buffers of buffer_size_mb,
+ * pool_max_mb in all (0 for no limit). The threads compress and write out
+ * the buffers the ctxs drain, whichever ctx they come from. They take
+ * turns among the ctxs with buffers drained, one buffer at a time, so a
+ * busy ctx doesn't hold up the others. When the pool is used up, a ctx
+ * that needs a buffer applies its backpressure policy until one is
+ * returned. If every buffer is some producer's current one, so none are
+ * on their way back, the one that has been current the longest is taken
+ * from its producer and written out, partially filled. Producers keep
+ * theirs while they write (which costs them an atomic exchange per call)
+ * or hold a reservation. All ctxs attached to the engine must have been
+ * destroyed before buffer_cache_engine_destroy() is called.
+ */
+struct buffer_cache_engine *buffer_cache_engine_init(size_t threads,
+    size_t buffer_size_mb, size_t pool_max_mb);
+void buffer_cache_engine_destroy(struct buffer_cache_engine *eng);
+
+/*
+ * buffer_cache_reserve() returns a pointer to count bytes of space in the
+ * calling thread's current buffer, so that a record can be built in place
+ * instead of being copied in by buffer_cache_write(). buffer_cache_commit()
+ * then adds the first count bytes of that space to the output; committing
+ * less than was reserved is fine. Any other write or drain by the same
+ * thread in between cancels the reservation. Records can't be larger than
+ * a buffer: reserving (or writing) more than that fails with EMSGSIZE.
+ */
+void *buffer_cache_reserve(struct buffer_cache_ctx *ctx, size_t count);
+int buffer_cache_commit(struct buffer_cache_ctx *ctx, size_t count);
 int buffer_cache_drain(struct buffer_cache_ctx *ctx);
-void buffer_cache_destroy(struct buffer_cache_ctx *ctx);
+int buffer_cache_set_key(struct buffer_cache_ctx *ctx, uint64_t key);
+
+/*
+ * buffer_cache_seq() returns the calling thread's sequence number: the
+ * number of bytes it has written so far, up to the end of its last record.
+ * In multi-producer mode, each thread counts its own.
+ * buffer_cache_wait_durable() blocks until the calling thread's data up
+ * to seq is durable, draining its current buffer first if that holds
+ * part of it. Threads waiting at the same time share syncs. Returns 1,
+ * with errno EIO, if writing or syncing failed. After a failed write,
+ * whatever is left to write out is dropped (and counted by
+ * buffer_cache_drops()), as the file is missing data by then.
+ */
+uint64_t buffer_cache_seq(struct buffer_cache_ctx *ctx);
+int buffer_cache_wait_durable(struct buffer_cache_ctx *ctx, uint64_t seq);
+
+/*
+ * Total number of bytes and records (writes, writevs and commits) lost to
+ * backpressure so far. Can be called at any time, from any thread.
+ */
+void buffer_cache_drops(struct buffer_cache_ctx *ctx, uint64_t *bytes,
+    uint64_t *records);
+
+/*
+ * Number of times a write found no empty buffer (with none left to
+ * allocate) and had to wait for one, and the total time spent waiting,
+ * in nanoseconds.
+ */
+void buffer_cache_waits(struct buffer_cache_ctx *ctx, uint64_t *waits,
+    uint64_t *wait_ns);
+
+/*
+ * buffer_cache_stats() fills in a snapshot of what ctx has been doing so
+ * far; it can be called at any time, from any thread. The counters are
+ * kept all along, at next to no cost to the producers.
+ *
+ * bytes_in is the data taken on by the I/O side (or sides, with stripes)
+ * and bytes_out what it has written to the file(s), headers included, so
+ * bytes_in / bytes_out is the compression ratio. bufs_drained counts the
+ * buffers drained, drain_cnt is the number of those currently waiting to
+ * be taken on, empty_cnt the number of empty ones and buf_cnt the number
+ * allocated. waits, wait_ns, drop_bytes and drop_recs are as returned by
+ * buffer_cache_waits() and buffer_cache_drops().
+ *
+ * compress_hist and write_hist count the buffers by the time it took to
+ * compress and to write them out: bucket 0 is for less than a
+ * microsecond, bucket i for less than 2^i, and the last bucket for
+ * anything longer. With io_uring, the write time is the time it took to
+ * queue the write. zstd works on its own threads (with comp_workers > 0),
+ * so its compress time is only that spent waiting for it.
+ */
+#define BC_STATS_HIST	32
+
+struct buffer_cache_stats {
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+	uint64_t	bufs_drained;
+	size_t		drain_cnt;
+	size_t		empty_cnt;
+	size_t		buf_cnt;
+	uint64_t	waits;
+	uint64_t	wait_ns;
+	uint64_t	drop_bytes;
+	uint64_t	drop_recs;
+	uint64_t	compress_hist[BC_STATS_HIST];
+	uint64_t	write_hist[BC_STATS_HIST];
+};
+
+void buffer_cache_stats(struct buffer_cache_ctx *ctx,
+    struct buffer_cache_stats *st);
+
+/*
+ * buffer_cache_destroy() writes out what is left, finishes the file and
+ * frees ctx. Returns 1, with errno EIO, if any of the data couldn't be
+ * written out or synced, or the file couldn't be finished.
+ */
+int buffer_cache_destroy(struct buffer_cache_ctx *ctx);
+
+/*
+ * The reader opens a file written by buffer_cache, detecting whether it
+ * is uncompressed, an LZ4 frame, gzip or zstd (with _WITH_ZSTD), or the
+ * manifest of striped output, and returns the data as it was written.
+ * LZ4 blocks are decompressed ahead of the consumer on threads
+ * decompression threads (0: in the calling thread). Blocks of a linked
+ * LZ4 frame depend on each other and are decompressed one at a time.
+ */
+struct buffer_cache_reader *buffer_cache_reader_open(const char *file,
+    size_t threads);
+ssize_t buffer_cache_reader_read(struct buffer_cache_reader *rd, void *data,
+    size_t count);
+int buffer_cache_reader_next(struct buffer_cache_reader *rd,
+    const void **data, size_t *len);
+
+/*
+ * buffer_cache_reader_record() returns the next record of a file written
+ * with BC_OPT_FRAMED, valid until the next call on the reader; it returns
+ * 1 if there was one, 0 at the end of the file and -1 if the file is
+ * corrupt. Don't mix it with the calls above.
+ *
+ * buffer_cache_reader_recover() opens a damaged file, say one that was
+ * being written during a crash, to get out as much as can be. Where
+ * decompressing fails, it picks up again at the next LZ4 frame, full
+ * flush point of gzip or zstd frame; with BC_OPT_INDEX there is one at
+ * the start of every buffer. Records that don't check out are passed
+ * over up to the next one that does, and a file that ends early just
+ * ends there. Linked LZ4 blocks after a damaged one are lost as well, up
+ * to the next frame or, going by the index, buffer. Not all damage is
+ * noticed, though. With gzip, damaged deflate data often inflates without
+ * error; the crc at the end of the gzip member is the only check, which
+ * is no longer made once inflating has picked up again after damage, and
+ * a member cut short isn't counted as lost. Data after a sync flush point
+ * (without BC_OPT_INDEX) may also refer back to data that was lost.
+ * Framed records catch data that comes out wrong, but damaged data tends
+ * to decompress into copies of earlier data, which they can't tell from
+ * the real thing: with gzip and zstd, records may come out twice, or out
+ * of order, the more so without BC_OPT_INDEX. Framed LZ4 blocks have
+ * checksums, so only intact ones are decompressed.
+ * buffer_cache_reader_lost() tells how many bytes were passed over (of
+ * the file where it couldn't be decompressed, of the data where records
+ * didn't check out), and how many damaged records.
+ */
+int buffer_cache_reader_record(struct buffer_cache_reader *rd,
+    const void **data, size_t *len);
+struct buffer_cache_reader *buffer_cache_reader_recover(const char *file,
+    size_t threads);
+void buffer_cache_reader_lost(struct buffer_cache_reader *rd, uint64_t *bytes,
+    uint64_t *records);
+
+/*
+ * Seeking needs the index written with BC_OPT_INDEX, except for
+ * uncompressed files. buffer_cache_reader_seek() positions the reader at
+ * the given uncompressed offset, decompressing only from the start of the
+ * buffer containing it. buffer_cache_reader_seek_key() positions it at
+ * the start of the last buffer starting with a key below key (or the
+ * first one), so that all data from key on follows, provided keys never
+ * decrease; with several producers, allow for the skew between them.
+ * Striped output can only be seeked in by offset, and when compressed,
+ * only if it was written with BC_OPT_INDEX, as each stripe is seeked in
+ * on its own. Both return 0 on success and -1 on failure.
+ */
+int buffer_cache_reader_seek(struct buffer_cache_reader *rd, uint64_t off);
+int buffer_cache_reader_seek_key(struct buffer_cache_reader *rd, uint64_t key);
+void buffer_cache_reader_close(struct buffer_cache_reader *rd);
@@ -0,0 +1,2202 @@
+/*
+ * Copyright (c) 2013 Alex Hornung <alex@alexhornung.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Reader for the files written by buffer_cache: uncompressed, LZ4 frame
+ * or gzip. The input is memory-mapped; LZ4 blocks are decompressed by a
+ * pool of threads into a ring of slots ahead of the consumer, which then
+ * takes them in stream order.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <errno.h>
+
+#ifndef _WITHOUT_LZ4
+#include "lz4/lz4.h"
+#include "lz4/xxhash.h"
+#endif
+
+#ifdef _WITH_ZLIB
+#include "zlib.h"
+#endif
+
+#ifdef _WITH_ZSTD
+#include "zstd.h"
+#endif
+#include "crc32c.h"
+#include "buffer_cache.h"
+
+#define LZ4_EXTRA_SZ	(64*1024)
+#define LZ4_BLOCK_SZ	(4*1024*1024)
+#define ZLIB_BLOCK_SZ	LZ4_BLOCK_SZ
+#define ZLIB_FEED_SZ	(1024*1024*1024)
+
+/* See buffer_cache.c for the index format */
+#define BC_INDEX_MAGIC		0x58494342	/* "BCIX" */
+#define BC_INDEX_KEYS		0x1
+#define BC_INDEX_FTR_SZ		24
+#define BC_INDEX_LZ4_MAGIC	0x184D2A5B
+#define BC_INDEX_GZ_TAIL	10
+#define BC_INDEX_ENT_SZ		24
+
+/* See buffer_cache.c for the manifest of striped output */
+#define BC_STRIPE_MAGIC		0x4D534342	/* "BCSM" */
+#define BC_STRIPE_HDR_SZ	16
+#define BC_STRIPE_ENT_SZ	16
+
+#define LZ4_MAGIC		0x184D2204
+#define LZ4_SKIP_MAGIC		0x184D2A50
+#define LZ4_SKIP_MAGIC_MASK	0xFFFFFFF0
+#define ZSTD_MAGIC		0xFD2FB528
+
+/*
+ * Framed records, see BC_OPT_FRAMED. When salvaging, a record is only
+ * taken to be longer than any before it up to FRAME_RESYNC_MIN.
+ */
+#define FRAME_HDR_MAX		5
+#define FRAME_MAX		0xFFFFFFFFULL
+#define FRAME_CRC_SZ		4
+#define FRAME_RESYNC_MIN	(64*1024)
+
+#define SLOT_FREE	0
+#define SLOT_BUSY	1
+#define SLOT_READY	2
+
+#define SLOT_DATA	0
+#define SLOT_FRAME_END	1
+#define SLOT_EOF	2
+#define SLOT_ERROR	3
+
+#ifndef _WITHOUT_LZ4
+struct bcr_slot {
+	int		state;
+	int		kind;
+	uint64_t	seq;
+
+	/* Compressed block, pointing into the mapping */
+	const unsigned char *src;
+	size_t		src_len;
+	int		raw;
+	int		linked;
+	int		frame_first;
+	int		block_checksum;
+	int		stream_checksum;
+	unsigned int	cksum;
+	uint64_t	prev_linked;
+	int		decoded;	/* when salvaging, by the parser */
+
+	/* Decompressed block; mem has LZ4_EXTRA_SZ of history in front */
+	unsigned char	*mem;
+	unsigned char	*data;
+	const unsigned char *out;
+	size_t		out_len;
+};
+
+struct bcr_lz4 {
+	/* Frame parser state, protected by mtx */
+	int		in_frame;
+	int		frame_first;
+	int		linked;
+	int		block_checksum;
+	int		stream_checksum;
+	size_t		block_max;
+	int		parse_done;
+	uint64_t	parse_seq;
+	uint64_t	last_linked;
+
+	/* Consumer */
+	uint64_t	read_seq;
+	struct bcr_slot	*cur;
+	void		*xxh32_state;
+	int		skip_checksum;	/* started mid-frame */
+
+	/* History of linked frames, owned by the last linked block */
+	uint64_t	hist_done;
+	size_t		hist_len;
+	int		hist_lost;	/* salvaging, a block of the frame was */
+	unsigned char	hist[LZ4_EXTRA_SZ];
+
+	size_t		nslots;
+	struct bcr_slot	*slots;
+	size_t		nthreads;
+	size_t		thr_created;
+	pthread_t	*threads;
+	int		exit;
+
+	pthread_mutex_t	mtx;
+	pthread_cond_t	work_cv;
+	pthread_cond_t	ready_cv;
+	pthread_cond_t	hist_cv;
+};
+#endif
+
+#ifdef _WITH_ZLIB
+struct bcr_zlib {
+	int		init;
+	int		raw;		/* started mid-member */
+	z_stream	strm;
+	unsigned char	obuf[ZLIB_BLOCK_SZ];
+};
+#endif
+
+#ifdef _WITH_ZSTD
+struct bcr_zstd {
+	ZSTD_DCtx	*dctx;
+	unsigned char	obuf[ZLIB_BLOCK_SZ];
+};
+#endif
+
+struct bcr_index_ent {
+	uint64_t	uoff;
+	uint64_t	coff;
+	uint64_t	key;
+};
+
+struct bcr_stripe_ent {
+	uint64_t	uoff;		/* in the striped data */
+	uint64_t	soff;		/* in the stripe's own data */
+	uint64_t	len;
+	size_t		stripe;
+};
+
+struct buffer_cache_reader {
+	char		*file;
+	int		fd;
+	int		format;
+	int		error;
+	int		eof;
+
+	/* Index, loaded on the first seek (or opening to recover LZ4) */
+	int		index_loaded;
+	int		index_keys;
+	size_t		index_cnt;
+	struct bcr_index_ent *index;
+
+	/*
+	 * Striped output: the data of each manifest entry in turn comes
+	 * from a reader of its stripe.
+	 */
+	size_t		stripe_cnt;
+	struct buffer_cache_reader **stripes;
+	size_t		stripe_ent_cnt;
+	struct bcr_stripe_ent *stripe_ents;
+	size_t		stripe_ent;	/* next entry */
+	struct buffer_cache_reader *stripe_rd;
+	uint64_t	stripe_left;
+
+	/*
+	 * Framed records: data taken from the chunks for records that
+	 * don't lie in a single one, from rec_off to rec_len.
+	 */
+	unsigned char	*rec;
+	size_t		rec_size;
+	size_t		rec_off;
+	size_t		rec_len;
+	size_t		rec_max;
+
+	/* Recovering (buffer_cache_reader_recover()) */
+	int		salvage;
+	uint64_t	lost_bytes;
+	uint64_t	lost_recs;
+
+	const unsigned char *map;
+	size_t		map_sz;
+	size_t		pos;
+
+	/* Current chunk of decompressed data handed out by _next */
+	const unsigned char *chunk;
+	size_t		chunk_len;
+
+	union {
+#ifndef _WITHOUT_LZ4
+		struct bcr_lz4	*lz4;
+#endif
+#ifdef _WITH_ZLIB
+		struct bcr_zlib	*zlib;
+#endif
+#ifdef _WITH_ZSTD
+		struct bcr_zstd	*zstd;
+#endif
+		void		*priv;
+	};
+};
+
+
+static
+unsigned int
+_le32(const unsigned char *p)
+{
+	return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+	    ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static
+uint64_t
+_le64(const unsigned char *p)
+{
+	return (uint64_t)_le32(p) | ((uint64_t)_le32(p+4) << 32);
+}
+
+/*
+ * Count bytes passed over while salvaging; LZ4 threads do so as well.
+ */
+static
+void
+_bcr_lost(struct buffer_cache_reader *rd, uint64_t bytes)
+{
+	__atomic_fetch_add(&rd->lost_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+#ifndef _WITHOUT_LZ4
+/*
+ * Parses the next block (or frame end) of the stream into slot. Skippable
+ * frames are passed over. Must be called with the mutex held.
+ */
+/*
+ * Parses the LZ4 frame header at rd->pos. Returns 0 on success.
+ */
+static
+int
+_bcr_lz4_frame(struct buffer_cache_reader *rd)
+{
+	struct bcr_lz4 *lz4 = rd->lz4;
+	const unsigned char *p = rd->map + rd->pos;
+	size_t left = rd->map_sz - rd->pos;
+	size_t hdr_sz;
+	int flg, bd;
+
+	if (left < 7 || _le32(p) != LZ4_MAGIC)
+		return 1;
+
+	flg = p[4];
+	bd = p[5];
+	if ((flg >> 6) != 0x1 || ((bd >> 4) & 0x7) < 4)
+		return 1;
+
+	/* FLG, BD, optional content size and dictionary id, HC */
+	hdr_sz = 6 + ((flg & 0x08) ? 8 : 0) + ((flg & 0x01) ? 4 : 0) + 1;
+	if (left < hdr_sz)
+		return 1;
+	if (p[hdr_sz-1] != ((XXH32(&p[4], (int)hdr_sz-5, 0) >> 8) & 0xFF))
+		return 1;
+
+	lz4->linked = !(flg & 0x20);
+	lz4->block_checksum = !!(flg & 0x10);
+	lz4->stream_checksum = !!(flg & 0x04);
+	lz4->block_max = (size_t)1 << (8 + 2*((bd >> 4) & 0x7));
+	lz4->in_frame = 1;
+	lz4->frame_first = 1;
+
+	rd->pos += hdr_sz;
+	return 0;
+}
+
+/*
+ * Salvaging linked blocks: tells whether the index (if there is one) has
+ * a buffer start at pos, where blocks don't need the ones before them.
+ */
+static
+int
+_bcr_lz4_indexed(struct buffer_cache_reader *rd, size_t pos)
+{
+	size_t lo = 0, hi = rd->index_cnt, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rd->index[mid].coff == pos)
+			return 1;
+		if (rd->index[mid].coff < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return 0;
+}
+
+/*
+ * Salvaging: tells whether a block of the last frame seems to start at
+ * pos: it has to fit, decompress (into mem) and be followed by the end of
+ * the file, an end mark, a frame or depth - 1 more such blocks. Small
+ * blocks of garbage decompress all too often.
+ */
+static
+int
+_bcr_lz4_block_at(struct buffer_cache_reader *rd, size_t pos,
+    unsigned char *mem, int depth)
+{
+	struct bcr_lz4 *lz4 = rd->lz4;
+	size_t bsz, next, cksum_sz = lz4->block_checksum ? 4 : 0;
+	unsigned int v;
+
+	if (rd->map_sz - pos < 4)
+		return 0;
+
+	v = _le32(rd->map + pos);
+	bsz = v & 0x7FFFFFFF;
+	if (bsz == 0 || bsz > lz4->block_max ||
+	    rd->map_sz - pos - 4 < bsz + cksum_sz)
+		return 0;
+
+	if ((v & 0x80000000) == 0 &&
+	    LZ4_decompress_safe((const char *)rd->map + pos + 4, (char *)mem,
+	    (int)bsz, LZ4_BLOCK_SZ) < 0)
+		return 0;
+
+	next = pos + 4 + bsz + cksum_sz;
+	if (next == rd->map_sz)
+		return 1;
+	if (rd->map_sz - next < 4)
+		return 0;
+
+	v = _le32(rd->map + next);
+	if (v == 0 || v == LZ4_MAGIC ||
+	    (v & LZ4_SKIP_MAGIC_MASK) == LZ4_SKIP_MAGIC)
+		return 1;
+
+	if (depth <= 1)
+		return (v & 0x7FFFFFFF) <= lz4->block_max;
+
+	return _bcr_lz4_block_at(rd, next, mem, depth - 1);
+}
+
+/*
+ * Salvaging: passes over the damage at rd->pos to the next frame (or
+ * skippable frame) after it, or the next block that seems to belong to
+ * the frame. Returns 1 if there is none, leaving rd->pos at the end.
+ */
+static
+int
+_bcr_lz4_resync(struct buffer_cache_reader *rd, unsigned char *mem)
+{
+	struct bcr_lz4 *lz4 = rd->lz4;
+	size_t start = rd->pos;
+	size_t pos;
+	unsigned int magic;
+
+	fprintf(stderr, "%s: corrupt LZ4 stream at offset %zu, looking for "
+	    "the next frame\n", rd->file, start);
+
+	lz4->in_frame = 0;
+
+	for (pos = start + 1; pos + 8 <= rd->map_sz; pos++) {
+		magic = _le32(rd->map + pos);
+
+		if ((magic & LZ4_SKIP_MAGIC_MASK) == LZ4_SKIP_MAGIC &&
+		    rd->map_sz - pos - 8 >= _le32(rd->map + pos + 4)) {
+			rd->pos = pos;
+			break;
+		}
+
+		rd->pos = pos;
+		if (magic == LZ4_MAGIC && _bcr_lz4_frame(rd) == 0)
+			break;
+
+		/*
+		 * Blocks go on without history (see _bcr_lz4_decode()),
+		 * linked ones only where the index has a buffer start.
+		 */
+		if (lz4->block_max > 0 && (lz4->linked ?
+		    _bcr_lz4_indexed(rd, pos) :
+		    _bcr_lz4_block_at(rd, pos, mem, 3))) {
+			lz4->in_frame = 1;
+			lz4->frame_first = 1;
+			break;
+		}
+	}
+
+	if (pos + 8 > rd->map_sz) {
+		_bcr_lost(rd, rd->map_sz - start);
+		rd->pos = rd->map_sz;
+		return 1;
+	}
+
+	_bcr_lost(rd, pos - start);
+
+	return 0;
+}
+
+static
+void
+_bcr_lz4_parse(struct buffer_cache_reader *rd, struct bcr_slot *slot)
+{
+	struct bcr_lz4 *lz4 = rd->lz4;
+	const unsigned char *p;
+	size_t left;
+	unsigned int magic, bsz;
+	int r;
+
+again:
+	p = rd->map + rd->pos;
+	left = rd->map_sz - rd->pos;
+
+	if (!lz4->in_frame) {
+		if (left == 0) {
+			slot->kind = SLOT_EOF;
+			return;
+		}
+
+		if (left < 4)
+			goto corrupt;
+
+		magic = _le32(p);
+		if ((magic & LZ4_SKIP_MAGIC_MASK) == LZ4_SKIP_MAGIC) {
+			if (left < 8 || left - 8 < _le32(p+4))
+				goto corrupt;
+			rd->pos += 8 + (size_t)_le32(p+4);
+			goto again;
+		}
+
+		if (_bcr_lz4_frame(rd) != 0)
+			goto corrupt;
+
+		goto again;
+	}
+
+	if (left < 4)
+		goto corrupt;
+
+	bsz = _le32(p);
+	p += 4;
+	left -= 4;
+
+	slot->stream_checksum = lz4->stream_checksum;
+
+	if (bsz == 0) {
+		/* End mark, optionally followed by the stream checksum */
+		if (lz4->stream_checksum) {
+			if (left < 4)
+				goto corrupt;
+			slot->cksum = _le32(p);
+			rd->pos += 4;
+		}
+		rd->pos += 4;
+		lz4->in_frame = 0;
+		slot->kind = SLOT_FRAME_END;
+		return;
+	}
+
+	slot->raw = !!(bsz & 0x80000000);
+	bsz &= 0x7FFFFFFF;
+
+	if (bsz > lz4->block_max || left < bsz + (lz4->block_checksum ? 4 : 0))
+		goto corrupt;
+
+	/*
+	 * Salvaging, independent blocks are checked right away: if one
+	 * doesn't decompress, its size may well be wrong too.
+	 */
+	slot->decoded = 0;
+	if (rd->salvage && !lz4->linked && !slot->raw) {
+		if ((lz4->block_checksum &&
+		    XXH32(p, (int)bsz, 0) != _le32(p + bsz)) ||
+		    (r = LZ4_decompress_safe((const char *)p,
+		    (char *)slot->data, (int)bsz, LZ4_BLOCK_SZ)) < 0)
+			goto corrupt;
+
+		slot->out = slot->data;
+		slot->out_len = (size_t)r;
+		slot->decoded = 1;
+	}
+
+	slot->kind = SLOT_DATA;
+	slot->src = p;
+	slot->src_len = bsz;
+	slot->block_checksum = lz4->block_checksum;
+	if (lz4->block_checksum)
+		slot->cksum = _le32(p + bsz);
+	slot->linked = lz4->linked;
+
+	/* Salvaging, linked blocks start afresh with each indexed buffer */
+	if (rd->salvage && lz4->linked && _bcr_lz4_indexed(rd, rd->pos))
+		lz4->frame_first = 1;
+	slot->frame_first = lz4->frame_first;
+	lz4->frame_first = 0;
+
+	/* Linked blocks take their history from the previous linked block */
+	if (slot->linked) {
+		slot->prev_linked = lz4->last_linked;
+		lz4->last_linked = lz4->parse_seq + 1;
+	}
+
+	rd->pos += 4 + bsz + (lz4->block_checksum ? 4 : 0);
+	return;
+
+corrupt:
+	/* The damaged frame ends here, as far as the checksum goes */
+	if (rd->salvage) {
+		r = _bcr_lz4_resync(rd, slot->data);
+		slot->kind = (r == 0) ? SLOT_FRAME_END : SLOT_EOF;
+		slot->stream_checksum = 0;
+		return;
+	}
+
+	fprintf(stderr, "%s: corrupt LZ4 stream at offset %zu\n", rd->file,
+	    rd->pos);
+	slot->kind = SLOT_ERROR;
+}
+
+/*
+ * Decompresses a data slot. Linked blocks first wait for the previous
+ * linked block to publish its history, which then goes right in front of
+ * the output. Called with the mutex held, which is dropped while working.
+ */
+static
+void
+_bcr_lz4_decode(struct buffer_cache_reader *rd, struct bcr_slot *slot)
+{
+	struct bcr_lz4 *lz4 = rd->lz4;
+	size_t n;
+	int r, lost = 0;
+
+	if (slot->linked) {
+		while (lz4->hist_done != slot->prev_linked)
+			pthread_cond_wait(&lz4->hist_cv, &lz4->mtx);
+		if (slot->frame_first) {
+			lz4->hist_len = 0;
+			lz4->hist_lost = 0;
+		}
+
+		/*
+		 * Without the block before it, a block may well decompress
+		 * into copies of earlier data, which framed records can't
+		 * tell from the real thing; it's lost as well.
+		 */
+		lost = lz4->hist_lost;
+	}
+
+	pthread_mutex_unlock(&lz4->mtx);
+
+	if (lost) {
+		slot->kind = SLOT_ERROR;
+	} else if (slot->block_checksum &&
+	    XXH32(slot->src, (int)slot->src_len, 0) != slot->cksum) {
+		slot->kind = SLOT_ERROR;
+	} else if (slot->raw && !slot->linked) {
+		slot->out = slot->src;
+		slot->out_len = slot->src_len;
+	} else {
+		if (slot->linked)
+			memcpy(slot->data - lz4->hist_len,
+			    lz4->hist + LZ4_EXTRA_SZ - lz4->hist_len,
+			    lz4->hist_len);
+
+		if (slot->raw) {
+			memcpy(slot->data, slot->src, slot->src_len);
+			r = (int)slot->src_len;
+		} else if (slot->linked) {
+			r = LZ4_decompress_safe_withPrefix64k(
+			    (const char *)slot->src, (char *)slot->data,
+			    (int)slot->src_len, LZ4_BLOCK_SZ);
+		} else {
+			r = LZ4_decompress_safe((const char *)slot->src,
+			    (char *)slot->data, (int)slot->src_len,
+			    LZ4_BLOCK_SZ);
+		}
+
+		if (r < 0) {
+			slot->kind = SLOT_ERROR;
+		} else {
+			slot->out = slot->data;
+			slot->out_len = (size_t)r;
+		}
+	}
+
+	if (slot->kind == SLOT_ERROR && !lost)
+		fprintf(stderr, "%s: corrupt LZ4 block at offset %zu\n",
+		    rd->file, (size_t)(slot->src - rd->map) - 4);
+
+	/* Keep the last 64 KB of output (and history) at the end of hist */
+	if (slot->linked) {
+		if (slot->kind == SLOT_ERROR)
+			lz4->hist_lost = 1;
+		n = lz4->hist_len + slot->out_len;
+		if (n > LZ4_EXTRA_SZ)
+			n = LZ4_EXTRA_SZ;
+		if (slot->kind == SLOT_DATA)
+			memcpy(lz4->hist + LZ4_EXTRA_SZ - n,
+			    slot->data + slot->out_len - n, n);
+		lz4->hist_len = n;
+	}
+
+	pthread_mutex_lock(&lz4->mtx);
+
+	if (slot->linked) {
+		lz4->hist_done = slot->seq + 1;
+		pthread_cond_broadcast(&lz4->hist_cv);
+	}
+}
+
+/*
+ * Parses and decompresses the next block of the stream, if its slot is
+ * free. Returns 0 if there was nothing to do. Must be called with the
+ * mutex held.
+ */
+static
+int
+_bcr_lz4_work(struct buffer_cache_reader *rd)
+{
+	struct bcr_lz4 *lz4 = rd->lz4;
+	struct bcr_slot *slot;
+
+	slot = &lz4->slots[lz4->parse_seq % lz4->nslots];
+	if (lz4->parse_done || slot->state != SLOT_FREE)
+		return 0;
+
+	_bcr_lz4_parse(rd, slot);
+	slot->seq = lz4->parse_seq++;
+	slot->state = SLOT_BUSY;
+
+	if (slot->kind == SLOT_EOF || slot->kind == SLOT_ERROR)
+		lz4->parse_done = 1;
+	else if (slot->kind == SLOT_DATA && !slot->decoded)
+		_bcr_lz4_decode(rd, slot);
+
+	slot->state = SLOT_READY;
+	pthread_cond_broadcast(&lz4->ready_cv);
+
+	return 1;
+}
+
+static
+void *
+_bcr_lz4_thr(void *priv)
+{
+	struct buffer_cache_reader *rd = priv;
+	struct bcr_lz4 *lz4 = rd->lz4;
+
+	pthread_mutex_lock(&lz4->mtx);
+
+	while (!lz4->exit) {
+		if (!_bcr_lz4_work(rd))
+			pthread_cond_wait(&lz4->work_cv, &lz4->mtx);
+	}
+
+	pthread_mutex_unlock(&lz4->mtx);
+
+	return NULL;
+}
+
+/*
+ * Hands out the next decompressed block, releasing the previous one.
+ * Returns 1 if a block was returned, 0 at the end of the stream and -1
+ * on error.
+ */
+static
+int
+_bcr_lz4_next(struct buffer_cache_reader *rd)
+{
+	struct bcr_lz4 *lz4 = rd->lz4;
+	struct bcr_slot *slot;
+
+	pthread_mutex_lock(&lz4->mtx);
+
+	if (lz4->cur != NULL) {
+		lz4->cur->state = SLOT_FREE;
+		lz4->cur = NULL;
+		++lz4->read_seq;
+		pthread_cond_signal(&lz4->work_cv);
+	}
+
+	for (;;) {
+		slot = &lz4->slots[lz4->read_seq % lz4->nslots];
+
+		while (slot->state != SLOT_READY) {
+			if (lz4->nthreads == 0)
+				_bcr_lz4_work(rd);
+			else
+				pthread_cond_wait(&lz4->ready_cv, &lz4->mtx);
+		}
+
+		/* Salvaging passes over blocks that fail to decompress */
+		if (slot->kind == SLOT_ERROR && rd->salvage) {
+			_bcr_lost(rd, 4 + slot->src_len);
+			if (lz4->xxh32_state != NULL) {
+				free(lz4->xxh32_state);
+				lz4->xxh32_state = NULL;
+			}
+			lz4->skip_checksum = 1;
+			slot->state = SLOT_FREE;
+			++lz4->read_seq;
+			pthread_cond_signal(&lz4->work_cv);
+			continue;
+		}
+
+		if (slot->kind != SLOT_FRAME_END)
+			break;
+
+		if (slot->stream_checksum && !lz4->skip_checksum) {
+			if (lz4->xxh32_state == NULL)
+				lz4->xxh32_state = XXH32_init(0);
+			if (XXH32_digest(lz4->xxh32_state) != slot->cksum) {
+				lz4->xxh32_state = NULL;
+				fprintf(stderr, "%s: LZ4 stream checksum "
+				    "mismatch\n", rd->file);
+				if (!rd->salvage) {
+					pthread_mutex_unlock(&lz4->mtx);
+					return -1;
+				}
+			}
+			lz4->xxh32_state = NULL;
+		} else if (lz4->xxh32_state != NULL) {
+			free(lz4->xxh32_state);
+			lz4->xxh32_state = NULL;
+		}
+
+		lz4->skip_checksum = 0;
+		slot->state = SLOT_FREE;
+		++lz4->read_seq;
+		pthread_cond_signal(&lz4->work_cv);
+	}
+
+	pthread_mutex_unlock(&lz4->mtx);
+
+	if (slot->kind == SLOT_EOF)
+		return 0;
+
+	if (slot->kind == SLOT_ERROR)
+		return -1;
+
+	if (slot->stream_checksum && !lz4->skip_checksum) {
+		if (lz4->xxh32_state == NULL)
+			lz4->xxh32_state = XXH32_init(0);
+		XXH32_update(lz4->xxh32_state, slot->out, (int)slot->out_len);
+	}
+
+	lz4->cur = slot;
+	rd->chunk = slot->out;
+	rd->chunk_len = slot->out_len;
+
+	return 1;
+}
+
+/*
+ * Restarts decompression at compressed offset coff, which must be the
+ * start of a block that doesn't depend on earlier ones. The blocks that
+ * are in the pipeline are waited for and thrown away.
+ */
+static
+int
+_bcr_lz4_restart(struct buffer_cache_reader *rd, uint64_t coff)
+{
+	struct bcr_lz4 *lz4 = rd->lz4;
+	size_t i;
+	int busy, r;
+
+	pthread_mutex_lock(&lz4->mtx);
+
+	lz4->parse_done = 1;
+	do {
+		for (i = 0, busy = 0; i < lz4->nslots; i++)
+			busy |= (lz4->slots[i].state == SLOT_BUSY);
+		if (busy)
+			pthread_cond_wait(&lz4->ready_cv, &lz4->mtx);
+	} while (busy);
+
+	for (i = 0; i < lz4->nslots; i++)
+		lz4->slots[i].state = SLOT_FREE;
+
+	lz4->cur = NULL;
+	lz4->read_seq = lz4->parse_seq;
+	lz4->last_linked = 0;
+	lz4->hist_done = 0;
+
+	if (lz4->xxh32_state != NULL) {
+		free(lz4->xxh32_state);
+		lz4->xxh32_state = NULL;
+	}
+
+	/* The frame's parameters come from its header at the start */
+	rd->pos = 0;
+	lz4->in_frame = 0;
+	if ((r = _bcr_lz4_frame(rd)) == 0 && coff >= rd->pos &&
+	    coff <= rd->map_sz) {
+		rd->pos = (size_t)coff;
+		lz4->skip_checksum = lz4->stream_checksum;
+		lz4->parse_done = 0;
+		pthread_cond_broadcast(&lz4->work_cv);
+	} else {
+		r = 1;
+	}
+
+	pthread_mutex_unlock(&lz4->mtx);
+
+	return r;
+}
+
+static
+void
+_bcr_lz4_free(struct bcr_lz4 *lz4)
+{
+	size_t i;
+
+	pthread_mutex_lock(&lz4->mtx);
+	lz4->exit = 1;
+	pthread_cond_broadcast(&lz4->work_cv);
+	pthread_mutex_unlock(&lz4->mtx);
+
+	for (i = 0; i < lz4->thr_created; i++)
+		pthread_join(lz4->threads[i], NULL);
+
+	for (i = 0; i < lz4->nslots; i++)
+		free(lz4->slots[i].mem);
+
+	if (lz4->xxh32_state != NULL)
+		free(lz4->xxh32_state);
+
+	pthread_mutex_destroy(&lz4->mtx);
+	pthread_cond_destroy(&lz4->work_cv);
+	pthread_cond_destroy(&lz4->ready_cv);
+	pthread_cond_destroy(&lz4->hist_cv);
+
+	free(lz4->threads);
+	free(lz4->slots);
+	free(lz4);
+}
+
+/*
+ * Without threads, the consumer decompresses each block itself when it
+ * gets to it. Otherwise two slots per thread keep the decompression
+ * threads busy while the consumer works through earlier blocks.
+ */
+static
+struct bcr_lz4 *
+_bcr_lz4_init(struct buffer_cache_reader *rd, size_t threads)
+{
+	struct bcr_lz4 *lz4;
+	size_t i;
+
+	if ((lz4 = malloc(sizeof(*lz4))) == NULL)
+		return NULL;
+
+	memset(lz4, 0, sizeof(*lz4));
+
+	pthread_mutex_init(&lz4->mtx, NULL);
+	pthread_cond_init(&lz4->work_cv, NULL);
+	pthread_cond_init(&lz4->ready_cv, NULL);
+	pthread_cond_init(&lz4->hist_cv, NULL);
+
+	lz4->nthreads = threads;
+	lz4->nslots = (threads > 0) ? 2*threads : 1;
+
+	if ((lz4->slots = calloc(lz4->nslots, sizeof(*lz4->slots))) == NULL)
+		goto fail;
+
+	for (i = 0; i < lz4->nslots; i++) {
+		if ((lz4->slots[i].mem = malloc(LZ4_EXTRA_SZ + LZ4_BLOCK_SZ)) == NULL)
+			goto fail;
+		lz4->slots[i].data = lz4->slots[i].mem + LZ4_EXTRA_SZ;
+	}
+
+	if (threads > 0 &&
+	    (lz4->threads = calloc(threads, sizeof(*lz4->threads))) == NULL)
+		goto fail;
+
+	rd->lz4 = lz4;
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&lz4->threads[i], NULL, _bcr_lz4_thr, rd) != 0)
+			goto fail;
+		++lz4->thr_created;
+	}
+
+	return lz4;
+
+fail:
+	rd->lz4 = NULL;
+	_bcr_lz4_free(lz4);
+	return NULL;
+}
+#endif
+
+
+#ifdef _WITH_ZLIB
+/*
+ * Points the inflate stream at the next piece of the mapping; avail_in
+ * is only 32 bits wide. rd->pos is the end of the input given to zlib.
+ */
+static
+void
+_bcr_zlib_feed(struct buffer_cache_reader *rd)
+{
+	z_stream *strm = &rd->zlib->strm;
+	size_t off, n;
+
+	off = rd->pos - strm->avail_in;
+	n = rd->map_sz - off;
+	if (n > ZLIB_FEED_SZ)
+		n = ZLIB_FEED_SZ;
+
+	strm->next_in = (unsigned char *)rd->map + off;
+	strm->avail_in = (unsigned int)n;
+	rd->pos = off + n;
+}
+
+/*
+ * Salvaging: passes over the damage to the next full flush point (or sync
+ * flush point, which may well lead to more damage) and inflates on from
+ * there. Returns 1 if there is none.
+ */
+static
+int
+_bcr_zlib_resync(struct buffer_cache_reader *rd)
+{
+	z_stream *strm = &rd->zlib->strm;
+	size_t start = rd->pos - strm->avail_in;
+	int r;
+
+	fprintf(stderr, "%s: corrupt gzip stream at offset %zu, looking for "
+	    "the next flush point\n", rd->file, start);
+
+	for (;;) {
+		if (strm->avail_in == 0)
+			_bcr_zlib_feed(rd);
+		if (strm->avail_in == 0) {
+			_bcr_lost(rd, rd->map_sz - start);
+			return 1;
+		}
+
+		if ((r = inflateSync(strm)) == Z_OK)
+			break;
+		if (r != Z_DATA_ERROR && r != Z_BUF_ERROR) {
+			_bcr_lost(rd, rd->map_sz - start);
+			return 1;
+		}
+	}
+
+	_bcr_lost(rd, rd->pos - strm->avail_in - start);
+
+	return 0;
+}
+
+/*
+ * Inflates the next chunk of a gzip file. Further gzip members following
+ * the first one are read as a continuation of the same stream.
+ */
+static
+int
+_bcr_zlib_next(struct buffer_cache_reader *rd)
+{
+	struct bcr_zlib *zlib = rd->zlib;
+	z_stream *strm = &zlib->strm;
+	int r;
+
+	strm->next_out = zlib->obuf;
+	strm->avail_out = sizeof(zlib->obuf);
+
+	while (strm->avail_out > 0 && !rd->eof) {
+		if (strm->avail_in < 2)
+			_bcr_zlib_feed(rd);
+
+		r = inflate(strm, Z_NO_FLUSH);
+		if (r == Z_STREAM_END) {
+			/* After a restart, skip the member's crc and isize */
+			if (zlib->raw) {
+				rd->pos = rd->pos - strm->avail_in + 8;
+				strm->avail_in = 0;
+				if (rd->pos > rd->map_sz)
+					rd->pos = rd->map_sz;
+				zlib->raw = 0;
+			}
+
+			if (strm->avail_in < 2)
+				_bcr_zlib_feed(rd);
+			if (strm->avail_in < 2 || strm->next_in[0] != 0x1f ||
+			    strm->next_in[1] != 0x8b)
+				rd->eof = 1;
+			else
+				inflateReset2(strm, 16 + MAX_WBITS);
+		} else if (r != Z_OK) {
+			if (rd->salvage) {
+				if (_bcr_zlib_resync(rd) != 0)
+					rd->eof = 1;
+				continue;
+			}
+
+			fprintf(stderr, "%s: corrupt gzip stream: %s\n",
+			    rd->file, (strm->msg != NULL) ? strm->msg : "truncated");
+			return -1;
+		}
+	}
+
+	rd->chunk = zlib->obuf;
+	rd->chunk_len = sizeof(zlib->obuf) - strm->avail_out;
+
+	return (rd->chunk_len > 0) ? 1 : 0;
+}
+
+/*
+ * Restarts inflating at compressed offset coff, which must be the start
+ * of a deflate block following a full flush, as raw deflate data.
+ */
+static
+int
+_bcr_zlib_restart(struct buffer_cache_reader *rd, uint64_t coff)
+{
+	struct bcr_zlib *zlib = rd->zlib;
+
+	if (coff > rd->map_sz || inflateReset2(&zlib->strm, -MAX_WBITS) != Z_OK)
+		return 1;
+
+	zlib->strm.avail_in = 0;
+	zlib->raw = 1;
+	rd->pos = (size_t)coff;
+	rd->eof = 0;
+
+	return 0;
+}
+
+static
+struct bcr_zlib *
+_bcr_zlib_init(void)
+{
+	struct bcr_zlib *zlib;
+
+	if ((zlib = malloc(sizeof(*zlib))) == NULL)
+		return NULL;
+
+	memset(zlib, 0, sizeof(*zlib));
+
+	if (inflateInit2(&zlib->strm, 16 + MAX_WBITS) != Z_OK) {
+		free(zlib);
+		return NULL;
+	}
+
+	zlib->init = 1;
+	return zlib;
+}
+
+static
+void
+_bcr_zlib_free(struct bcr_zlib *zlib)
+{
+	if (zlib->init)
+		inflateEnd(&zlib->strm);
+	free(zlib);
+}
+#endif
+
+
+#ifdef _WITH_ZSTD
+/*
+ * Salvaging: passes over the damage to the next frame (or skippable
+ * frame) after in->pos. Returns 1 if there is none.
+ */
+static
+int
+_bcr_zstd_resync(struct buffer_cache_reader *rd, ZSTD_inBuffer *in)
+{
+	size_t start = in->pos;
+	size_t pos;
+	unsigned int magic;
+
+	for (pos = start + 1; pos + 8 <= rd->map_sz; pos++) {
+		magic = _le32(rd->map + pos);
+		if (magic == ZSTD_MAGIC ||
+		    (magic & LZ4_SKIP_MAGIC_MASK) == LZ4_SKIP_MAGIC)
+			break;
+	}
+
+	if (pos + 8 > rd->map_sz ||
+	    ZSTD_isError(ZSTD_DCtx_reset(rd->zstd->dctx, ZSTD_reset_session_only))) {
+		_bcr_lost(rd, rd->map_sz - start);
+		in->pos = rd->map_sz;
+		return 1;
+	}
+
+	_bcr_lost(rd, pos - start);
+	in->pos = pos;
+
+	return 0;
+}
+
+/*
+ * Decompresses the next chunk of a zstd file. zstd moves on to following
+ * frames by itself and passes over skippable ones, such as the index.
+ */
+static
+int
+_bcr_zstd_next(struct buffer_cache_reader *rd)
+{
+	struct bcr_zstd *zstd = rd->zstd;
+	ZSTD_inBuffer in = { rd->map, rd->map_sz, rd->pos };
+	ZSTD_outBuffer out = { zstd->obuf, sizeof(zstd->obuf), 0 };
+	size_t r;
+
+	while (out.pos < out.size && !rd->eof) {
+		/*
+		 * Salvaging, hand over the input a block at a time: what
+		 * zstd decompresses in a call that fails is lost.
+		 */
+		if (rd->salvage)
+			in.size = (rd->map_sz - in.pos > ZSTD_BLOCKSIZE_MAX) ?
+			    in.pos + ZSTD_BLOCKSIZE_MAX : rd->map_sz;
+
+		r = ZSTD_decompressStream(zstd->dctx, &out, &in);
+		if (ZSTD_isError(r)) {
+			fprintf(stderr, "%s: corrupt zstd stream: %s\n", rd->file,
+			    ZSTD_getErrorName(r));
+			if (!rd->salvage)
+				return -1;
+			if (_bcr_zstd_resync(rd, &in) != 0)
+				rd->eof = 1;
+			continue;
+		}
+
+		/*
+		 * All input is taken: done if that completed a frame (and
+		 * zstd flushed it); with room left over, zstd has flushed
+		 * all it can, so anything else is a truncated frame.
+		 */
+		if (in.pos == rd->map_sz) {
+			if (r == 0) {
+				rd->eof = 1;
+			} else if (out.pos < out.size) {
+				fprintf(stderr, "%s: corrupt zstd stream: "
+				    "truncated\n", rd->file);
+				if (!rd->salvage)
+					return -1;
+				rd->eof = 1;
+			}
+		}
+	}
+
+	rd->pos = in.pos;
+	rd->chunk = zstd->obuf;
+	rd->chunk_len = out.pos;
+
+	return (rd->chunk_len > 0) ? 1 : 0;
+}
+
+/*
+ * Restarts decompressing at compressed offset coff, which must be the
+ * start of a frame.
+ */
+static
+int
+_bcr_zstd_restart(struct buffer_cache_reader *rd, uint64_t coff)
+{
+	if (coff > rd->map_sz ||
+	    ZSTD_isError(ZSTD_DCtx_reset(rd->zstd->dctx, ZSTD_reset_session_only)))
+		return 1;
+
+	rd->pos = (size_t)coff;
+	rd->eof = 0;
+
+	return 0;
+}
+
+static
+struct bcr_zstd *
+_bcr_zstd_init(void)
+{
+	struct bcr_zstd *zstd;
+
+	if ((zstd = malloc(sizeof(*zstd))) == NULL)
+		return NULL;
+
+	/* Allow for the window of BC_OPT_ZSTD_LONG */
+	if ((zstd->dctx = ZSTD_createDCtx()) == NULL ||
+	    ZSTD_isError(ZSTD_DCtx_setParameter(zstd->dctx,
+	    ZSTD_d_windowLogMax, 27))) {
+		ZSTD_freeDCtx(zstd->dctx);
+		free(zstd);
+		return NULL;
+	}
+
+	return zstd;
+}
+
+static
+void
+_bcr_zstd_free(struct bcr_zstd *zstd)
+{
+	ZSTD_freeDCtx(zstd->dctx);
+	free(zstd);
+}
+#endif
+
+
+/*
+ * Hands out the rest of an uncompressed file in one go.
+ */
+static
+int
+_bcr_raw_next(struct buffer_cache_reader *rd)
+{
+	rd->chunk = rd->map + rd->pos;
+	rd->chunk_len = rd->map_sz - rd->pos;
+	rd->pos = rd->map_sz;
+
+	return (rd->chunk_len > 0) ? 1 : 0;
+}
+
+static int _bcr_next(struct buffer_cache_reader *rd);
+static struct buffer_cache_reader *_bcr_open(const char *file, size_t threads,
+    int salvage);
+
+/*
+ * Hands out the next piece of the current manifest entry, straight from
+ * its stripe's reader. A stripe that ends early is corrupt.
+ */
+static
+int
+_bcr_stripe_next(struct buffer_cache_reader *rd)
+{
+	struct buffer_cache_reader *srd;
+	struct bcr_stripe_ent *ent;
+	size_t len;
+	int r;
+
+again:
+	if (rd->stripe_left == 0) {
+		if (rd->stripe_ent == rd->stripe_ent_cnt)
+			return 0;
+
+		ent = &rd->stripe_ents[rd->stripe_ent++];
+		rd->stripe_rd = rd->stripes[ent->stripe];
+		rd->stripe_left = ent->len;
+	}
+
+	srd = rd->stripe_rd;
+	if (srd->chunk_len == 0 && (r = _bcr_next(srd)) <= 0) {
+		if (r == 0)
+			fprintf(stderr, "%s: stripe %s ends early\n", rd->file,
+			    srd->file);
+
+		/* Salvaging goes on with what the other stripes have */
+		if (!rd->salvage)
+			return -1;
+		_bcr_lost(rd, rd->stripe_left);
+		rd->stripe_left = 0;
+		goto again;
+	}
+
+	len = srd->chunk_len;
+	if (len > rd->stripe_left)
+		len = (size_t)rd->stripe_left;
+
+	rd->chunk = srd->chunk;
+	rd->chunk_len = len;
+	srd->chunk += len;
+	srd->chunk_len -= len;
+	rd->stripe_left -= len;
+
+	return 1;
+}
+
+/*
+ * Seeks to off in the striped data: its entry's stripe goes to the
+ * matching offset, and every other stripe to the start of its next entry.
+ */
+static
+int
+_bcr_stripe_seek(struct buffer_cache_reader *rd, uint64_t off)
+{
+	struct bcr_stripe_ent *ent;
+	size_t lo, hi, mid, i, seen = 0;
+	unsigned char *done;
+	int r = 0;
+
+	rd->chunk = NULL;
+	rd->chunk_len = 0;
+	rd->stripe_left = 0;
+	rd->stripe_ent = rd->stripe_ent_cnt;
+
+	if (rd->stripe_ent_cnt == 0)
+		return (off == 0) ? 0 : -1;
+
+	ent = &rd->stripe_ents[rd->stripe_ent_cnt - 1];
+	if (off > ent->uoff + ent->len)
+		return -1;
+	if (off == ent->uoff + ent->len)
+		return 0;
+
+	/* Last entry starting at or before off */
+	for (lo = 0, hi = rd->stripe_ent_cnt; hi - lo > 1; ) {
+		mid = lo + (hi - lo) / 2;
+		if (rd->stripe_ents[mid].uoff <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if ((done = calloc(rd->stripe_cnt, 1)) == NULL)
+		return -1;
+
+	for (i = lo; i < rd->stripe_ent_cnt && seen < rd->stripe_cnt; i++) {
+		ent = &rd->stripe_ents[i];
+		if (done[ent->stripe])
+			continue;
+
+		done[ent->stripe] = 1;
+		++seen;
+
+		if (buffer_cache_reader_seek(rd->stripes[ent->stripe], ent->soff +
+		    ((i == lo) ? off - ent->uoff : 0)) != 0) {
+			r = -1;
+			break;
+		}
+	}
+
+	free(done);
+
+	if (r == 0) {
+		ent = &rd->stripe_ents[lo];
+		rd->stripe_ent = lo + 1;
+		rd->stripe_rd = rd->stripes[ent->stripe];
+		rd->stripe_left = ent->uoff + ent->len - off;
+	}
+
+	rd->error = (r != 0);
+
+	return r;
+}
+
+/*
+ * If the file is a manifest of striped output, loads it and opens the
+ * stripes, splitting the threads among them. A stripe that isn't where it
+ * was written is looked for next to the manifest. Returns 0 if the file
+ * is no manifest, 1 if it is and -1 on failure.
+ */
+static
+int
+_bcr_stripe_open(struct buffer_cache_reader *rd, size_t threads)
+{
+	const unsigned char *p = rd->map;
+	const unsigned char *path;
+	uint64_t ent_cnt, uoff = 0, *soff = NULL;
+	size_t cnt, i, len, off, dir_len;
+	const char *base;
+	char *name;
+	struct bcr_stripe_ent *ent;
+
+	if (rd->map_sz < BC_STRIPE_HDR_SZ || _le32(p) != BC_STRIPE_MAGIC)
+		return 0;
+
+	/* It has to add up exactly, or it's data that just starts alike */
+	cnt = _le32(p + 4);
+	ent_cnt = _le64(p + 8);
+	for (i = 0, off = BC_STRIPE_HDR_SZ; i < cnt; i++) {
+		if (rd->map_sz - off < 4 || rd->map_sz - off - 4 < _le32(p + off))
+			return 0;
+		off += 4 + _le32(p + off);
+	}
+	if (cnt == 0 || (rd->map_sz - off) / BC_STRIPE_ENT_SZ != ent_cnt ||
+	    (rd->map_sz - off) % BC_STRIPE_ENT_SZ != 0)
+		return 0;
+
+	if ((rd->stripes = calloc(cnt, sizeof(*rd->stripes))) == NULL ||
+	    (rd->stripe_ents = calloc((size_t)ent_cnt + 1, sizeof(*rd->stripe_ents))) == NULL ||
+	    (soff = calloc(cnt, sizeof(*soff))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for reader\n");
+		goto fail;
+	}
+
+	rd->stripe_cnt = cnt;
+	threads = (threads + cnt - 1) / cnt;
+
+	base = strrchr(rd->file, '/');
+	dir_len = (base != NULL) ? (size_t)(base - rd->file) + 1 : 0;
+
+	for (i = 0, off = BC_STRIPE_HDR_SZ; i < cnt; i++) {
+		len = _le32(p + off);
+		path = p + off + 4;
+		off += 4 + len;
+
+		if ((name = malloc(dir_len + len + 1)) == NULL)
+			goto fail;
+
+		memcpy(name, path, len);
+		name[len] = '\0';
+
+		if (access(name, R_OK) != 0) {
+			for (base = (const char *)path + len;
+			    base > (const char *)path && base[-1] != '/'; base--)
+				;
+			len -= (size_t)(base - (const char *)path);
+			memcpy(name, rd->file, dir_len);
+			memcpy(name + dir_len, base, len);
+			name[dir_len + len] = '\0';
+		}
+
+		rd->stripes[i] = _bcr_open(name, threads, rd->salvage);
+		free(name);
+		if (rd->stripes[i] == NULL)
+			goto fail;
+	}
+
+	for (i = 0; i < ent_cnt; i++, off += BC_STRIPE_ENT_SZ) {
+		ent = &rd->stripe_ents[i];
+		ent->len = _le64(p + off);
+		ent->stripe = (size_t)_le64(p + off + 8);
+		if (ent->stripe >= cnt) {
+			fprintf(stderr, "%s: corrupt manifest\n", rd->file);
+			goto fail;
+		}
+
+		ent->uoff = uoff;
+		ent->soff = soff[ent->stripe];
+		uoff += ent->len;
+		soff[ent->stripe] += ent->len;
+	}
+
+	rd->stripe_ent_cnt = (size_t)ent_cnt;
+	free(soff);
+
+	return 1;
+
+fail:
+	free(soff);
+	return -1;
+}
+
+static
+int
+_bcr_next(struct buffer_cache_reader *rd)
+{
+	int r;
+
+	if (rd->error)
+		return -1;
+
+	if (rd->stripes != NULL) {
+		r = _bcr_stripe_next(rd);
+		goto out;
+	}
+
+	switch (rd->format) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		r = _bcr_lz4_next(rd);
+		break;
+#endif
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		r = _bcr_zlib_next(rd);
+		break;
+#endif
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		r = _bcr_zstd_next(rd);
+		break;
+#endif
+	default:
+		r = _bcr_raw_next(rd);
+		break;
+	}
+
+out:
+	if (r < 0)
+		rd->error = 1;
+	if (r <= 0) {
+		rd->chunk = NULL;
+		rd->chunk_len = 0;
+	}
+
+	return r;
+}
+
+static
+int
+_bcr_detect(const unsigned char *p, size_t sz)
+{
+	if (sz >= 4 && (_le32(p) == LZ4_MAGIC ||
+	    (_le32(p) & LZ4_SKIP_MAGIC_MASK) == LZ4_SKIP_MAGIC))
+		return BC_COMP_LZ4;
+
+	if (sz >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+		return BC_COMP_ZLIB;
+
+	if (sz >= 4 && _le32(p) == ZSTD_MAGIC)
+		return BC_COMP_ZSTD;
+
+	return BC_COMP_NONE;
+}
+
+/*
+ * Collects the index pieces from the "BX" extra fields of the empty gzip
+ * members starting at off into blob.
+ */
+static
+int
+_bcr_index_gz(struct buffer_cache_reader *rd, size_t off, unsigned char *blob,
+    size_t blob_sz)
+{
+	const unsigned char *p, *xend;
+	size_t xlen, len, got = 0;
+
+	while (off < rd->map_sz) {
+		p = rd->map + off;
+		if (rd->map_sz - off < 12 + BC_INDEX_GZ_TAIL || p[0] != 0x1f ||
+		    p[1] != 0x8b || p[3] != 0x04)
+			return 1;
+
+		xlen = p[10] | ((size_t)p[11] << 8);
+		if (rd->map_sz - off - 12 - BC_INDEX_GZ_TAIL < xlen)
+			return 1;
+
+		xend = p + 12 + xlen;
+		for (p += 12; p + 4 <= xend; p += 4 + len) {
+			len = p[2] | ((size_t)p[3] << 8);
+			if (len > (size_t)(xend - p) - 4)
+				return 1;
+			if (p[0] != 'B' || p[1] != 'X')
+				continue;
+			if (len > blob_sz - got)
+				return 1;
+			memcpy(blob + got, p + 4, len);
+			got += len;
+		}
+
+		off += 12 + xlen + BC_INDEX_GZ_TAIL;
+	}
+
+	return (got == blob_sz) ? 0 : 1;
+}
+
+/*
+ * Finds and loads the index from the footer at the end of the file.
+ */
+static
+int
+_bcr_index_load(struct buffer_cache_reader *rd)
+{
+	const unsigned char *ftr;
+	unsigned char *blob = NULL;
+	uint64_t index_off, cnt;
+	size_t blob_sz, end, i;
+	int r = 1;
+
+	if (rd->index_loaded)
+		return (rd->index != NULL) ? 0 : 1;
+
+	rd->index_loaded = 1;
+
+	end = rd->map_sz;
+	if (rd->format == BC_COMP_ZLIB)
+		end -= (end >= BC_INDEX_GZ_TAIL) ? BC_INDEX_GZ_TAIL : end;
+	if (end < BC_INDEX_FTR_SZ)
+		goto out;
+
+	ftr = rd->map + end - BC_INDEX_FTR_SZ;
+	if (_le32(ftr + 20) != BC_INDEX_MAGIC)
+		goto out;
+
+	index_off = _le64(ftr);
+	cnt = _le64(ftr + 8);
+	if (index_off >= end || cnt == 0 || cnt > (end - index_off) / BC_INDEX_ENT_SZ)
+		goto out;
+
+	blob_sz = (size_t)cnt * BC_INDEX_ENT_SZ + BC_INDEX_FTR_SZ;
+
+	switch (rd->format) {
+	case BC_COMP_LZ4:
+	case BC_COMP_ZSTD:
+		if (end - index_off != blob_sz + 8 ||
+		    _le32(rd->map + index_off) != BC_INDEX_LZ4_MAGIC ||
+		    _le32(rd->map + index_off + 4) != blob_sz)
+			goto out;
+		blob = (unsigned char *)rd->map + index_off + 8;
+		break;
+
+	case BC_COMP_ZLIB:
+		if ((blob = malloc(blob_sz)) == NULL ||
+		    _bcr_index_gz(rd, (size_t)index_off, blob, blob_sz) != 0)
+			goto out;
+		break;
+
+	default:
+		goto out;
+	}
+
+	if ((rd->index = calloc((size_t)cnt, sizeof(*rd->index))) == NULL)
+		goto out;
+
+	for (i = 0; i < cnt; i++) {
+		rd->index[i].uoff = _le64(blob + i*BC_INDEX_ENT_SZ);
+		rd->index[i].coff = _le64(blob + i*BC_INDEX_ENT_SZ + 8);
+		rd->index[i].key = _le64(blob + i*BC_INDEX_ENT_SZ + 16);
+	}
+
+	rd->index_cnt = (size_t)cnt;
+	rd->index_keys = !!(_le32(ftr + 16) & BC_INDEX_KEYS);
+	r = 0;
+
+out:
+	if (rd->format == BC_COMP_ZLIB && blob != NULL)
+		free(blob);
+
+	return r;
+}
+
+/*
+ * Restarts decompression at index entry ent and skips skip bytes.
+ */
+static
+int
+_bcr_restart(struct buffer_cache_reader *rd, const struct bcr_index_ent *ent,
+    uint64_t skip)
+{
+	const void *data;
+	size_t len;
+	int r;
+
+	switch (rd->format) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		r = _bcr_lz4_restart(rd, ent->coff);
+		break;
+#endif
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		r = _bcr_zlib_restart(rd, ent->coff);
+		break;
+#endif
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		r = _bcr_zstd_restart(rd, ent->coff);
+		break;
+#endif
+	default:
+		(void)ent;	/* with no codec compiled in */
+		r = 1;
+	}
+
+	rd->chunk = NULL;
+	rd->chunk_len = 0;
+	rd->error = r;
+	if (r != 0)
+		return -1;
+
+	while (skip > 0) {
+		if ((r = _bcr_next(rd)) <= 0)
+			return r;
+
+		len = (rd->chunk_len < skip) ? rd->chunk_len : (size_t)skip;
+		data = rd->chunk;
+		rd->chunk = (const unsigned char *)data + len;
+		rd->chunk_len -= len;
+		skip -= len;
+	}
+
+	return 0;
+}
+
+int
+buffer_cache_reader_seek(struct buffer_cache_reader *rd, uint64_t off)
+{
+	size_t lo, hi, mid;
+
+	if (rd->stripes != NULL)
+		return _bcr_stripe_seek(rd, off);
+
+	if (rd->format == BC_COMP_NONE) {
+		if (off > rd->map_sz)
+			return -1;
+		rd->pos = (size_t)off;
+		rd->chunk = NULL;
+		rd->chunk_len = 0;
+		return 0;
+	}
+
+	if (_bcr_index_load(rd) != 0) {
+		fprintf(stderr, "%s: no index found\n", rd->file);
+		return -1;
+	}
+
+	/* Last entry starting at or before off */
+	for (lo = 0, hi = rd->index_cnt; hi - lo > 1; ) {
+		mid = lo + (hi - lo) / 2;
+		if (rd->index[mid].uoff <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if (off < rd->index[lo].uoff)
+		return -1;
+
+	return _bcr_restart(rd, &rd->index[lo], off - rd->index[lo].uoff);
+}
+
+int
+buffer_cache_reader_seek_key(struct buffer_cache_reader *rd, uint64_t key)
+{
+	size_t lo, hi, mid;
+
+	if (rd->stripes != NULL) {
+		fprintf(stderr, "%s: striped output has no keys\n", rd->file);
+		return -1;
+	}
+
+	if (_bcr_index_load(rd) != 0) {
+		fprintf(stderr, "%s: no index found\n", rd->file);
+		return -1;
+	}
+
+	if (!rd->index_keys) {
+		fprintf(stderr, "%s: index has no keys\n", rd->file);
+		return -1;
+	}
+
+	/*
+	 * Last entry with a key < key, or the first one: data with the key
+	 * itself may begin before a buffer starting at it.
+	 */
+	for (lo = 0, hi = rd->index_cnt; hi - lo > 1; ) {
+		mid = lo + (hi - lo) / 2;
+		if (rd->index[mid].key < key)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return _bcr_restart(rd, &rd->index[lo], 0);
+}
+
+static
+struct buffer_cache_reader *
+_bcr_open(const char *file, size_t threads, int salvage)
+{
+	struct buffer_cache_reader *rd;
+	struct stat st;
+	void *map;
+
+	if ((rd = malloc(sizeof(*rd))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for reader\n");
+		return NULL;
+	}
+
+	memset(rd, 0, sizeof(*rd));
+	rd->fd = -1;
+	rd->salvage = salvage;
+
+	if ((rd->file = strdup(file)) == NULL)
+		goto fail;
+
+	if ((rd->fd = open(file, O_RDONLY)) < 0) {
+		fprintf(stderr, "Failed to open input file %s: %s\n", file,
+		    strerror(errno));
+		goto fail;
+	}
+
+	if (fstat(rd->fd, &st) != 0) {
+		fprintf(stderr, "Failed to stat input file %s: %s\n", file,
+		    strerror(errno));
+		goto fail;
+	}
+
+	rd->map_sz = (size_t)st.st_size;
+
+	if (rd->map_sz > 0) {
+		map = mmap(NULL, rd->map_sz, PROT_READ, MAP_PRIVATE, rd->fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Failed to map input file %s: %s\n",
+			    file, strerror(errno));
+			rd->map_sz = 0;
+			goto fail;
+		}
+		madvise(map, rd->map_sz, MADV_SEQUENTIAL);
+		rd->map = map;
+	}
+
+	rd->format = _bcr_detect(rd->map, rd->map_sz);
+
+	if (rd->format == BC_COMP_NONE && _bcr_stripe_open(rd, threads) < 0)
+		goto fail;
+
+	/* Salvaging linked LZ4 blocks, the index tells where to pick up */
+	if (salvage && rd->format == BC_COMP_LZ4)
+		(void)_bcr_index_load(rd);
+
+	switch (rd->format) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		if (_bcr_lz4_init(rd, threads) == NULL) {
+			fprintf(stderr, "Failed to set up LZ4 decompression\n");
+			goto fail;
+		}
+		break;
+#endif
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		if ((rd->zlib = _bcr_zlib_init()) == NULL) {
+			fprintf(stderr, "Failed to set up gzip decompression\n");
+			goto fail;
+		}
+		break;
+#endif
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		if ((rd->zstd = _bcr_zstd_init()) == NULL) {
+			fprintf(stderr, "Failed to set up zstd decompression\n");
+			goto fail;
+		}
+		break;
+#endif
+	case BC_COMP_NONE:
+		break;
+	default:
+		fprintf(stderr, "%s: compression format not supported\n", file);
+		goto fail;
+	}
+
+	return rd;
+
+fail:
+	rd->format = BC_COMP_NONE;
+	buffer_cache_reader_close(rd);
+	return NULL;
+}
+
+struct buffer_cache_reader *
+buffer_cache_reader_open(const char *file, size_t threads)
+{
+	return _bcr_open(file, threads, 0);
+}
+
+struct buffer_cache_reader *
+buffer_cache_reader_recover(const char *file, size_t threads)
+{
+	return _bcr_open(file, threads, 1);
+}
+
+/*
+ * Reads the next count bytes of data into data. Returns the number of
+ * bytes read, which is only less than count at the end of the file, or
+ * -1 if the file is corrupt.
+ */
+ssize_t
+buffer_cache_reader_read(struct buffer_cache_reader *rd, void *data,
+    size_t count)
+{
+	unsigned char *p = data;
+	size_t n, done = 0;
+	int r;
+
+	while (done < count) {
+		if (rd->chunk_len == 0) {
+			if ((r = _bcr_next(rd)) < 0)
+				return -1;
+			if (r == 0)
+				break;
+		}
+
+		n = count - done;
+		if (n > rd->chunk_len)
+			n = rd->chunk_len;
+
+		memcpy(p + done, rd->chunk, n);
+		rd->chunk += n;
+		rd->chunk_len -= n;
+		done += n;
+	}
+
+	return (ssize_t)done;
+}
+
+/*
+ * Returns the next piece of decompressed data without copying it. The
+ * data stays valid until the next call on the reader. Returns 1 if data
+ * was returned, 0 at the end of the file and -1 if the file is corrupt.
+ */
+int
+buffer_cache_reader_next(struct buffer_cache_reader *rd, const void **data,
+    size_t *len)
+{
+	int r;
+
+	if (rd->chunk_len == 0 && (r = _bcr_next(rd)) <= 0)
+		return r;
+
+	*data = rd->chunk;
+	*len = rd->chunk_len;
+	rd->chunk += rd->chunk_len;
+	rd->chunk_len = 0;
+
+	return 1;
+}
+
+/*
+ * Makes sure there are at least n bytes from rd->rec_off on, moving data
+ * over from the chunks. Returns how many there are, fewer only at the end
+ * of the file, or -1 on error.
+ */
+static
+ssize_t
+_bcr_rec_fill(struct buffer_cache_reader *rd, size_t n)
+{
+	unsigned char *rec;
+	size_t size, len;
+	int r;
+
+	if (rd->rec_off > 0) {
+		memmove(rd->rec, rd->rec + rd->rec_off, rd->rec_len - rd->rec_off);
+		rd->rec_len -= rd->rec_off;
+		rd->rec_off = 0;
+	}
+
+	if (n > rd->rec_size) {
+		for (size = (rd->rec_size > 0) ? rd->rec_size : 4096; size < n; )
+			size *= 2;
+		if ((rec = realloc(rd->rec, size)) == NULL) {
+			fprintf(stderr, "Failed to allocate memory for record\n");
+			return -1;
+		}
+		rd->rec = rec;
+		rd->rec_size = size;
+	}
+
+	while (rd->rec_len < n) {
+		if (rd->chunk_len == 0 && (r = _bcr_next(rd)) <= 0) {
+			if (r < 0)
+				return -1;
+			break;
+		}
+
+		len = n - rd->rec_len;
+		if (len > rd->chunk_len)
+			len = rd->chunk_len;
+
+		memcpy(rd->rec + rd->rec_len, rd->chunk, len);
+		rd->rec_len += len;
+		rd->chunk += len;
+		rd->chunk_len -= len;
+	}
+
+	return (ssize_t)rd->rec_len;
+}
+
+/*
+ * Looks at the frame at p, of which avail bytes are there. Returns 1 if
+ * it checks out, setting *hdr_sz and *len, 0 if it needs *need bytes to
+ * tell, and -1 if it's damaged.
+ */
+static
+int
+_bcr_rec_check(struct buffer_cache_reader *rd, const unsigned char *p,
+    size_t avail, size_t *need, size_t *hdr_sz, size_t *len)
+{
+	uint64_t v = 0;
+	size_t i, max;
+
+	for (i = 0; ; i++) {
+		if (i == FRAME_HDR_MAX)
+			return -1;
+		if (i == avail) {
+			*need = i + 1;
+			return 0;
+		}
+
+		v |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+		if ((p[i] & 0x80) == 0)
+			break;
+	}
+
+	/* Salvaging, don't go looking too far for the end of a record */
+	max = FRAME_MAX;
+	if (rd->salvage)
+		max = (rd->rec_max > FRAME_RESYNC_MIN) ? rd->rec_max :
+		    FRAME_RESYNC_MIN;
+	if (v > max)
+		return -1;
+
+	*hdr_sz = i + 1;
+	*len = (size_t)v;
+	*need = *hdr_sz + *len + FRAME_CRC_SZ;
+
+	if (avail < *need)
+		return 0;
+
+	if (crc32c(0, p, *hdr_sz + *len) != _le32(p + *hdr_sz + *len))
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Passes over n bytes of records, from the data taken from the chunks
+ * first.
+ */
+static
+void
+_bcr_rec_skip(struct buffer_cache_reader *rd, size_t n)
+{
+	if (rd->rec_off < rd->rec_len) {
+		rd->rec_off += n;
+	} else {
+		rd->chunk += n;
+		rd->chunk_len -= n;
+	}
+}
+
+int
+buffer_cache_reader_record(struct buffer_cache_reader *rd, const void **data,
+    size_t *len)
+{
+	const unsigned char *p;
+	size_t avail, need, hdr_sz, rec_len;
+	ssize_t n;
+	int r, damaged = 0;
+
+	for (;;) {
+		/* Records that lie in a single chunk are used right there */
+		if (rd->rec_off < rd->rec_len) {
+			p = rd->rec + rd->rec_off;
+			avail = rd->rec_len - rd->rec_off;
+		} else {
+			if (rd->chunk_len == 0 && (r = _bcr_next(rd)) <= 0)
+				return r;
+			p = rd->chunk;
+			avail = rd->chunk_len;
+		}
+
+		r = _bcr_rec_check(rd, p, avail, &need, &hdr_sz, &rec_len);
+
+		if (r > 0) {
+			*data = p + hdr_sz;
+			*len = rec_len;
+			_bcr_rec_skip(rd, hdr_sz + rec_len + FRAME_CRC_SZ);
+			if (rec_len > rd->rec_max)
+				rd->rec_max = rec_len;
+			return 1;
+		}
+
+		if (r == 0) {
+			if ((n = _bcr_rec_fill(rd, need)) < 0)
+				return -1;
+			if ((size_t)n >= need)
+				continue;
+
+			/* The file ends in the middle of a record */
+			if (!rd->salvage) {
+				fprintf(stderr, "%s: truncated record\n",
+				    rd->file);
+				rd->error = 1;
+				return -1;
+			}
+
+			if (!damaged)
+				++rd->lost_recs;
+			_bcr_lost(rd, (uint64_t)n);
+			rd->rec_off = rd->rec_len = 0;
+			return 0;
+		}
+
+		if (!rd->salvage) {
+			fprintf(stderr, "%s: corrupt record\n", rd->file);
+			rd->error = 1;
+			return -1;
+		}
+
+		/* Look for the next record that checks out from the next byte */
+		if (!damaged) {
+			damaged = 1;
+			++rd->lost_recs;
+		}
+		_bcr_lost(rd, 1);
+		_bcr_rec_skip(rd, 1);
+	}
+}
+
+void
+buffer_cache_reader_lost(struct buffer_cache_reader *rd, uint64_t *bytes,
+    uint64_t *records)
+{
+	size_t i;
+
+	*bytes = __atomic_load_n(&rd->lost_bytes, __ATOMIC_RELAXED);
+	*records = rd->lost_recs;
+
+	for (i = 0; i < rd->stripe_cnt; i++) {
+		*bytes += __atomic_load_n(&rd->stripes[i]->lost_bytes,
+		    __ATOMIC_RELAXED);
+		*records += rd->stripes[i]->lost_recs;
+	}
+}
+
+void
+buffer_cache_reader_close(struct buffer_cache_reader *rd)
+{
+	size_t i;
+
+	switch (rd->format) {
+#ifndef _WITHOUT_LZ4
+	case BC_COMP_LZ4:
+		if (rd->lz4 != NULL)
+			_bcr_lz4_free(rd->lz4);
+		break;
+#endif
+#ifdef _WITH_ZLIB
+	case BC_COMP_ZLIB:
+		if (rd->zlib != NULL)
+			_bcr_zlib_free(rd->zlib);
+		break;
+#endif
+#ifdef _WITH_ZSTD
+	case BC_COMP_ZSTD:
+		if (rd->zstd != NULL)
+			_bcr_zstd_free(rd->zstd);
+		break;
+#endif
+	}
+
+	if (rd->index != NULL)
+		free(rd->index);
+	if (rd->rec != NULL)
+		free(rd->rec);
+	for (i = 0; i < rd->stripe_cnt; i++) {
+		if (rd->stripes[i] != NULL)
+			buffer_cache_reader_close(rd->stripes[i]);
+	}
+	if (rd->stripes != NULL)
+		free(rd->stripes);
+	if (rd->stripe_ents != NULL)
+		free(rd->stripe_ents);
+	if (rd->map != NULL)
+		munmap((void *)rd->map, rd->map_sz);
+	if (rd->fd >= 0)
+		close(rd->fd);
+
+	free(rd->file);
+	free(rd);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2013 Alex Hornung <alex@alexhornung.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * CRC-32C, with the crc32 instructions of SSE4.2 or ARMv8 where the CPU has
+ * them, and table-driven, eight bytes at a time ("slicing-by-8"), where it
+ * doesn't.
+ */
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY	0x82F63B78	/* reflected */
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_SSE42
+#endif
+
+static uint32_t crc32c_tab[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len);
+static uint32_t (*crc32c_fn)(uint32_t, const unsigned char *, size_t) =
+    crc32c_sw;
+
+#ifdef CRC32C_SSE42
+/*
+ * Built for SSE4.2 whatever the rest of the file is built for, and only
+ * called once the CPU is known to have it.
+ */
+__attribute__((target("sse4.2")))
+static
+uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t w, c = crc;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, sizeof(w));
+		c = __builtin_ia32_crc32di(c, w);
+	}
+
+	for (; len > 0; len--)
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+
+	return (uint32_t)c;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static
+uint32_t
+crc32c_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t w;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = __crc32cb(crc, *p++);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, sizeof(w));
+		crc = __crc32cd(crc, w);
+	}
+
+	for (; len > 0; len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+static
+void
+crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+#ifdef CRC32C_SSE42
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_fn = crc32c_sse42;
+		return;
+	}
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc32c_fn = crc32c_armv8;
+	return;
+#endif
+
+	for (i = 0; i < 256; i++) {
+		crc = (uint32_t)i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		crc32c_tab[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_tab[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = (crc >> 8) ^ crc32c_tab[0][crc & 0xFF];
+			crc32c_tab[j][i] = crc;
+		}
+	}
+}
+
+static
+uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t w;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = (crc >> 8) ^ crc32c_tab[0][(crc ^ *p++) & 0xFF];
+
+	/* Little endian only, like the rest of the file formats */
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, sizeof(w));
+		w ^= crc;
+		crc = crc32c_tab[7][w & 0xFF] ^
+		    crc32c_tab[6][(w >> 8) & 0xFF] ^
+		    crc32c_tab[5][(w >> 16) & 0xFF] ^
+		    crc32c_tab[4][(w >> 24) & 0xFF] ^
+		    crc32c_tab[3][(w >> 32) & 0xFF] ^
+		    crc32c_tab[2][(w >> 40) & 0xFF] ^
+		    crc32c_tab[1][(w >> 48) & 0xFF] ^
+		    crc32c_tab[0][w >> 56];
+	}
+
+	for (; len > 0; len--)
+		crc = (crc >> 8) ^ crc32c_tab[0][(crc ^ *p++) & 0xFF];
+
+	return crc;
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return ~crc32c_fn(~crc, data, len);
+}
@@ -0,0 +1,133 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "buffer_cache.h"
+
+/*
+ * Attaches more ctxs to an engine than its pool has buffers, and has a
+ * few threads write a small record to each of them in turn, so that the
+ * pool is soon all current buffers of ctxs that aren't being written to
+ * any more. The writes must not block for good (the alarm goes off if
+ * they do), and everything must read back in order.
+ */
+
+#define CTX_CNT		200
+#define THREAD_CNT	4
+#define POOL_MB		64
+#define ROUNDS		3
+#define REC_SZ		5
+
+static struct buffer_cache_ctx *bc[CTX_CNT];
+
+static
+void
+fill(char *p, int c, int round)
+{
+	/* "ccc:r", fixed width so every record is REC_SZ */
+	p[0] = '0' + c / 100 % 10;
+	p[1] = '0' + c / 10 % 10;
+	p[2] = '0' + c % 10;
+	p[3] = ':';
+	p[4] = '0' + round % 10;
+}
+
+static
+void *
+producer(void *arg)
+{
+	int t = (int)(intptr_t)arg;
+	char rec[REC_SZ + 1];
+	int c, round, r;
+
+	for (round = 0; round < ROUNDS; round++) {
+		for (c = t; c < CTX_CNT; c += THREAD_CNT) {
+			fill(rec, c, round);
+			r = buffer_cache_write(bc[c], rec, REC_SZ);
+			assert (r == 0);
+		}
+	}
+
+	return NULL;
+}
+
+static
+void
+check(const char *file, int c)
+{
+	struct buffer_cache_reader *rd;
+	char rec[REC_SZ + 1], exp[REC_SZ + 1];
+	ssize_t ssz;
+	int round;
+
+	rd = buffer_cache_reader_open(file, 2);
+	assert (rd != NULL);
+
+	for (round = 0; round < ROUNDS; round++) {
+		ssz = buffer_cache_reader_read(rd, rec, REC_SZ);
+		assert (ssz == REC_SZ);
+		fill(exp, c, round);
+		assert (memcmp(rec, exp, REC_SZ) == 0);
+	}
+
+	ssz = buffer_cache_reader_read(rd, rec, 1);
+	assert (ssz == 0);
+
+	buffer_cache_reader_close(rd);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *prefix = "engine_test";
+	struct buffer_cache_engine *eng;
+	struct buffer_cache_opts opts;
+	pthread_t thr[THREAD_CNT];
+	char file[256];
+	int c, t, r;
+
+	if (argc > 1)
+		prefix = argv[1];
+
+	alarm(60);
+
+	eng = buffer_cache_engine_init(2, 1, POOL_MB);
+	assert (eng != NULL);
+
+	for (c = 0; c < CTX_CNT; c++) {
+		buffer_cache_opts_init(&opts);
+		opts.compress = (c % 2 == 0) ? BC_COMP_NONE : BC_COMP_LZ4;
+		opts.backpressure = BC_BP_BLOCK;
+		opts.engine = eng;
+
+		snprintf(file, sizeof(file), "%s.%d.trace", prefix, c);
+		bc[c] = buffer_cache_init_opts(file, &opts);
+		assert (bc[c] != NULL);
+	}
+
+	for (t = 0; t < THREAD_CNT; t++) {
+		r = pthread_create(&thr[t], NULL, producer, (void *)(intptr_t)t);
+		assert (r == 0);
+	}
+	for (t = 0; t < THREAD_CNT; t++)
+		pthread_join(thr[t], NULL);
+
+	for (c = 0; c < CTX_CNT; c++) {
+		r = buffer_cache_destroy(bc[c]);
+		assert (r == 0);
+	}
+	buffer_cache_engine_destroy(eng);
+
+	for (c = 0; c < CTX_CNT; c++) {
+		snprintf(file, sizeof(file), "%s.%d.trace", prefix, c);
+		check(file, c);
+		unlink(file);
+	}
+
+	printf("%d ctxs, %d MB pool: ok\n", CTX_CNT, POOL_MB);
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "buffer_cache.h"
+
+/*
+ * Runs out of room partway through the file, by way of a file size limit
+ * (so writes past it fail with EFBIG), and checks that both waiting for
+ * durability and destroying the ctx report it, rather than the I/O
+ * thread giving up on the spot or the producers hanging.
+ */
+
+#define LIMIT_MB	2
+#define DATA_MB		16
+#define REC_SZ		4096
+
+static
+void
+fill(char *p, size_t len, uint64_t *x)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*x ^= *x << 13;
+		*x ^= *x >> 7;
+		*x ^= *x << 17;
+		p[i] = (char)*x;
+	}
+}
+
+static
+void
+check(const char *file, int compress, int flags, size_t comp_workers,
+    unsigned int max_age_ms)
+{
+	struct buffer_cache_opts opts;
+	struct buffer_cache_ctx *bc;
+	char rec[REC_SZ];
+	uint64_t x = 1, drop_bytes, drop_recs;
+	size_t i, n = (size_t)DATA_MB * 1024 * 1024 / REC_SZ;
+	int r;
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.flags = flags;
+	opts.comp_workers = comp_workers;
+	opts.max_age_ms = max_age_ms;
+	opts.buffer_size_mb = 1;
+	opts.durability = BC_DUR_BUFFER;
+
+	bc = buffer_cache_init_opts(file, &opts);
+	assert (bc != NULL);
+
+	for (i = 0; i < n; i++) {
+		fill(rec, sizeof(rec), &x);
+		r = buffer_cache_write(bc, rec, sizeof(rec));
+		assert (r == 0);
+	}
+
+	errno = 0;
+	r = buffer_cache_wait_durable(bc, buffer_cache_seq(bc));
+	assert (r == 1 && errno == EIO);
+
+	buffer_cache_drops(bc, &drop_bytes, &drop_recs);
+	printf("codec %d, flags %#x, workers %zu, max_age %u: "
+	    "%ju bytes dropped\n", compress, flags, comp_workers, max_age_ms,
+	    (uintmax_t)drop_bytes);
+
+	errno = 0;
+	r = buffer_cache_destroy(bc);
+	assert (r == 1 && errno == EIO);
+
+	unlink(file);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *file = "fail_test.trace";
+	struct rlimit rl;
+
+	if (argc > 1)
+		file = argv[1];
+
+	signal(SIGXFSZ, SIG_IGN);
+	rl.rlim_cur = rl.rlim_max = (rlim_t)LIMIT_MB * 1024 * 1024;
+	if (setrlimit(RLIMIT_FSIZE, &rl) != 0) {
+		perror("setrlimit");
+		return 1;
+	}
+
+	check(file, BC_COMP_NONE, 0, 0, 0);
+	check(file, BC_COMP_NONE, 0, 0, 1);
+	check(file, BC_COMP_NONE, BC_OPT_IO_URING, 0, 0);
+	check(file, BC_COMP_LZ4, 0, 0, 0);
+	check(file, BC_COMP_LZ4, 0, 2, 0);
+#ifdef _WITH_ZLIB
+	check(file, BC_COMP_ZLIB, BC_OPT_IO_URING, 2, 0);
+#endif
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "buffer_cache.h"
+
+/*
+ * Writes random lowercase text, which has no repeats to speak of but only
+ * uses 26 byte values, and checks that each codec still compresses it
+ * (gzip -1 gets it down to about 2/3) and that it reads back intact.
+ */
+
+#define TEXT_MB		20
+#define REC_SZ		4096
+
+static
+void
+fill(char *p, size_t len, uint64_t *x)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*x ^= *x << 13;
+		*x ^= *x >> 7;
+		*x ^= *x << 17;
+		p[i] = 'a' + (char)(*x % 26);
+	}
+}
+
+static
+void
+check(const char *file, int compress, double max_ratio)
+{
+	struct buffer_cache_opts opts;
+	struct buffer_cache_ctx *bc;
+	struct buffer_cache_reader *rd;
+	char rec[REC_SZ], exp[REC_SZ];
+	uint64_t x = 1, y = 1;
+	struct stat st;
+	size_t i, n = (size_t)TEXT_MB * 1024 * 1024 / REC_SZ;
+	ssize_t ssz;
+	int r;
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.buffer_size_mb = 4;
+
+	bc = buffer_cache_init_opts(file, &opts);
+	assert (bc != NULL);
+
+	for (i = 0; i < n; i++) {
+		fill(rec, sizeof(rec), &x);
+		r = buffer_cache_write(bc, rec, sizeof(rec));
+		assert (r == 0);
+	}
+
+	buffer_cache_destroy(bc);
+
+	r = stat(file, &st);
+	assert (r == 0);
+	printf("codec %d: %ju -> %ju bytes\n", compress,
+	    (uintmax_t)(n * REC_SZ), (uintmax_t)st.st_size);
+	assert ((double)st.st_size <= max_ratio * (double)(n * REC_SZ));
+
+	rd = buffer_cache_reader_open(file, 2);
+	assert (rd != NULL);
+
+	for (i = 0; i < n; i++) {
+		ssz = buffer_cache_reader_read(rd, rec, sizeof(rec));
+		assert (ssz == sizeof(rec));
+		fill(exp, sizeof(exp), &y);
+		assert (memcmp(rec, exp, sizeof(rec)) == 0);
+	}
+
+	ssz = buffer_cache_reader_read(rd, rec, 1);
+	assert (ssz == 0);
+
+	buffer_cache_reader_close(rd);
+	unlink(file);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *file = "ratio_test.trace";
+
+	if (argc > 1)
+		file = argv[1];
+
+#ifdef _WITH_ZLIB
+	check(file, BC_COMP_ZLIB, 0.75);
+#endif
+#ifdef _WITH_ZSTD
+	check(file, BC_COMP_ZSTD, 0.75);
+#endif
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer_cache.h"
+
+
+int
+main(int argc, char *argv[]) {
+	struct buffer_cache_reader *rd;
+	const char *file = "bc_test.trace";
+	size_t threads = 4;
+	char buf[16];
+	int i, j, rec_i, rec_j;
+	ssize_t ssz;
+
+	if (argc > 1)
+		file = argv[1];
+	if (argc > 2)
+		threads = (size_t)atoi(argv[2]);
+
+	rd = buffer_cache_reader_open(file, threads);
+	assert (rd != NULL);
+
+	for (i = 0, j = 1024*1024*512; ; i++, j--) {
+		ssz = buffer_cache_reader_read(rd, buf, sizeof(i)+sizeof(j)+4);
+		assert (ssz >= 0);
+		if (ssz == 0)
+			break;
+		assert (ssz == sizeof(i)+sizeof(j)+4);
+
+		memcpy(&rec_i, buf, sizeof(rec_i));
+		memcpy(&rec_j, buf+sizeof(rec_i), sizeof(rec_j));
+		assert (rec_i == i && rec_j == j);
+	}
+
+	buffer_cache_reader_close(rd);
+
+	printf("%d records\n", i);
+
+	return 0;
+}
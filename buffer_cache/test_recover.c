@@ -0,0 +1,187 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "buffer_cache.h"
+
+/*
+ * Writes framed records, damages the file in one spot or another, then
+ * cuts it short, and reads it back with buffer_cache_reader_recover()
+ * each time. Whatever comes back has to be records as they were written,
+ * in order and each only once: the records repeat a lot, so damaged
+ * compressed data can well decompress into earlier ones with good CRCs.
+ * Where the output has points to pick up again at, most of the records
+ * after the damage have to come back too.
+ */
+
+#define REC_CNT		(2 * 1024 * 1024)
+#define REC_MAX		128
+#define DAMAGE_SZ	64
+
+/* Where to damage the file, past a third of it; each is tried on its own */
+static const off_t damage_at[] = { 0, 17, 100, 1000, 4099 };
+
+static const char text[] =
+    "the quick brown fox jumps over the lazy dog, and then some more "
+    "text so that the records have something to compress with each other";
+
+static
+size_t
+fill(char *p, uint64_t seq)
+{
+	size_t len = 8 + 24 + (size_t)(seq % 64);
+
+	memcpy(p, &seq, 8);
+	memcpy(p + 8, text + seq % 7, len - 8);
+
+	return len;
+}
+
+/* Flips DAMAGE_SZ bytes at off; doing it again undoes it */
+static
+void
+damage(const char *file, off_t off)
+{
+	unsigned char buf[DAMAGE_SZ];
+	ssize_t ssz;
+	int fd, i;
+
+	fd = open(file, O_RDWR);
+	assert (fd >= 0);
+
+	ssz = pread(fd, buf, sizeof(buf), off);
+	assert (ssz == sizeof(buf));
+	for (i = 0; i < DAMAGE_SZ; i++)
+		buf[i] ^= 0xFF;
+	ssz = pwrite(fd, buf, sizeof(buf), off);
+	assert (ssz == sizeof(buf));
+
+	close(fd);
+}
+
+static
+void
+recover(const char *file, int compress, off_t size, int picks_up)
+{
+	struct buffer_cache_reader *rd;
+	char exp[REC_MAX];
+	const void *data;
+	uint64_t seq, next = 0, got = 0, got_bytes = 0, lost_bytes, lost_recs;
+	size_t len;
+	int r;
+
+	rd = buffer_cache_reader_recover(file, 2);
+	assert (rd != NULL);
+
+	while ((r = buffer_cache_reader_record(rd, &data, &len)) > 0) {
+		assert (len >= 8 && len <= REC_MAX);
+		memcpy(&seq, data, 8);
+
+		/* No repeats, nothing out of order, nothing made up */
+		assert (seq >= next && seq < REC_CNT);
+		assert (fill(exp, seq) == len);
+		assert (memcmp(data, exp, len) == 0);
+
+		next = seq + 1;
+		++got;
+		got_bytes += 1 + len + 4;	/* a 1 byte varint, and the CRC */
+	}
+	assert (r == 0);
+
+	buffer_cache_reader_lost(rd, &lost_bytes, &lost_recs);
+	buffer_cache_reader_close(rd);
+
+	/* Those before the damage come back, most of those after it too */
+	assert (got < REC_CNT && got > REC_CNT / 4);
+	if (picks_up)
+		assert (got > REC_CNT / 2);
+
+	/*
+	 * The damage is all in one place, so at most the records around it
+	 * don't check out; whole LZ4 blocks lost don't count. Uncompressed,
+	 * the bytes lost are those of the records lost.
+	 */
+	assert (lost_bytes > 0 && lost_recs <= 1);
+	if (compress == BC_COMP_NONE)
+		assert (lost_recs == 1 && got_bytes + lost_bytes == (uint64_t)size);
+}
+
+static
+void
+check(const char *file, int compress, int flags, size_t comp_workers,
+    int picks_up)
+{
+	struct buffer_cache_opts opts;
+	struct buffer_cache_ctx *bc;
+	char rec[REC_MAX];
+	struct stat st;
+	uint64_t i;
+	size_t j, len;
+	int r;
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.flags = flags | BC_OPT_FRAMED;
+	opts.comp_workers = comp_workers;
+	opts.buffer_size_mb = 4;
+
+	bc = buffer_cache_init_opts(file, &opts);
+	assert (bc != NULL);
+
+	for (i = 0; i < REC_CNT; i++) {
+		len = fill(rec, i);
+		r = buffer_cache_write(bc, rec, len);
+		assert (r == 0);
+	}
+
+	r = buffer_cache_destroy(bc);
+	assert (r == 0);
+
+	r = stat(file, &st);
+	assert (r == 0);
+
+	for (j = 0; j < sizeof(damage_at) / sizeof(damage_at[0]); j++) {
+		damage(file, st.st_size / 3 + damage_at[j]);
+		recover(file, compress, st.st_size, picks_up);
+		damage(file, st.st_size / 3 + damage_at[j]);
+	}
+
+	/* Cut short, as if the writer had crashed */
+	r = truncate(file, st.st_size * 2 / 3 + 7);
+	assert (r == 0);
+	recover(file, compress, st.st_size * 2 / 3 + 7, 1);
+
+	printf("codec %d, flags %#x, workers %zu: ok\n", compress, flags,
+	    comp_workers);
+
+	unlink(file);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *file = "recover_test.trace";
+
+	if (argc > 1)
+		file = argv[1];
+
+	check(file, BC_COMP_NONE, 0, 0, 1);
+	check(file, BC_COMP_LZ4, 0, 0, 1);
+	check(file, BC_COMP_LZ4, 0, 2, 1);
+	/* Linked blocks are lost up to the next frame, i.e. buffer */
+	check(file, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 0, 0);
+	check(file, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 2, 0);
+	check(file, BC_COMP_LZ4, BC_OPT_LZ4_LINKED | BC_OPT_INDEX, 0, 1);
+	check(file, BC_COMP_LZ4, BC_OPT_LZ4_LINKED | BC_OPT_INDEX, 2, 1);
+#ifdef _WITH_ZLIB
+	/* gzip needs the full flush points to pick up again without harm */
+	check(file, BC_COMP_ZLIB, BC_OPT_INDEX, 0, 1);
+	check(file, BC_COMP_ZLIB, BC_OPT_INDEX, 2, 1);
+#endif
+
+	return 0;
+}
@@ -0,0 +1,199 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "buffer_cache.h"
+
+/*
+ * Writes a stream of 64-bit words, each holding its own index, rotating
+ * the output by size and by time, and reads the files back one after the
+ * other: each has to be a complete file, they have to be named as the
+ * pattern says, and together they have to hold the whole stream.
+ */
+
+#define BUF_MB		1
+#define ROTATE_MB	1
+#define DATA_MB		8
+#define REC_SZ		4096
+#define ROTATE_SEC	1
+#define RUN_MS		2500
+
+static
+void
+fill(uint64_t *p, uint64_t off, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len / 8; i++)
+		p[i] = off / 8 + i;
+}
+
+static
+void
+name(char *buf, size_t sz, const char *pattern, int idx)
+{
+	const char *pct = strstr(pattern, "%i");
+
+	/* Stands in for %i, or appends .<idx> past the first file */
+	if (pct != NULL)
+		snprintf(buf, sz, "%.*s%d%s", (int)(pct - pattern), pattern,
+		    idx, pct + 2);
+	else if (idx > 0)
+		snprintf(buf, sz, "%s.%d", pattern, idx);
+	else
+		snprintf(buf, sz, "%s", pattern);
+}
+
+static
+uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Reads the files back in turn, returns how many there were */
+static
+int
+check_files(const char *pattern, uint64_t total, off_t max_sz)
+{
+	static uint64_t buf[REC_SZ / 8], exp[REC_SZ / 8];
+	struct buffer_cache_reader *rd;
+	char file[256];
+	struct stat st;
+	uint64_t off = 0;
+	ssize_t ssz;
+	int idx;
+
+	for (idx = 0; ; idx++) {
+		name(file, sizeof(file), pattern, idx);
+		if (stat(file, &st) != 0)
+			break;
+		assert (max_sz == 0 || st.st_size <= max_sz);
+
+		rd = buffer_cache_reader_open(file, 2);
+		assert (rd != NULL);
+
+		while ((ssz = buffer_cache_reader_read(rd, buf, REC_SZ)) > 0) {
+			assert (ssz % 8 == 0 && off + (uint64_t)ssz <= total);
+			fill(exp, off, (size_t)ssz);
+			assert (memcmp(buf, exp, (size_t)ssz) == 0);
+			off += (uint64_t)ssz;
+		}
+		assert (ssz == 0);
+
+		buffer_cache_reader_close(rd);
+		unlink(file);
+	}
+
+	assert (off == total);
+
+	return idx;
+}
+
+/* By size: rotate_mb to a file, give or take a buffer */
+static
+void
+check_size(const char *pattern, int compress)
+{
+	static uint64_t rec[REC_SZ / 8];
+	struct buffer_cache_opts opts;
+	struct buffer_cache_ctx *bc;
+	uint64_t off, total = (uint64_t)DATA_MB << 20;
+	int r, files;
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.buffer_size_mb = BUF_MB;
+	opts.rotate_mb = ROTATE_MB;
+
+	bc = buffer_cache_init_opts(pattern, &opts);
+	assert (bc != NULL);
+
+	for (off = 0; off < total; off += REC_SZ) {
+		fill(rec, off, REC_SZ);
+		r = buffer_cache_write(bc, rec, REC_SZ);
+		assert (r == 0);
+	}
+
+	r = buffer_cache_destroy(bc);
+	assert (r == 0);
+
+	/* Over by up to a buffer's output, which may not compress */
+	files = check_files(pattern, total,
+	    ((off_t)ROTATE_MB << 20) + ((off_t)BUF_MB << 20) + 4096);
+	if (compress == BC_COMP_NONE)
+		assert (files >= DATA_MB / ROTATE_MB - 1);
+	else
+		assert (files >= 2);
+
+	printf("%s, codec %d: %d files\n", pattern, compress, files);
+}
+
+/* By time: writing for RUN_MS has to go through a few ROTATE_SEC files */
+static
+void
+check_time(const char *pattern, int compress)
+{
+	static uint64_t rec[REC_SZ / 8];
+	struct buffer_cache_opts opts;
+	struct buffer_cache_ctx *bc;
+	uint64_t off, start;
+	int r, files;
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.buffer_size_mb = BUF_MB;
+	opts.rotate_sec = ROTATE_SEC;
+	opts.max_age_ms = 10;
+
+	bc = buffer_cache_init_opts(pattern, &opts);
+	assert (bc != NULL);
+
+	start = now_ms();
+	for (off = 0; now_ms() - start < RUN_MS; off += REC_SZ) {
+		fill(rec, off, REC_SZ);
+		r = buffer_cache_write(bc, rec, REC_SZ);
+		assert (r == 0);
+		usleep(1000);
+	}
+
+	r = buffer_cache_destroy(bc);
+	assert (r == 0);
+
+	files = check_files(pattern, off, 0);
+	assert (files >= RUN_MS / 1000 / ROTATE_SEC);
+
+	printf("%s, codec %d, every %d s: %d files\n", pattern, compress,
+	    ROTATE_SEC, files);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *prefix = "rotate_test";
+	char pattern[256];
+
+	if (argc > 1)
+		prefix = argv[1];
+
+	snprintf(pattern, sizeof(pattern), "%s.%%i.trace", prefix);
+	check_size(pattern, BC_COMP_NONE);
+	check_size(pattern, BC_COMP_LZ4);
+	check_time(pattern, BC_COMP_LZ4);
+
+	/* Without any % in it, .<number> is appended */
+	snprintf(pattern, sizeof(pattern), "%s.trace", prefix);
+	check_size(pattern, BC_COMP_NONE);
+#ifdef _WITH_ZLIB
+	check_size(pattern, BC_COMP_ZLIB);
+#endif
+
+	return 0;
+}
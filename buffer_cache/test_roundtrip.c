@@ -0,0 +1,213 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "buffer_cache.h"
+
+/*
+ * Writes records of random words, and so of all sizes, and checks that
+ * they read back intact. Linked LZ4 blocks are written from a single
+ * thread, by compression workers, and flushed by age in bits and pieces,
+ * and read back decompressing in the calling thread and ahead of it on a
+ * few threads, where each block has to wait for the history of the one
+ * before it. Records are also built in place with buffer_cache_reserve(),
+ * reserving more than they take up, and gathered with buffer_cache_writev()
+ * from a few pieces, empty ones included.
+ */
+
+#define DATA_MB		12
+#define BUF_MB		1
+#define REC_MAX		512
+#define AGE_EVERY	2000	/* records between pauses, with max_age_ms */
+
+/* How records are written */
+#define HOW_WRITE	0
+#define HOW_RESERVE	1
+#define HOW_WRITEV	2
+
+static const char *words[] = {
+	"buffer", "cache", "block", "frame", "linked", "history", "record",
+	"thread", "worker", "stream", "offset", "checksum", "flush", "index",
+};
+
+/* A record of whole words, up to REC_MAX bytes */
+static
+size_t
+fill(char *p, uint64_t *x)
+{
+	size_t len = 0, n, max;
+	const char *w;
+
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	max = 1 + (size_t)(*x % REC_MAX);
+
+	for (;;) {
+		*x ^= *x << 13;
+		*x ^= *x >> 7;
+		*x ^= *x << 17;
+		w = words[*x % (sizeof(words) / sizeof(words[0]))];
+		n = strlen(w);
+		if (len + n + 1 > max)
+			break;
+		memcpy(p + len, w, n);
+		p[len + n] = ' ';
+		len += n + 1;
+	}
+
+	return len;
+}
+
+static
+void
+check(const char *file, int how, int compress, int flags,
+    size_t comp_workers, unsigned int max_age_ms)
+{
+	struct buffer_cache_opts opts;
+	struct buffer_cache_ctx *bc;
+	struct buffer_cache_reader *rd;
+	struct buffer_cache_stats st;
+	char rec[REC_MAX], exp[REC_MAX];
+	uint64_t x, total = 0, i, n;
+	struct iovec iov[3];
+	const void *data;
+	char *p;
+	size_t len, rec_len, threads, j;
+	ssize_t ssz;
+	int r;
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.flags = flags;
+	opts.comp_workers = comp_workers;
+	opts.max_age_ms = max_age_ms;
+	opts.buffer_size_mb = BUF_MB;
+
+	bc = buffer_cache_init_opts(file, &opts);
+	assert (bc != NULL);
+
+	/* Records can't be larger than a buffer */
+	if (how == HOW_RESERVE) {
+		p = buffer_cache_reserve(bc, ((size_t)BUF_MB << 20) + 1);
+		assert (p == NULL && errno == EMSGSIZE);
+	}
+
+	x = 1;
+	for (i = 0; total < (uint64_t)DATA_MB << 20; i++) {
+		switch (how) {
+		case HOW_RESERVE:
+			p = buffer_cache_reserve(bc, REC_MAX);
+			assert (p != NULL);
+			len = fill(p, &x);
+			r = buffer_cache_commit(bc, len);
+			break;
+		case HOW_WRITEV:
+			len = fill(rec, &x);
+			iov[0].iov_base = rec;
+			iov[0].iov_len = len / 3;
+			iov[1].iov_base = rec + len / 3;
+			iov[1].iov_len = (i % 2 == 0) ? 0 : len / 3;
+			iov[2].iov_base = rec + len / 3 + iov[1].iov_len;
+			iov[2].iov_len = len - len / 3 - iov[1].iov_len;
+			r = buffer_cache_writev(bc, iov, 3);
+			break;
+		default:
+			len = fill(rec, &x);
+			r = buffer_cache_write(bc, rec, len);
+		}
+		assert (r == 0);
+		total += len;
+
+		/* Every so often, wait for the I/O thread to flush it all */
+		if (max_age_ms == 0 || i % AGE_EVERY != AGE_EVERY - 1)
+			continue;
+		for (j = 0; ; j++) {
+			buffer_cache_stats(bc, &st);
+			if (st.bytes_in == total)
+				break;
+			assert (j < 1000);
+			usleep(max_age_ms * 1000);
+		}
+	}
+	n = i;
+
+	r = buffer_cache_destroy(bc);
+	assert (r == 0);
+
+	for (threads = 0; threads <= 2; threads += 2) {
+		rd = buffer_cache_reader_open(file, threads);
+		assert (rd != NULL);
+
+		x = 1;
+		for (i = 0; i < n; i++) {
+			len = fill(exp, &x);
+
+			/* Framed, each write, writev or commit is a record */
+			if (flags & BC_OPT_FRAMED) {
+				r = buffer_cache_reader_record(rd, &data,
+				    &rec_len);
+				assert (r == 1 && rec_len == len);
+			} else {
+				ssz = buffer_cache_reader_read(rd, rec, len);
+				assert (ssz == (ssize_t)len);
+				data = rec;
+			}
+			assert (memcmp(data, exp, len) == 0);
+		}
+
+		if (flags & BC_OPT_FRAMED) {
+			r = buffer_cache_reader_record(rd, &data, &rec_len);
+			assert (r == 0);
+		} else {
+			ssz = buffer_cache_reader_read(rd, rec, 1);
+			assert (ssz == 0);
+		}
+
+		buffer_cache_reader_close(rd);
+	}
+
+	printf("how %d, codec %d, flags %#x, workers %zu, max_age %u: ok\n",
+	    how, compress, flags, comp_workers, max_age_ms);
+
+	unlink(file);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *file = "roundtrip_test.trace";
+
+	if (argc > 1)
+		file = argv[1];
+
+	check(file, HOW_WRITE, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 0, 0);
+	check(file, HOW_WRITE, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 2, 0);
+	check(file, HOW_WRITE, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 0, 1);
+	check(file, HOW_WRITE, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 2, 1);
+	check(file, HOW_WRITE, BC_COMP_LZ4, BC_OPT_LZ4_LINKED | BC_OPT_INDEX,
+	    2, 1);
+
+	check(file, HOW_RESERVE, BC_COMP_NONE, 0, 0, 0);
+	check(file, HOW_RESERVE, BC_COMP_NONE, 0, 0, 1);
+	check(file, HOW_RESERVE, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 2, 0);
+	check(file, HOW_RESERVE, BC_COMP_LZ4, BC_OPT_MULTI_PRODUCER, 0, 1);
+#ifdef _WITH_ZLIB
+	check(file, HOW_RESERVE, BC_COMP_ZLIB, 0, 2, 0);
+#endif
+
+	check(file, HOW_WRITEV, BC_COMP_NONE, 0, 0, 0);
+	check(file, HOW_WRITEV, BC_COMP_LZ4, 0, 0, 1);
+	check(file, HOW_WRITEV, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 2, 0);
+	check(file, HOW_WRITEV, BC_COMP_NONE, BC_OPT_MULTI_PRODUCER, 0, 1);
+	check(file, HOW_WRITEV, BC_COMP_LZ4, BC_OPT_FRAMED, 2, 0);
+#ifdef _WITH_ZLIB
+	check(file, HOW_WRITEV, BC_COMP_ZLIB, 0, 0, 0);
+#endif
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "buffer_cache.h"
+
+/*
+ * Writes a stream of 64-bit words, each holding its own index, with
+ * BC_OPT_INDEX and a key per record, and seeks around in it with one
+ * reader: to buffer starts, into the middle of buffers, backwards, to the
+ * end, and by key. Whatever follows each seek has to be the stream from
+ * there on.
+ */
+
+#define BUF_MB		1
+#define REC_SZ		4096
+#define REC_CNT		6000
+#define CHECK_SZ	(64 * 1024)
+
+static
+void
+fill(uint64_t *p, uint64_t off, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len / 8; i++)
+		p[i] = off / 8 + i;
+}
+
+/* Reads up to CHECK_SZ bytes and checks they are the stream from off */
+static
+void
+check_at(struct buffer_cache_reader *rd, uint64_t off)
+{
+	static uint64_t buf[CHECK_SZ / 8], exp[CHECK_SZ / 8];
+	uint64_t total = (uint64_t)REC_CNT * REC_SZ;
+	size_t len = CHECK_SZ;
+	ssize_t ssz;
+
+	if (total - off < len)
+		len = (size_t)(total - off);
+
+	ssz = buffer_cache_reader_read(rd, buf, CHECK_SZ);
+	assert (ssz == (ssize_t)len);
+
+	fill(exp, off, len);
+	assert (memcmp(buf, exp, len) == 0);
+}
+
+static
+void
+check(const char *file, int compress, int flags, size_t comp_workers)
+{
+	static uint64_t rec[REC_SZ / 8];
+	uint64_t total = (uint64_t)REC_CNT * REC_SZ, buf_sz = BUF_MB << 20;
+	uint64_t off, first, key;
+	struct buffer_cache_opts opts;
+	struct buffer_cache_ctx *bc;
+	struct buffer_cache_reader *rd;
+	ssize_t ssz;
+	size_t i;
+	int r;
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.flags = flags | BC_OPT_INDEX;
+	opts.comp_workers = comp_workers;
+	opts.buffer_size_mb = BUF_MB;
+
+	bc = buffer_cache_init_opts(file, &opts);
+	assert (bc != NULL);
+
+	for (i = 0; i < REC_CNT; i++) {
+		r = buffer_cache_set_key(bc, i);
+		assert (r == 0);
+		fill(rec, (uint64_t)i * REC_SZ, REC_SZ);
+		r = buffer_cache_write(bc, rec, REC_SZ);
+		assert (r == 0);
+	}
+
+	r = buffer_cache_destroy(bc);
+	assert (r == 0);
+
+	rd = buffer_cache_reader_open(file, 2);
+	assert (rd != NULL);
+
+	/* Buffer starts and the middle of buffers, from the end backwards */
+	for (off = total / buf_sz * buf_sz; ; off -= buf_sz) {
+		if (off < total) {
+			r = buffer_cache_reader_seek(rd, off);
+			assert (r == 0);
+			check_at(rd, off);
+		}
+		if (off + 12344 < total) {
+			r = buffer_cache_reader_seek(rd, off + 12344);
+			assert (r == 0);
+			check_at(rd, off + 12344);
+		}
+		if (off == 0)
+			break;
+	}
+
+	/* Just short of the end, and the end itself */
+	r = buffer_cache_reader_seek(rd, total - 8);
+	assert (r == 0);
+	check_at(rd, total - 8);
+
+	r = buffer_cache_reader_seek(rd, total);
+	assert (r == 0);
+	ssz = buffer_cache_reader_read(rd, rec, 1);
+	assert (ssz == 0);
+
+	/*
+	 * By key: the data has to start no later than the record with the
+	 * key, and (one producer, so no skew) within a buffer before it.
+	 */
+	for (key = 0; key < REC_CNT; key += 777) {
+		r = buffer_cache_reader_seek_key(rd, key);
+		assert (r == 0);
+
+		ssz = buffer_cache_reader_read(rd, &first, 8);
+		assert (ssz == 8);
+		off = first * 8;
+		assert (off <= key * REC_SZ && off + buf_sz > key * REC_SZ);
+		check_at(rd, off + 8);
+	}
+
+	buffer_cache_reader_close(rd);
+
+	printf("codec %d, flags %#x, workers %zu: ok\n", compress, flags,
+	    comp_workers);
+
+	unlink(file);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *file = "seek_test.trace";
+
+	if (argc > 1)
+		file = argv[1];
+
+	check(file, BC_COMP_LZ4, 0, 0);
+	check(file, BC_COMP_LZ4, 0, 2);
+	check(file, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 0);
+	check(file, BC_COMP_LZ4, BC_OPT_LZ4_LINKED, 2);
+#ifdef _WITH_ZLIB
+	check(file, BC_COMP_ZLIB, 0, 0);
+	check(file, BC_COMP_ZLIB, 0, 2);
+#endif
+#ifdef _WITH_ZSTD
+	check(file, BC_COMP_ZSTD, 0, 0);
+#endif
+
+	return 0;
+}
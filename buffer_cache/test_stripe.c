@@ -0,0 +1,182 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "buffer_cache.h"
+
+/*
+ * Has a few producers write framed records over three stripes, reads the
+ * manifest back, and checks that each producer's records come back, all
+ * of them and in the order it wrote them. Then seeks into the striped
+ * data and checks that what follows is what reading it through gave.
+ */
+
+#define STRIPE_CNT	3
+#define THREAD_CNT	4
+#define REC_CNT		100000
+#define REC_SZ		40
+#define SEEK_SZ		4096
+
+static struct buffer_cache_ctx *bc;
+
+static
+void
+fill(char *p, uint32_t t, uint64_t seq)
+{
+	size_t i;
+
+	memcpy(p, &t, 4);
+	memcpy(p + 4, &seq, 8);
+	for (i = 12; i < REC_SZ; i++)
+		p[i] = 'a' + (char)((t + seq + i) % 26);
+}
+
+static
+void *
+producer(void *arg)
+{
+	uint32_t t = (uint32_t)(intptr_t)arg;
+	char rec[REC_SZ];
+	uint64_t seq;
+	int r;
+
+	for (seq = 0; seq < REC_CNT; seq++) {
+		fill(rec, t, seq);
+		r = buffer_cache_write(bc, rec, REC_SZ);
+		assert (r == 0);
+	}
+
+	return NULL;
+}
+
+static
+void
+check(const char *file, int compress, int flags)
+{
+	struct buffer_cache_opts opts;
+	struct buffer_cache_reader *rd;
+	const char *stripes[STRIPE_CNT];
+	char names[STRIPE_CNT][256], exp[REC_SZ];
+	uint64_t next[THREAD_CNT], seq;
+	/* Frames of REC_SZ have a 1 byte varint and the CRC */
+	size_t total = (size_t)THREAD_CNT * REC_CNT * (1 + REC_SZ + 4);
+	size_t step = total / 7 + 12345;
+	static unsigned char buf[SEEK_SZ];
+	unsigned char *all;
+	const void *data;
+	pthread_t thr[THREAD_CNT];
+	struct stat st;
+	uint32_t t;
+	size_t i, len, off;
+	ssize_t ssz;
+	int r;
+
+	for (i = 0; i < STRIPE_CNT; i++) {
+		snprintf(names[i], sizeof(names[i]), "%s.%zu", file, i);
+		stripes[i] = names[i];
+	}
+
+	buffer_cache_opts_init(&opts);
+	opts.compress = compress;
+	opts.flags = flags | BC_OPT_MULTI_PRODUCER | BC_OPT_FRAMED;
+	opts.buffer_size_mb = 1;
+	opts.buffer_cnt = 16;
+	opts.stripe_files = stripes;
+	opts.stripe_cnt = STRIPE_CNT;
+
+	bc = buffer_cache_init_opts(file, &opts);
+	assert (bc != NULL);
+
+	for (t = 0; t < THREAD_CNT; t++) {
+		r = pthread_create(&thr[t], NULL, producer, (void *)(intptr_t)t);
+		assert (r == 0);
+	}
+	for (t = 0; t < THREAD_CNT; t++)
+		pthread_join(thr[t], NULL);
+
+	r = buffer_cache_destroy(bc);
+	assert (r == 0);
+
+	/* Taking turns, every stripe gets its share */
+	for (i = 0; i < STRIPE_CNT; i++) {
+		r = stat(names[i], &st);
+		assert (r == 0 && st.st_size > 0);
+	}
+
+	/* Each producer's records in its own order, interleaved any which way */
+	rd = buffer_cache_reader_open(file, 2);
+	assert (rd != NULL);
+
+	memset(next, 0, sizeof(next));
+	while ((r = buffer_cache_reader_record(rd, &data, &len)) > 0) {
+		assert (len == REC_SZ);
+		memcpy(&t, data, 4);
+		memcpy(&seq, (const char *)data + 4, 8);
+		assert (t < THREAD_CNT && seq == next[t]);
+		fill(exp, t, seq);
+		assert (memcmp(data, exp, REC_SZ) == 0);
+		++next[t];
+	}
+	assert (r == 0);
+	for (t = 0; t < THREAD_CNT; t++)
+		assert (next[t] == REC_CNT);
+
+	buffer_cache_reader_close(rd);
+
+	/* Seeking needs the index with compression; backwards, from the end */
+	if (compress == BC_COMP_NONE || (flags & BC_OPT_INDEX)) {
+		all = malloc(total + 1);
+		assert (all != NULL);
+
+		rd = buffer_cache_reader_open(file, 2);
+		assert (rd != NULL);
+		ssz = buffer_cache_reader_read(rd, all, total + 1);
+		assert (ssz == (ssize_t)total);
+
+		for (off = total; ; off -= (off < step) ? off : step) {
+			r = buffer_cache_reader_seek(rd, off);
+			assert (r == 0);
+			len = (total - off < SEEK_SZ) ? total - off : SEEK_SZ;
+			ssz = buffer_cache_reader_read(rd, buf, SEEK_SZ);
+			assert (ssz == (ssize_t)len);
+			assert (memcmp(buf, all + off, len) == 0);
+			if (off == 0)
+				break;
+		}
+
+		buffer_cache_reader_close(rd);
+		free(all);
+	} else {
+		rd = buffer_cache_reader_open(file, 2);
+		assert (rd != NULL);
+		r = buffer_cache_reader_seek(rd, total / 2);
+		assert (r == -1);
+		buffer_cache_reader_close(rd);
+	}
+
+	printf("codec %d, flags %#x, %d stripes: ok\n", compress, flags,
+	    STRIPE_CNT);
+
+	unlink(file);
+	for (i = 0; i < STRIPE_CNT; i++)
+		unlink(names[i]);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *file = "stripe_test.trace";
+
+	if (argc > 1)
+		file = argv[1];
+
+	check(file, BC_COMP_NONE, 0);
+	check(file, BC_COMP_LZ4, 0);
+	check(file, BC_COMP_LZ4, BC_OPT_INDEX);
+
+	return 0;
+}